@@ -0,0 +1,208 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bsearch.h"
+#include "btree.h"
+#include "hashmap.h"
+
+/**
+ * 有序数组查找: bsearch_get(cmpfunc) 对比 bsearch_index 单个查找和批量查找, 记录和hrpc_connection一样是80字节:
+ *   ./bench_bsearch [元素数量列表]
+ *   ./bench_bsearch 100,10000,1000000
+ */
+
+#define k_bench_max 1000000
+#define k_bench_queries 4000000
+#define k_bench_array_fill_max 100000    // 数组乱序插入是O(n^2), 更大的只测btree
+
+struct bench_conn {
+    int nid;
+    char pad[76];
+};
+
+struct bench_conn64 {
+    long long id;
+    char pad[72];
+};
+
+static struct bench_conn conns[k_bench_max + 1];
+static int conns_count_;
+static struct bench_conn64 conns64[k_bench_max + 1];
+static int conns64_count_;
+static long long queries[k_bench_queries];
+static int results[k_bench_queries];
+
+static long long time_curruent_ns_() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static unsigned long long bench_rand_state_;
+
+static unsigned long long bench_rand_() {    // splitmix64
+    unsigned long long z = (bench_rand_state_ += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static void bench_report_(const char* impl, const char* workload, int count, long long ops, long long cost_ns, long long check) {
+    printf("{\"bench\":\"bsearch\",\"impl\":\"%s\",\"workload\":\"%s\",\"count\":%d,\"ops\":%lld,\"ns_per_op\":%.2f,\"ops_per_sec\":%.0f,\"check\":%lld}\n",
+           impl, workload, count, ops, (double)cost_ns / (ops ? ops : 1), ops * 1e9 / (cost_ns ? cost_ns : 1), check);
+    fflush(stdout);
+}
+
+#define bench_run_(impl, workload, count, ops, ...)                                     \
+    do {                                                                               \
+        long long check = 0;                                                           \
+        long long start = time_curruent_ns_();                                         \
+        __VA_ARGS__;                                                                   \
+        bench_report_(impl, workload, count, ops, time_curruent_ns_() - start, check); \
+    } while (0)
+
+// key是偶数, 查询一半命中一半不命中
+static void bench_int_(int count) {
+    conns_count_ = count;
+    for (int i = 0; i < count; i++) {
+        conns[i].nid = i * 2;
+    }
+    int ops = k_bench_queries;
+    for (int i = 0; i < ops; i++) {
+        queries[i] = bench_rand_() % (count * 2);
+    }
+    struct bsearch_index index = {0};
+    bench_run_("bsearch_get", "int", count, ops, {
+        for (int i = 0; i < ops; i++) {
+            int nid = queries[i];
+            check += bsearch_get(conns, cmp_int, &nid) != 0;
+        }
+    });
+    bench_run_("bsearch_index", "int_build", count, count, {
+        bsearch_index_update(&index, conns, nid);
+    });
+    bench_run_("bsearch_index", "int", count, ops, {
+        for (int i = 0; i < ops; i++) {
+            check += bsearch_index_get(&index, conns, queries[i]) != 0;
+        }
+    });
+    bench_run_("bsearch_index", "int_batch", count, ops, {
+        bsearch_index_find_batch(&index, queries, ops, results);
+        for (int i = 0; i < ops; i++) {
+            check += results[i] >= 0;
+        }
+    });
+    bsearch_index_free(&index);
+}
+
+static void bench_int64_(int count) {
+    conns64_count_ = count;
+    for (int i = 0; i < count; i++) {
+        conns64[i].id = i * 2 + (1LL << 40);
+    }
+    int ops = k_bench_queries;
+    for (int i = 0; i < ops; i++) {
+        queries[i] = bench_rand_() % (count * 2) + (1LL << 40);
+    }
+    struct bsearch_index index = {0};
+    bench_run_("bsearch_get", "int64", count, ops, {
+        for (int i = 0; i < ops; i++) {
+            check += bsearch_get(conns64, cmp_int64, &queries[i]) != 0;
+        }
+    });
+    bsearch_index_update(&index, conns64, id);
+    bench_run_("bsearch_index", "int64", count, ops, {
+        for (int i = 0; i < ops; i++) {
+            check += bsearch_index_get(&index, conns64, queries[i]) != 0;
+        }
+    });
+    bench_run_("bsearch_index", "int64_batch", count, ops, {
+        bsearch_index_find_batch(&index, queries, ops, results);
+        for (int i = 0; i < ops; i++) {
+            check += results[i] >= 0;
+        }
+    });
+    bsearch_index_free(&index);
+}
+
+static int bench_deleted_(const void* val, void* ud) {
+    (void)ud;
+    return ((const struct bench_conn*)val)->nid % 2;
+}
+
+// 乱序插入/查找/删除, 有序数组每次都要memmove后半部分
+static void bench_sorted_(int count) {
+    for (int i = 0; i < count; i++) {
+        queries[i] = i;
+    }
+    for (int i = count - 1; i > 0; i--) {
+        int j = bench_rand_() % (i + 1);
+        long long t = queries[i];
+        queries[i] = queries[j];
+        queries[j] = t;
+    }
+    struct bench_conn tmp = {0};
+    if (count <= k_bench_array_fill_max) {
+        conns_count_ = 0;
+        bench_run_("bsearch_array", "put_random", count, count, {
+            for (int i = 0; i < count; i++) {
+                tmp.nid = queries[i];
+                check += bsearch_put(conns, cmp_int, &tmp) >= 0;
+            }
+        });
+        bench_run_("bsearch_array", "del_random", count, count, {
+            for (int i = 0; i < count; i++) {
+                int nid = queries[count - 1 - i];
+                check += bsearch_del(conns, cmp_int, &nid) >= 0;
+            }
+        });
+    }
+    struct btree* tree = btree_create(sizeof(struct bench_conn), cmp_int);
+    bench_run_("btree", "put_random", count, count, {
+        for (int i = 0; i < count; i++) {
+            tmp.nid = queries[i];
+            check += btree_put(tree, &tmp) != 0;
+        }
+    });
+    bench_run_("btree", "get", count, count, {
+        for (int i = 0; i < count; i++) {
+            int nid = queries[i];
+            check += btree_get(tree, &nid) != 0;
+        }
+    });
+    bench_run_("btree", "iterate", count, count, {
+        btree_foreach(struct bench_conn*, c, tree) {
+            check += c->nid;
+        }
+    });
+    bench_run_("btree", "compact_half", count, count, {
+        check += btree_compact(tree, bench_deleted_, 0);
+    });
+    bench_run_("btree", "del_random", count, count, {
+        for (int i = 0; i < count; i++) {
+            int nid = queries[count - 1 - i];
+            check += btree_del(tree, &nid);
+        }
+    });
+    btree_free(tree);
+}
+
+int main(int argc, char** argv) {
+    char list[256] = "100,10000,1000000";
+    if (argc > 1) {
+        snprintf(list, sizeof(list), "%s", argv[1]);
+    }
+    for (char* p = strtok(list, ","); p; p = strtok(0, ",")) {
+        int count = atoi(p);
+        if (count <= 0 || count > k_bench_max) {
+            continue;
+        }
+        bench_rand_state_ = 0x5eed;
+        bench_int_(count);
+        bench_int64_(count);
+        bench_sorted_(count);
+    }
+    return 0;
+}
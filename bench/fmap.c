@@ -0,0 +1,554 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fmap.h"
+
+static long long time_curruent_us() {
+    long long now;
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    now = tv.tv_sec;
+    now = now * 1000000;
+    now += tv.tv_usec;
+    return now;
+}
+
+static void bench_clean_(const char* fpath) {
+    char path[1024];
+    for (int i = 1; i < fmap_max_files; i++) {
+        snprintf(path, sizeof(path), "%s.%d", fpath, i);
+        unlink(path);
+    }
+    snprintf(path, sizeof(path), "%s.hash", fpath);
+    unlink(path);
+}
+
+// 随机精确查找: 跳表 vs hash索引
+static void bench_get_(const char* fpath, int count) {
+    bench_clean_(fpath);
+    struct fmap* mp = fmap_mount(fpath);
+    char key[64];
+    for (int i = 0; i < count; i++) {
+        snprintf(key, sizeof(key), "/bench/%d", i);
+        fmap_add(mp, key, &i, sizeof(i));
+    }
+    fmap_unmount(mp);
+
+    for (int hash = 0; hash < 2; hash++) {
+        long long start = time_curruent_us();
+        mp = fmap_mount_ex(fpath, hash ? k_fmap_mount_hash : 0);
+        long long mount = time_curruent_us() - start;
+        srand(1);
+        int miss = 0;
+        start = time_curruent_us();
+        for (int i = 0; i < count; i++) {
+            snprintf(key, sizeof(key), "/bench/%d", rand() % count);
+            if (!fmap_get(mp, key)) {
+                miss++;
+            }
+        }
+        long long cost = time_curruent_us() - start;
+        printf("get %-8s count=%d mount=%lldms cost=%lldms %.0f op/s miss=%d\n", hash ? "hash" : "skiplist", count, mount / 1000, cost / 1000, count * 1e6 / (cost ? cost : 1), miss);
+        fmap_unmount(mp);
+    }
+    bench_clean_(fpath);
+}
+
+struct bench_load_ctx_ {
+    int i;
+    int count;
+    char key[64];
+};
+
+static int bench_load_next_(void* ud, struct fmap_kv* kv) {
+    struct bench_load_ctx_* ctx = ud;
+    if (ctx->i >= ctx->count) {
+        return 0;
+    }
+    snprintf(ctx->key, sizeof(ctx->key), "/bench/%010d", ctx->i);
+    kv->key = ctx->key;
+    kv->val = &ctx->i;
+    kv->size = sizeof(ctx->i);
+    ctx->i++;
+    return 1;
+}
+
+// 初始灌数据: 逐个fmap_add vs 有序导入 vs 无序批量
+static void bench_load_(const char* fpath, int count) {
+    char key[64];
+    bench_clean_(fpath);
+    struct fmap* mp = fmap_mount(fpath);
+    long long start = time_curruent_us();
+    for (int i = 0; i < count; i++) {
+        snprintf(key, sizeof(key), "/bench/%010d", i);
+        fmap_add(mp, key, &i, sizeof(i));
+    }
+    long long cost = time_curruent_us() - start;
+    printf("load %-8s count=%d cost=%lldms %.0f op/s\n", "add", count, cost / 1000, count * 1e6 / (cost ? cost : 1));
+    fmap_unmount(mp);
+
+    bench_clean_(fpath);
+    mp = fmap_mount(fpath);
+    struct bench_load_ctx_ ctx = {.i = 0, .count = count};
+    start = time_curruent_us();
+    fmap_bulk_load(mp, bench_load_next_, &ctx);
+    cost = time_curruent_us() - start;
+    printf("load %-8s count=%d cost=%lldms %.0f op/s\n", "bulk", count, cost / 1000, count * 1e6 / (cost ? cost : 1));
+    fmap_unmount(mp);
+
+    bench_clean_(fpath);
+    mp = fmap_mount(fpath);
+    struct fmap_kv* kvs = malloc(sizeof(struct fmap_kv) * count);
+    char(*keys)[32] = malloc(32 * (long long)count);
+    for (int i = 0; i < count; i++) {
+        snprintf(keys[i], sizeof(keys[i]), "/bench/%010d", i);
+    }
+    srand(1);
+    for (int i = 0; i < count; i++) {
+        int j = rand() % (i + 1);
+        kvs[i] = kvs[j];
+        kvs[j].key = keys[i];
+        kvs[j].val = 0;
+        kvs[j].size = sizeof(int);
+    }
+    start = time_curruent_us();
+    fmap_put_batch(mp, kvs, count / 2);    // 空map走有序导入
+    fmap_put_batch(mp, kvs + count / 2, count - count / 2);    // 归并进已有数据
+    cost = time_curruent_us() - start;
+    printf("load %-8s count=%d cost=%lldms %.0f op/s\n", "batch", count, cost / 1000, count * 1e6 / (cost ? cost : 1));
+    fmap_unmount(mp);
+    free(keys);
+    free(kvs);
+    bench_clean_(fpath);
+}
+
+struct bench_reader_ {
+    pthread_t thread;
+    struct fmap* mp;
+    int count;
+    int seed;
+    volatile int* stop;
+    long long reads;
+};
+
+static void* bench_reader_run_(void* arg) {
+    struct bench_reader_* r = arg;
+    char key[64];
+    unsigned int seed = r->seed;
+    while (!*r->stop) {
+        int slot = fmap_read_begin(r->mp);
+        for (int i = 0; i < 64; i++) {
+            snprintf(key, sizeof(key), "/bench/%d", rand_r(&seed) % r->count);
+            fmap_get(r->mp, key);
+        }
+        fmap_read_end(r->mp, slot);
+        r->reads += 64;
+    }
+    return 0;
+}
+
+// 并发读: 写线程持续删除/插入, 多个读线程无锁查找
+static void bench_read_scaling_(const char* fpath, int count) {
+    bench_clean_(fpath);
+    struct fmap* mp = fmap_mount_ex(fpath, k_fmap_mount_concurrent);
+    char key[64];
+    for (int i = 0; i < count; i++) {
+        snprintf(key, sizeof(key), "/bench/%d", i);
+        fmap_add(mp, key, &i, sizeof(i));
+    }
+    for (int threads = 1; threads <= 8; threads *= 2) {
+        volatile int stop = 0;
+        struct bench_reader_ readers[8];
+        for (int i = 0; i < threads; i++) {
+            readers[i] = (struct bench_reader_){.mp = mp, .count = count, .seed = i + 1, .stop = &stop, .reads = 0};
+            pthread_create(&readers[i].thread, 0, bench_reader_run_, &readers[i]);
+        }
+        long long writes = 0;
+        long long start = time_curruent_us();
+        while (time_curruent_us() - start < 1000000) {
+            int k = rand() % count;
+            snprintf(key, sizeof(key), "/bench/%d", k);
+            fmap_del(mp, key);
+            fmap_add(mp, key, &k, sizeof(k));
+            writes++;
+        }
+        stop = 1;
+        long long reads = 0;
+        for (int i = 0; i < threads; i++) {
+            pthread_join(readers[i].thread, 0);
+            reads += readers[i].reads;
+        }
+        long long cost = time_curruent_us() - start;
+        printf("concurrent readers=%d count=%d %.0f read/s %.0f write/s\n", threads, count, reads * 1e6 / cost, writes * 1e6 / cost);
+    }
+    fmap_unmount(mp);
+    bench_clean_(fpath);
+}
+
+/**
+ * 基准套件: 每个(key数量, 值大小)组合跑一遍下面的负载, 每个负载输出一行json, 方便存档对比:
+ *   ./bench_fmap suite [key数量列表] [值大小列表] [操作数] > result.jsonl
+ *   ./bench_fmap suite 10000,100000,1000000,10000000 16,256,4096,65536,1048576
+ * 随机数固定种子, 同一组参数每次生成的key顺序和操作序列都一样
+ */
+
+#define k_bench_max_total (4LL << 30)    // 单个组合key数量*值大小超过这个就跳过
+#define k_bench_scan_len 100
+
+static long long time_curruent_ns_() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static unsigned long long bench_rand_state_;
+
+static void bench_srand_(unsigned long long seed) {
+    bench_rand_state_ = seed * 0x9E3779B97F4A7C15ULL + 1;
+}
+
+static unsigned long long bench_rand_() {    // splitmix64
+    unsigned long long z = (bench_rand_state_ += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// YCSB的zipfian分布(theta=0.99), 再打散避免热点都集中在key空间的开头
+struct bench_zipf_ {
+    long long n;
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+};
+
+static void bench_zipf_init_(struct bench_zipf_* z, long long n) {
+    z->n = n;
+    z->theta = 0.99;
+    double zeta2 = 1 + pow(0.5, z->theta);
+    z->zetan = 0;
+    for (long long i = 1; i <= n; i++) {
+        z->zetan += 1 / pow(i, z->theta);
+    }
+    z->alpha = 1 / (1 - z->theta);
+    z->eta = (1 - pow(2.0 / n, 1 - z->theta)) / (1 - zeta2 / z->zetan);
+}
+
+static long long bench_zipf_next_(struct bench_zipf_* z) {
+    double u = (bench_rand_() >> 11) * (1.0 / (1ULL << 53));
+    double uz = u * z->zetan;
+    long long v;
+    if (uz < 1) {
+        v = 0;
+    } else if (uz < 1 + pow(0.5, z->theta)) {
+        v = 1;
+    } else {
+        v = (long long)(z->n * pow(z->eta * u - z->eta + 1, z->alpha));
+    }
+    unsigned long long h = (unsigned long long)v * 0x9E3779B97F4A7C15ULL;
+    return (h ^ (h >> 29)) % z->n;
+}
+
+// 延迟直方图: 按最高位分段, 每段16格, 相对误差小于6%
+#define k_bench_hist_sub 4
+#define k_bench_hist_size (64 << k_bench_hist_sub)
+
+struct bench_hist_ {
+    long long count;
+    long long max;
+    long long total;
+    long long bucket[k_bench_hist_size];
+};
+
+static inline int bench_hist_index_(long long ns) {
+    if (ns < (1 << k_bench_hist_sub)) {
+        return (int)ns;
+    }
+    int msb = 63 - __builtin_clzll(ns);
+    int shift = msb - k_bench_hist_sub;
+    return ((shift + 1) << k_bench_hist_sub) + (int)((ns >> shift) & ((1 << k_bench_hist_sub) - 1));
+}
+
+static long long bench_hist_value_(int index) {    // 格子的上界
+    if (index < (1 << k_bench_hist_sub)) {
+        return index;
+    }
+    int shift = (index >> k_bench_hist_sub) - 1;
+    long long sub = index & ((1 << k_bench_hist_sub) - 1);
+    return (((1LL << k_bench_hist_sub) + sub + 1) << shift) - 1;
+}
+
+static inline void bench_hist_add_(struct bench_hist_* h, long long ns) {
+    h->bucket[bench_hist_index_(ns)]++;
+    h->count++;
+    h->total += ns;
+    if (ns > h->max) {
+        h->max = ns;
+    }
+}
+
+static long long bench_hist_percentile_(struct bench_hist_* h, double p) {
+    long long need = (long long)ceil(h->count * p);
+    long long seen = 0;
+    for (int i = 0; i < k_bench_hist_size; i++) {
+        seen += h->bucket[i];
+        if (seen >= need && seen) {
+            long long v = bench_hist_value_(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+static long long bench_rss_() {
+    long long pages = 0, rss = 0;
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (f) {
+        if (fscanf(f, "%lld %lld", &pages, &rss) != 2) {
+            rss = 0;
+        }
+        fclose(f);
+        return rss * sysconf(_SC_PAGESIZE);
+    }
+    struct rusage usage;    // 没有proc的系统只能拿到峰值
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss;
+#else
+    return usage.ru_maxrss * 1024LL;
+#endif
+}
+
+static long long bench_disk_bytes_(const char* fpath) {    // 实际占用的磁盘块, 稀疏文件的空洞不算
+    char path[1024];
+    long long total = 0;
+    struct stat st;
+    for (int i = 1; i < fmap_max_files; i++) {
+        snprintf(path, sizeof(path), "%s.%d", fpath, i);
+        if (stat(path, &st) == 0) {
+            total += st.st_blocks * 512LL;
+        }
+    }
+    return total;
+}
+
+struct bench_suite_ {
+    const char* fpath;
+    struct fmap* mp;
+    long long count;
+    int val_size;
+    long long ops;
+    char* val;
+    unsigned int* order;    // 随机插入/删除的顺序
+    struct bench_zipf_ zipf;
+};
+
+static inline void bench_key_(char* key, long long i) {
+    snprintf(key, 64, "/bench/%012lld", i);
+}
+
+static void bench_report_(struct bench_suite_* b, const char* workload, struct bench_hist_* h, long long cost_ns) {
+    struct fmap_stat st;
+    fmap_stat(b->mp, &st);
+    printf("{\"bench\":\"fmap\",\"workload\":\"%s\",\"keys\":%lld,\"val_size\":%d,\"ops\":%lld,\"sec\":%.6f,\"ops_per_sec\":%.0f,"
+           "\"avg_ns\":%lld,\"p50_ns\":%lld,\"p90_ns\":%lld,\"p99_ns\":%lld,\"p999_ns\":%lld,\"max_ns\":%lld,"
+           "\"count\":%d,\"index_bytes\":%lld,\"data_bytes\":%lld,\"disk_bytes\":%lld,\"rss_bytes\":%lld,\"majflt\":%lld}\n",
+           workload, b->count, b->val_size, h->count, cost_ns / 1e9, h->count * 1e9 / (cost_ns ? cost_ns : 1),
+           h->count ? h->total / h->count : 0, bench_hist_percentile_(h, 0.5), bench_hist_percentile_(h, 0.9), bench_hist_percentile_(h, 0.99), bench_hist_percentile_(h, 0.999), h->max,
+           fmap_count(b->mp), st.index_bytes, st.data_bytes, bench_disk_bytes_(b->fpath), bench_rss_(), st.majflt);
+    fflush(stdout);
+}
+
+static void bench_insert_(struct bench_suite_* b, const char* workload, int random) {
+    struct bench_hist_* h = calloc(1, sizeof(struct bench_hist_));
+    char key[64];
+    bench_clean_(b->fpath);
+    b->mp = fmap_mount(b->fpath);
+    long long start = time_curruent_ns_();
+    for (long long i = 0; i < b->count; i++) {
+        bench_key_(key, random ? b->order[i] : i);
+        long long t = time_curruent_ns_();
+        fmap_put(b->mp, key, b->val, b->val_size);
+        bench_hist_add_(h, time_curruent_ns_() - t);
+    }
+    bench_report_(b, workload, h, time_curruent_ns_() - start);
+    free(h);
+}
+
+static void bench_get_uniform_(struct bench_suite_* b) {
+    struct bench_hist_* h = calloc(1, sizeof(struct bench_hist_));
+    char key[64];
+    long long start = time_curruent_ns_();
+    for (long long i = 0; i < b->ops; i++) {
+        bench_key_(key, bench_rand_() % b->count);
+        long long t = time_curruent_ns_();
+        fmap_get(b->mp, key);
+        bench_hist_add_(h, time_curruent_ns_() - t);
+    }
+    bench_report_(b, "get", h, time_curruent_ns_() - start);
+    free(h);
+}
+
+static void bench_scan_(struct bench_suite_* b) {    // get_ge定位后顺序读k_bench_scan_len个, 延迟按整次扫描统计
+    struct bench_hist_* h = calloc(1, sizeof(struct bench_hist_));
+    char key[64];
+    long long ops = b->ops / 10 ? b->ops / 10 : 1;
+    volatile unsigned int sum = 0;
+    long long start = time_curruent_ns_();
+    for (long long i = 0; i < ops; i++) {
+        bench_key_(key, bench_rand_() % b->count);
+        long long t = time_curruent_ns_();
+        struct fmap_index* it = fmap_get_ge(b->mp, key);
+        for (int n = 0; it && n < k_bench_scan_len; n++) {
+            sum += *(unsigned char*)fmap_val(b->mp, it, fmap_val_size(it));
+            it = fmap_nxt(b->mp, it);
+        }
+        bench_hist_add_(h, time_curruent_ns_() - t);
+    }
+    bench_report_(b, "scan", h, time_curruent_ns_() - start);
+    free(h);
+}
+
+// YCSB风格混合负载, read/update/scan/insert按百分比, key按zipfian选
+static void bench_mix_(struct bench_suite_* b, const char* workload, int read, int update, int scan) {
+    struct bench_hist_* h = calloc(1, sizeof(struct bench_hist_));
+    char key[64];
+    long long inserted = b->count;
+    long long start = time_curruent_ns_();
+    for (long long i = 0; i < b->ops; i++) {
+        int r = bench_rand_() % 100;
+        long long t;
+        if (r < read + update + scan) {
+            bench_key_(key, bench_zipf_next_(&b->zipf));
+            t = time_curruent_ns_();
+            if (r < read) {
+                fmap_get(b->mp, key);
+            } else if (r < read + update) {
+                fmap_put(b->mp, key, b->val, b->val_size);
+            } else {
+                struct fmap_index* it = fmap_get_ge(b->mp, key);
+                for (int n = 0; it && n < k_bench_scan_len; n++) {
+                    it = fmap_nxt(b->mp, it);
+                }
+            }
+        } else {
+            bench_key_(key, inserted++);
+            t = time_curruent_ns_();
+            fmap_put(b->mp, key, b->val, b->val_size);
+        }
+        bench_hist_add_(h, time_curruent_ns_() - t);
+    }
+    bench_report_(b, workload, h, time_curruent_ns_() - start);
+    for (char key2[64]; inserted > b->count; inserted--) {    // 删掉新插入的, 后面的负载看到的数据量不变
+        bench_key_(key2, inserted - 1);
+        fmap_del(b->mp, key2);
+    }
+    free(h);
+}
+
+static void bench_del_(struct bench_suite_* b) {
+    struct bench_hist_* h = calloc(1, sizeof(struct bench_hist_));
+    char key[64];
+    long long start = time_curruent_ns_();
+    for (long long i = 0; i < b->count; i++) {
+        bench_key_(key, b->order[i]);
+        long long t = time_curruent_ns_();
+        fmap_del(b->mp, key);
+        bench_hist_add_(h, time_curruent_ns_() - t);
+    }
+    bench_report_(b, "del", h, time_curruent_ns_() - start);
+    free(h);
+}
+
+static void bench_suite_run_(const char* fpath, long long count, int val_size, long long ops) {
+    if (count * val_size > k_bench_max_total) {
+        fprintf(stderr, "skip keys=%lld val_size=%d: more than %lld bytes\n", count, val_size, k_bench_max_total);
+        return;
+    }
+    struct bench_suite_ b = {.fpath = fpath, .count = count, .val_size = val_size, .ops = ops ? ops : (count < 1000000 ? count : 1000000)};
+    b.val = malloc(val_size);
+    memset(b.val, 'v', val_size);
+    b.order = malloc(sizeof(unsigned int) * count);
+    bench_srand_(count * 131 + val_size);
+    for (long long i = 0; i < count; i++) {    // Fisher-Yates
+        long long j = bench_rand_() % (i + 1);
+        b.order[i] = b.order[j];
+        b.order[j] = i;
+    }
+    bench_zipf_init_(&b.zipf, count);
+
+    bench_insert_(&b, "seq_insert", 0);
+    fmap_unmount(b.mp);
+    bench_insert_(&b, "rand_insert", 1);
+    bench_get_uniform_(&b);
+    bench_scan_(&b);
+    bench_mix_(&b, "ycsb_a", 50, 50, 0);
+    bench_mix_(&b, "ycsb_b", 95, 5, 0);
+    bench_mix_(&b, "ycsb_c", 100, 0, 0);
+    bench_mix_(&b, "ycsb_e", 0, 0, 95);
+    bench_del_(&b);
+    fmap_unmount(b.mp);
+    bench_clean_(fpath);
+    free(b.order);
+    free(b.val);
+}
+
+static int bench_parse_list_(const char* s, long long* out, int max) {
+    int n = 0;
+    while (*s && n < max) {
+        char* end;
+        long long v = strtoll(s, &end, 10);
+        if (end == s) {
+            break;
+        }
+        if (*end == 'k' || *end == 'K') {
+            v *= 1000;
+            end++;
+        } else if (*end == 'm' || *end == 'M') {
+            v *= 1000000;
+            end++;
+        }
+        out[n++] = v;
+        s = *end == ',' ? end + 1 : end;
+    }
+    return n;
+}
+
+static void bench_suite_(int argc, char const* argv[]) {
+    long long counts[16] = {10000, 100000, 1000000};
+    long long sizes[16] = {16, 256, 4096};
+    int ncount = 3, nsize = 3;
+    if (argc > 2) {
+        ncount = bench_parse_list_(argv[2], counts, 16);
+    }
+    if (argc > 3) {
+        nsize = bench_parse_list_(argv[3], sizes, 16);
+    }
+    long long ops = argc > 4 ? atoll(argv[4]) : 0;
+    for (int c = 0; c < ncount; c++) {
+        for (int s = 0; s < nsize; s++) {
+            bench_suite_run_("./fmap.bin.bench", counts[c], (int)sizes[s], ops);
+        }
+    }
+}
+
+int main(int argc, char const* argv[]) {
+    if (argc > 1 && strcmp(argv[1], "suite") == 0) {
+        bench_suite_(argc, argv);
+        return 0;
+    }
+    int count = argc > 1 ? atoi(argv[1]) : 100000;
+    bench_get_("./fmap.bin.bench", count);
+    bench_load_("./fmap.bin.bench", count);
+    bench_read_scaling_("./fmap.bin.bench", count);
+    return 0;
+}
@@ -0,0 +1,483 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "densemap.h"
+#include "hashmap.h"
+#include "swissmap.h"
+
+/**
+ * hashmap / swissmap / swissmap_define / densemap 对比, key和hrpc的(nid, id)一样, 每个负载输出一行json:
+ *   ./bench_hashmap [元素数量列表]
+ *   ./bench_hashmap 1000,100000,1000000
+ */
+
+struct bench_pack {
+    unsigned long long id;
+    unsigned int nid;
+    unsigned int size;
+};
+
+struct bench_pack_key {
+    unsigned long long id;
+    unsigned int nid;
+};
+
+static int bench_pack_hashcode_(const void* ptr) {    // 和hrpc_pack_hashcode_一样
+    const struct bench_pack* a = ptr;
+    unsigned long long id = a->id << 8;
+    id += a->nid;
+    return id;
+}
+
+static int bench_pack_equal_(const void* a, const void* b) {
+    const struct bench_pack* m = a;
+    const struct bench_pack* n = b;
+    return m->id == n->id && m->nid == n->nid;
+}
+
+static inline unsigned long long bench_key_hash_(struct bench_pack_key k) {
+    return swissmap_mix64((k.id << 8) + k.nid);
+}
+
+static inline int bench_key_equal_(struct bench_pack_key a, struct bench_pack_key b) {
+    return a.id == b.id && a.nid == b.nid;
+}
+
+swissmap_define(bench_packmap, struct bench_pack_key, struct bench_pack*, bench_key_hash_, bench_key_equal_)
+
+static long long time_curruent_ns_() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static unsigned long long bench_rand_state_;
+
+static unsigned long long bench_rand_() {    // splitmix64
+    unsigned long long z = (bench_rand_state_ += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static void bench_report_(const char* impl, const char* workload, int count, long long ops, long long cost_ns, long long check) {
+    printf("{\"bench\":\"hashmap\",\"impl\":\"%s\",\"workload\":\"%s\",\"count\":%d,\"ops\":%lld,\"ns_per_op\":%.2f,\"ops_per_sec\":%.0f,\"check\":%lld}\n",
+           impl, workload, count, ops, (double)cost_ns / (ops ? ops : 1), ops * 1e9 / (cost_ns ? cost_ns : 1), check);
+    fflush(stdout);
+}
+
+// 16个节点, 每个节点的id连续递增, 和hrpc的发送/接收表一样
+static void bench_make_packs_(struct bench_pack* packs, int count) {
+    for (int i = 0; i < count; i++) {
+        packs[i].nid = i % 16 + 1;
+        packs[i].id = i / 16 + 1;
+        packs[i].size = i;
+    }
+}
+
+#define bench_run_(impl, workload, count, ops, ...)                                     \
+    do {                                                                               \
+        long long check = 0;                                                           \
+        long long start = time_curruent_ns_();                                         \
+        __VA_ARGS__;                                                                   \
+        bench_report_(impl, workload, count, ops, time_curruent_ns_() - start, check); \
+    } while (0)
+
+static void bench_hashmap_(struct bench_pack* packs, int* order, int count) {
+    struct hashmap* map = hashmap_create(1000, 0, bench_pack_hashcode_, bench_pack_equal_);
+    struct bench_pack key = {0};
+    bench_run_("hashmap", "add", count, count, {
+        for (int i = 0; i < count; i++) {
+            hashmap_add(map, &packs[i]);
+        }
+    });
+    bench_run_("hashmap", "get_hit", count, count, {
+        for (int i = 0; i < count; i++) {
+            struct bench_pack* p = hashmap_get(map, &packs[order[i]]);
+            check += p->size;
+        }
+    });
+    bench_run_("hashmap", "get_miss", count, count, {
+        for (int i = 0; i < count; i++) {
+            key.nid = 100 + i % 16;
+            key.id = order[i];
+            check += hashmap_get(map, &key) != 0;
+        }
+    });
+    bench_run_("hashmap", "iterate", count, count, {
+        hashmap_foreach(struct bench_pack*, p, map) {
+            check += p->size;
+        }
+    });
+    bench_run_("hashmap", "del", count, count, {
+        for (int i = 0; i < count; i++) {
+            hashmap_del(map, &packs[order[i]]);
+        }
+    });
+    bench_run_("hashmap", "churn", count, count * 4LL, {    // 窗口内收发: 新包加入, 最老的包确认删除
+        int window = count / 4 ? count / 4 : 1;
+        for (int i = 0; i < count * 4; i++) {
+            int j = i % count;
+            if (i >= window) {
+                hashmap_del(map, &packs[(i - window) % count]);
+            }
+            hashmap_add(map, &packs[j]);
+            check += hashmap_get(map, &packs[(i + count - bench_rand_() % window) % count]) != 0;
+        }
+    });
+    hashmap_free(map);
+}
+
+static void bench_swissmap_(struct bench_pack* packs, int* order, int count) {
+    struct swissmap* map = swissmap_create(1000, 0, bench_pack_hashcode_, bench_pack_equal_);
+    struct bench_pack key = {0};
+    bench_run_("swissmap", "add", count, count, {
+        for (int i = 0; i < count; i++) {
+            swissmap_add(map, &packs[i]);
+        }
+    });
+    bench_run_("swissmap", "get_hit", count, count, {
+        for (int i = 0; i < count; i++) {
+            struct bench_pack* p = swissmap_get(map, &packs[order[i]]);
+            check += p->size;
+        }
+    });
+    bench_run_("swissmap", "get_miss", count, count, {
+        for (int i = 0; i < count; i++) {
+            key.nid = 100 + i % 16;
+            key.id = order[i];
+            check += swissmap_get(map, &key) != 0;
+        }
+    });
+    bench_run_("swissmap", "iterate", count, count, {
+        swissmap_foreach(struct bench_pack*, p, map) {
+            check += p->size;
+        }
+    });
+    bench_run_("swissmap", "del", count, count, {
+        for (int i = 0; i < count; i++) {
+            swissmap_del(map, &packs[order[i]]);
+        }
+    });
+    bench_run_("swissmap", "churn", count, count * 4LL, {
+        int window = count / 4 ? count / 4 : 1;
+        for (int i = 0; i < count * 4; i++) {
+            int j = i % count;
+            if (i >= window) {
+                swissmap_del(map, &packs[(i - window) % count]);
+            }
+            swissmap_add(map, &packs[j]);
+            check += swissmap_get(map, &packs[(i + count - bench_rand_() % window) % count]) != 0;
+        }
+    });
+    swissmap_free(map);
+}
+
+static void bench_densemap_(struct bench_pack* packs, int* order, int count) {
+    struct densemap* map = densemap_create(1000, 0, bench_pack_hashcode_, bench_pack_equal_);
+    struct bench_pack key = {0};
+    bench_run_("densemap", "add", count, count, {
+        for (int i = 0; i < count; i++) {
+            densemap_add(map, &packs[i]);
+        }
+    });
+    bench_run_("densemap", "get_hit", count, count, {
+        for (int i = 0; i < count; i++) {
+            struct bench_pack* p = densemap_get(map, &packs[order[i]]);
+            check += p->size;
+        }
+    });
+    bench_run_("densemap", "get_miss", count, count, {
+        for (int i = 0; i < count; i++) {
+            key.nid = 100 + i % 16;
+            key.id = order[i];
+            check += densemap_get(map, &key) != 0;
+        }
+    });
+    bench_run_("densemap", "iterate", count, count, {
+        densemap_foreach(struct bench_pack*, p, map) {
+            check += p->size;
+        }
+    });
+    bench_run_("densemap", "del", count, count, {
+        for (int i = 0; i < count; i++) {
+            densemap_del(map, &packs[order[i]]);
+        }
+    });
+    bench_run_("densemap", "churn", count, count * 4LL, {
+        int window = count / 4 ? count / 4 : 1;
+        for (int i = 0; i < count * 4; i++) {
+            int j = i % count;
+            if (i >= window) {
+                densemap_del(map, &packs[(i - window) % count]);
+            }
+            densemap_add(map, &packs[j]);
+            check += densemap_get(map, &packs[(i + count - bench_rand_() % window) % count]) != 0;
+        }
+    });
+    densemap_free(map);
+}
+
+// map自己持有元素(element_size不为0)时的增删, 每次add都会复制一份元素
+static void bench_owned_(struct bench_pack* packs, int count) {
+    int window = count / 4 ? count / 4 : 1;
+    long long ops = count * 4LL;
+    struct hashmap* hmap = hashmap_create(1000, sizeof(struct bench_pack), bench_pack_hashcode_, bench_pack_equal_);
+    bench_run_("hashmap", "churn_owned", count, ops, {
+        for (int i = 0; i < count * 4; i++) {
+            if (i >= window) {
+                hashmap_del(hmap, &packs[(i - window) % count]);
+            }
+            hashmap_add(hmap, &packs[i % count]);
+        }
+        hashmap_free(hmap);
+    });
+    struct swissmap* smap = swissmap_create(1000, sizeof(struct bench_pack), bench_pack_hashcode_, bench_pack_equal_);
+    bench_run_("swissmap", "churn_owned", count, ops, {
+        for (int i = 0; i < count * 4; i++) {
+            if (i >= window) {
+                swissmap_del(smap, &packs[(i - window) % count]);
+            }
+            swissmap_add(smap, &packs[i % count]);
+        }
+        swissmap_free(smap);
+    });
+    struct densemap* dmap = densemap_create(1000, sizeof(struct bench_pack), bench_pack_hashcode_, bench_pack_equal_);
+    bench_run_("densemap", "churn_owned", count, ops, {
+        for (int i = 0; i < count * 4; i++) {
+            if (i >= window) {
+                densemap_del(dmap, &packs[(i - window) % count]);
+            }
+            densemap_add(dmap, &packs[i % count]);
+        }
+        densemap_free(dmap);
+    });
+    struct hashmap* pmap = hashmap_create(1000, sizeof(struct bench_pack), bench_pack_hashcode_, bench_pack_equal_);
+    bench_run_("hashmap", "put_owned", count, ops, {    // 反复覆盖同一批key
+        for (int i = 0; i < count * 4; i++) {
+            hashmap_put(pmap, &packs[i % window]);
+        }
+        hashmap_free(pmap);
+    });
+}
+
+// 涨到count之后删到只剩10个再遍历, 和hrpc流量高峰过后每次hrpc_once遍历收发表一样
+static void bench_sparse_(struct bench_pack* packs, int count) {
+    int left = count < 10 ? count : 10;
+    long long passes = 1000;
+    struct hashmap* hmap = hashmap_create(1000, 0, bench_pack_hashcode_, bench_pack_equal_);
+    hashmap_shrink(hmap, 0);
+    struct swissmap* smap = swissmap_create(1000, 0, bench_pack_hashcode_, bench_pack_equal_);
+    struct densemap* dmap = densemap_create(1000, 0, bench_pack_hashcode_, bench_pack_equal_);
+    for (int i = 0; i < count; i++) {
+        hashmap_add(hmap, &packs[i]);
+        swissmap_add(smap, &packs[i]);
+        densemap_add(dmap, &packs[i]);
+    }
+    for (int i = left; i < count; i++) {
+        hashmap_del(hmap, &packs[i]);
+        swissmap_del(smap, &packs[i]);
+        densemap_del(dmap, &packs[i]);
+    }
+    bench_run_("hashmap_noshrink", "iterate_sparse", count, passes * left, {
+        for (long long n = 0; n < passes; n++) {
+            hashmap_foreach(struct bench_pack*, p, hmap) {
+                check += p->size;
+            }
+        }
+    });
+    bench_run_("swissmap", "iterate_sparse", count, passes * left, {
+        for (long long n = 0; n < passes; n++) {
+            swissmap_foreach(struct bench_pack*, p, smap) {
+                check += p->size;
+            }
+        }
+    });
+    bench_run_("densemap", "iterate_sparse", count, passes * left, {
+        for (long long n = 0; n < passes; n++) {
+            densemap_foreach(struct bench_pack*, p, dmap) {
+                check += p->size;
+            }
+        }
+    });
+    hashmap_free(hmap);
+    swissmap_free(smap);
+    densemap_free(dmap);
+}
+
+static inline struct bench_pack_key bench_key_of_(struct bench_pack* p) {
+    return (struct bench_pack_key){.id = p->id, .nid = p->nid};
+}
+
+static void bench_packmap_(struct bench_pack* packs, int* order, int count) {
+    struct bench_packmap map;
+    bench_packmap_init(&map, 1000);
+    bench_run_("swissmap_define", "add", count, count, {
+        for (int i = 0; i < count; i++) {
+            *bench_packmap_put(&map, bench_key_of_(&packs[i]), 0) = &packs[i];
+        }
+    });
+    bench_run_("swissmap_define", "get_hit", count, count, {
+        for (int i = 0; i < count; i++) {
+            struct bench_pack** p = bench_packmap_get(&map, bench_key_of_(&packs[order[i]]));
+            check += (*p)->size;
+        }
+    });
+    bench_run_("swissmap_define", "get_miss", count, count, {
+        for (int i = 0; i < count; i++) {
+            struct bench_pack_key key = {.id = order[i], .nid = 100 + i % 16};
+            check += bench_packmap_get(&map, key) != 0;
+        }
+    });
+    bench_run_("swissmap_define", "iterate", count, count, {
+        swissmap_slot_foreach(slot, &map) {
+            check += slot->val->size;
+        }
+    });
+    bench_run_("swissmap_define", "del", count, count, {
+        for (int i = 0; i < count; i++) {
+            bench_packmap_del(&map, bench_key_of_(&packs[order[i]]));
+        }
+    });
+    bench_run_("swissmap_define", "churn", count, count * 4LL, {
+        int window = count / 4 ? count / 4 : 1;
+        for (int i = 0; i < count * 4; i++) {
+            int j = i % count;
+            if (i >= window) {
+                bench_packmap_del(&map, bench_key_of_(&packs[(i - window) % count]));
+            }
+            *bench_packmap_put(&map, bench_key_of_(&packs[j]), 0) = &packs[j];
+            check += bench_packmap_get(&map, bench_key_of_(&packs[(i + count - bench_rand_() % window) % count])) != 0;
+        }
+    });
+    bench_packmap_destroy(&map);
+}
+
+static int bench_cmp_ll_(const void* a, const void* b) {
+    long long x = *(const long long*)a, y = *(const long long*)b;
+    return x < y ? -1 : x > y;
+}
+
+// 锯齿负载: 反复从空涨到count再删到接近空, 和hrpc收发表随流量突发的变化一样, 统计每次操作的延迟分位
+struct bench_sawtooth_ops_ {
+    const char* impl;
+    void* (*create)();
+    void (*add)(void* map, struct bench_pack* p);
+    void (*del)(void* map, struct bench_pack* p);
+    void (*free)(void* map);
+};
+
+static void* bench_hashmap_create_() {
+    return hashmap_create(1000, 0, bench_pack_hashcode_, bench_pack_equal_);
+}
+
+static void* bench_hashmap_noshrink_create_() {
+    struct hashmap* map = hashmap_create(1000, 0, bench_pack_hashcode_, bench_pack_equal_);
+    hashmap_shrink(map, 0);
+    return map;
+}
+
+static void bench_hashmap_add_(void* map, struct bench_pack* p) {
+    hashmap_add(map, p);
+}
+
+static void bench_hashmap_del_(void* map, struct bench_pack* p) {
+    hashmap_del(map, p);
+}
+
+static void bench_hashmap_free_(void* map) {
+    hashmap_free(map);
+}
+
+static void* bench_swissmap_create_() {
+    return swissmap_create(1000, 0, bench_pack_hashcode_, bench_pack_equal_);
+}
+
+static void bench_swissmap_add_(void* map, struct bench_pack* p) {
+    swissmap_add(map, p);
+}
+
+static void bench_swissmap_del_(void* map, struct bench_pack* p) {
+    swissmap_del(map, p);
+}
+
+static void bench_swissmap_free_(void* map) {
+    swissmap_free(map);
+}
+
+static void bench_sawtooth_(struct bench_sawtooth_ops_* ops, struct bench_pack* packs, int count) {
+    int cycles = 4;
+    long long total = (long long)count * 2 * cycles;
+    long long* lat = malloc(sizeof(long long) * total);
+    long long n = 0;
+    void* map = ops->create();
+    long long start = time_curruent_ns_();
+    for (int c = 0; c < cycles; c++) {
+        for (int i = 0; i < count; i++) {
+            long long t = time_curruent_ns_();
+            ops->add(map, &packs[i]);
+            lat[n++] = time_curruent_ns_() - t;
+        }
+        for (int i = 0; i < count; i++) {    // 先进先出, 和确认顺序一样
+            long long t = time_curruent_ns_();
+            ops->del(map, &packs[i]);
+            lat[n++] = time_curruent_ns_() - t;
+        }
+    }
+    long long cost = time_curruent_ns_() - start;
+    ops->free(map);
+    qsort(lat, n, sizeof(long long), bench_cmp_ll_);
+    printf("{\"bench\":\"hashmap\",\"impl\":\"%s\",\"workload\":\"sawtooth\",\"count\":%d,\"ops\":%lld,\"ns_per_op\":%.2f,\"ops_per_sec\":%.0f,"
+           "\"p50_ns\":%lld,\"p99_ns\":%lld,\"p999_ns\":%lld,\"max_ns\":%lld}\n",
+           ops->impl, count, n, (double)cost / n, n * 1e9 / (cost ? cost : 1), lat[n / 2], lat[n * 99 / 100], lat[n * 999 / 1000], lat[n - 1]);
+    fflush(stdout);
+    free(lat);
+}
+
+int main(int argc, char const* argv[]) {
+    int counts[16] = {1000, 100000, 1000000};
+    int ncount = 3;
+    if (argc > 1) {
+        ncount = 0;
+        for (const char* s = argv[1]; *s && ncount < 16;) {
+            char* end;
+            long v = strtol(s, &end, 10);
+            if (end == s) {
+                break;
+            }
+            counts[ncount++] = v;
+            s = *end == ',' ? end + 1 : end;
+        }
+    }
+    for (int c = 0; c < ncount; c++) {
+        int count = counts[c];
+        struct bench_pack* packs = malloc(sizeof(struct bench_pack) * count);
+        int* order = malloc(sizeof(int) * count);
+        bench_make_packs_(packs, count);
+        bench_rand_state_ = count;
+        for (int i = 0; i < count; i++) {
+            int j = bench_rand_() % (i + 1);
+            order[i] = order[j];
+            order[j] = i;
+        }
+        bench_hashmap_(packs, order, count);
+        bench_swissmap_(packs, order, count);
+        bench_packmap_(packs, order, count);
+        bench_densemap_(packs, order, count);
+        bench_sparse_(packs, count);
+        bench_owned_(packs, count);
+        struct bench_sawtooth_ops_ sawtooth[] = {
+            {"hashmap", bench_hashmap_create_, bench_hashmap_add_, bench_hashmap_del_, bench_hashmap_free_},
+            {"hashmap_noshrink", bench_hashmap_noshrink_create_, bench_hashmap_add_, bench_hashmap_del_, bench_hashmap_free_},
+            {"swissmap", bench_swissmap_create_, bench_swissmap_add_, bench_swissmap_del_, bench_swissmap_free_},
+        };
+        for (size_t i = 0; i < sizeof(sawtooth) / sizeof(sawtooth[0]); i++) {
+            bench_sawtooth_(&sawtooth[i], packs, count);
+        }
+        free(order);
+        free(packs);
+    }
+    return 0;
+}
@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lz.h"
+
+/**
+ * hrpc消息压缩: 合成的游戏世界状态快照, 每个(语料, 消息大小)输出一行json:
+ *   ./bench_lz [消息大小列表(KB)]
+ *   ./bench_lz 20,100,500
+ * 语料:
+ *   world_state  实体数组: 连续的id, 少量类型, 坐标在地图上成团, 八成实体静止, 血量大多是满的, 名字和buff来自小字典
+ *   random       不可压缩的数据, 看放弃压缩的代价
+ * 帧数和线上字节按1024字节一帧, 版本2的帧头12字节计算. 丢包时每帧的重传概率一样, 重传量和帧数成正比
+ */
+
+#define k_bench_frame 1024
+#define k_bench_frame_head 12
+#define k_bench_min_ns 200000000LL
+
+struct bench_entity {
+    unsigned int id;
+    unsigned short type;
+    unsigned short flags;
+    float pos[3];
+    float vel[3];
+    unsigned int hp;
+    unsigned int max_hp;
+    unsigned char team;
+    unsigned char level;
+    unsigned short zone;
+    char name[16];
+    unsigned int buffs[4];
+};
+
+static long long time_curruent_ns_() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static unsigned long long bench_rand_state_;
+
+static unsigned long long bench_rand_() {    // splitmix64
+    unsigned long long z = (bench_rand_state_ += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static float bench_randf_(float lo, float hi) {
+    return lo + (hi - lo) * (bench_rand_() >> 40) / (float)(1 << 24);
+}
+
+static void bench_world_state_(char* buff, int size) {
+    static const char* names[] = {"goblin", "orc_warrior", "skeleton", "wolf", "merchant", "guard", "archer", "dragon_whelp"};
+    static const float camps[][2] = {{120, 340}, {800, 95}, {512, 512}, {900, 870}, {60, 700}};
+    int count = size / sizeof(struct bench_entity);
+    struct bench_entity* e = (struct bench_entity*)buff;
+    for (int i = 0; i < count; i++) {
+        memset(&e[i], 0, sizeof(struct bench_entity));
+        int kind = bench_rand_() % 8;
+        const float* camp = camps[bench_rand_() % 5];
+        e[i].id = 100000 + i;
+        e[i].type = kind;
+        e[i].flags = bench_rand_() % 10 == 0 ? 0x4 : 0x1;
+        e[i].pos[0] = camp[0] + bench_randf_(-40, 40);
+        e[i].pos[1] = camp[1] + bench_randf_(-40, 40);
+        e[i].pos[2] = bench_rand_() % 4 == 0 ? bench_randf_(0, 8) : 0;
+        if (bench_rand_() % 5 == 0) {
+            e[i].vel[0] = bench_randf_(-3, 3);
+            e[i].vel[1] = bench_randf_(-3, 3);
+        }
+        e[i].max_hp = 100 * (1 + kind);
+        e[i].hp = bench_rand_() % 4 == 0 ? bench_rand_() % e[i].max_hp : e[i].max_hp;
+        e[i].team = kind < 4 ? 1 : 2;
+        e[i].level = 1 + kind * 5 + bench_rand_() % 3;
+        e[i].zone = 7;
+        snprintf(e[i].name, sizeof(e[i].name), "%s", names[kind]);
+        if (bench_rand_() % 3 == 0) {
+            e[i].buffs[0] = 2001 + bench_rand_() % 6;
+        }
+    }
+    memset(buff + count * sizeof(struct bench_entity), 0, size - count * sizeof(struct bench_entity));
+}
+
+static void bench_random_(char* buff, int size) {
+    for (int i = 0; i < size; i++) {
+        buff[i] = bench_rand_();
+    }
+}
+
+static long long bench_wire_bytes_(int size) {
+    int frames = (size + k_bench_frame - 1) / k_bench_frame;
+    return (long long)frames * k_bench_frame_head + size;
+}
+
+static void bench_corpus_(const char* corpus, void (*gen)(char* buff, int size), int size) {
+    char* src = malloc(size);
+    char* dst = malloc(lz_bound(size));
+    char* out = malloc(size);
+    gen(src, size);
+
+    long long rounds = 0;
+    long long start = time_curruent_ns_();
+    long long cost = 0;
+    int zsize = 0;
+    do {
+        zsize = lz_compress(src, size, dst, size - size / 8);    // 和hrpc一样, 省不到1/8放弃
+        rounds++;
+        cost = time_curruent_ns_() - start;
+    } while (cost < k_bench_min_ns);
+    double compress_mb_s = (double)size * rounds / cost * 1e3;
+
+    double decompress_mb_s = 0;
+    long long check = 0;
+    if (zsize) {
+        rounds = 0;
+        start = time_curruent_ns_();
+        do {
+            check += lz_decompress(dst, zsize, out, size);
+            rounds++;
+            cost = time_curruent_ns_() - start;
+        } while (cost < k_bench_min_ns);
+        decompress_mb_s = (double)size * rounds / cost * 1e3;
+        check = memcmp(src, out, size) == 0;
+    }
+    int wire_size = zsize ? zsize : size;
+    printf("{\"bench\":\"lz\",\"corpus\":\"%s\",\"size\":%d,\"compressed\":%d,\"ratio\":%.2f,\"compress_mb_per_sec\":%.0f,\"decompress_mb_per_sec\":%.0f,"
+           "\"frames_raw\":%d,\"frames_lz\":%d,\"wire_bytes_raw\":%lld,\"wire_bytes_lz\":%lld,\"check\":%lld}\n",
+           corpus, size, zsize, (double)size / wire_size, compress_mb_s, decompress_mb_s,
+           (size + k_bench_frame - 1) / k_bench_frame, (wire_size + k_bench_frame - 1) / k_bench_frame,
+           bench_wire_bytes_(size), bench_wire_bytes_(wire_size), check);
+    fflush(stdout);
+    free(src);
+    free(dst);
+    free(out);
+}
+
+int main(int argc, char** argv) {
+    char list[256] = "20,100,500";
+    if (argc > 1) {
+        snprintf(list, sizeof(list), "%s", argv[1]);
+    }
+    for (char* p = strtok(list, ","); p; p = strtok(0, ",")) {
+        int size = atoi(p) * 1024;
+        if (size <= 0) {
+            continue;
+        }
+        bench_rand_state_ = 42;
+        bench_corpus_("world_state", bench_world_state_, size);
+        bench_rand_state_ = 42;
+        bench_corpus_("random", bench_random_, size);
+    }
+    return 0;
+}
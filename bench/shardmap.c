@@ -0,0 +1,218 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hashmap.h"
+#include "shardmap.h"
+
+/**
+ * 多线程共享表的扩展性: 全局互斥锁包住的hashmap 对比 shardmap, 每个(实现, 负载, 线程数)输出一行json:
+ *   ./bench_shardmap [元素数量] [每个线程的操作数] [线程数列表]
+ *   ./bench_shardmap 100000 1000000 1,2,4,8,16,32
+ * 负载:
+ *   read_mostly  95% get, 5% put
+ *   write_heavy  50% get, 25% put, 25% del
+ */
+
+struct bench_session {
+    unsigned long long id;
+    unsigned int nid;
+    unsigned int route;
+};
+
+static int bench_session_hashcode_(const void* ptr) {
+    const struct bench_session* a = ptr;
+    unsigned long long id = a->id << 8;
+    id += a->nid;
+    return id;
+}
+
+static int bench_session_equal_(const void* a, const void* b) {
+    const struct bench_session* m = a;
+    const struct bench_session* n = b;
+    return m->id == n->id && m->nid == n->nid;
+}
+
+static long long time_curruent_ns_() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static inline unsigned long long bench_rand_(unsigned long long* state) {    // splitmix64, 每个线程自己的状态
+    unsigned long long z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// 两种实现统一成同样的接口, 线程里只通过这几个函数访问
+struct bench_impl {
+    const char* name;
+    void* (*create)(int count);
+    int (*get)(void* map, struct bench_session* key, struct bench_session* out);
+    void (*put)(void* map, struct bench_session* s);
+    void (*del)(void* map, struct bench_session* key);
+    void (*free)(void* map);
+};
+
+struct bench_locked {
+    pthread_mutex_t lock;
+    struct hashmap* map;
+};
+
+static void* bench_locked_create_(int count) {
+    struct bench_locked* self = malloc(sizeof(struct bench_locked));
+    pthread_mutex_init(&self->lock, 0);
+    self->map = hashmap_create(count, sizeof(struct bench_session), bench_session_hashcode_, bench_session_equal_);
+    return self;
+}
+
+static int bench_locked_get_(void* map, struct bench_session* key, struct bench_session* out) {
+    struct bench_locked* self = map;
+    pthread_mutex_lock(&self->lock);
+    struct bench_session* s = hashmap_get(self->map, key);
+    if (s) {
+        *out = *s;
+    }
+    pthread_mutex_unlock(&self->lock);
+    return s != 0;
+}
+
+static void bench_locked_put_(void* map, struct bench_session* s) {
+    struct bench_locked* self = map;
+    pthread_mutex_lock(&self->lock);
+    hashmap_put(self->map, s);
+    pthread_mutex_unlock(&self->lock);
+}
+
+static void bench_locked_del_(void* map, struct bench_session* key) {
+    struct bench_locked* self = map;
+    pthread_mutex_lock(&self->lock);
+    hashmap_del(self->map, key);
+    pthread_mutex_unlock(&self->lock);
+}
+
+static void bench_locked_free_(void* map) {
+    struct bench_locked* self = map;
+    hashmap_free(self->map);
+    pthread_mutex_destroy(&self->lock);
+    free(self);
+}
+
+static void* bench_shardmap_create_(int count) {
+    return shardmap_create(count, sizeof(struct bench_session), bench_session_hashcode_, bench_session_equal_);
+}
+
+static int bench_shardmap_get_(void* map, struct bench_session* key, struct bench_session* out) {
+    return shardmap_get(map, key, out);
+}
+
+static void bench_shardmap_put_(void* map, struct bench_session* s) {
+    shardmap_put(map, s);
+}
+
+static void bench_shardmap_del_(void* map, struct bench_session* key) {
+    shardmap_del(map, key);
+}
+
+static void bench_shardmap_free_(void* map) {
+    shardmap_free(map);
+}
+
+static const struct bench_impl bench_impls_[] = {
+    {"mutex_hashmap", bench_locked_create_, bench_locked_get_, bench_locked_put_, bench_locked_del_, bench_locked_free_},
+    {"shardmap", bench_shardmap_create_, bench_shardmap_get_, bench_shardmap_put_, bench_shardmap_del_, bench_shardmap_free_},
+};
+
+struct bench_worker {
+    const struct bench_impl* impl;
+    void* map;
+    pthread_barrier_t* barrier;
+    int count;
+    int get_percent;    // 剩下的put和del对半
+    int del_percent;
+    long long ops;
+    unsigned long long seed;
+    long long check;
+} __attribute__((aligned(64)));
+
+static void* bench_worker_run_(void* arg) {
+    struct bench_worker* w = arg;
+    unsigned long long state = w->seed;
+    struct bench_session s = {0}, out;
+    pthread_barrier_wait(w->barrier);
+    for (long long i = 0; i < w->ops; i++) {
+        unsigned long long r = bench_rand_(&state);
+        int k = (int)((r >> 8) % w->count);
+        s.nid = k % 16 + 1;
+        s.id = k / 16 + 1;
+        int dice = (int)(r & 0xff) * 100 >> 8;
+        if (dice < w->get_percent) {
+            w->check += w->impl->get(w->map, &s, &out);
+        } else if (dice < 100 - w->del_percent) {
+            s.route = (unsigned int)i;
+            w->impl->put(w->map, &s);
+        } else {
+            w->impl->del(w->map, &s);
+        }
+    }
+    return 0;
+}
+
+static void bench_scale_(const struct bench_impl* impl, const char* workload, int get_percent, int del_percent, int count, long long ops, int threads) {
+    void* map = impl->create(count);
+    struct bench_session s = {0};
+    for (int k = 0; k < count; k++) {
+        s.nid = k % 16 + 1;
+        s.id = k / 16 + 1;
+        impl->put(map, &s);
+    }
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, 0, threads + 1);
+    struct bench_worker* workers = aligned_alloc(64, sizeof(struct bench_worker) * threads);
+    pthread_t* tids = malloc(sizeof(pthread_t) * threads);
+    for (int t = 0; t < threads; t++) {
+        workers[t] = (struct bench_worker){
+            .impl = impl, .map = map, .barrier = &barrier, .count = count, .get_percent = get_percent, .del_percent = del_percent, .ops = ops, .seed = 0x5eed0000ULL + t};
+        pthread_create(&tids[t], 0, bench_worker_run_, &workers[t]);
+    }
+    pthread_barrier_wait(&barrier);
+    long long start = time_curruent_ns_();
+    long long check = 0;
+    for (int t = 0; t < threads; t++) {
+        pthread_join(tids[t], 0);
+        check += workers[t].check;
+    }
+    long long cost_ns = time_curruent_ns_() - start;
+    long long total = ops * threads;
+    printf("{\"bench\":\"shardmap\",\"impl\":\"%s\",\"workload\":\"%s\",\"count\":%d,\"threads\":%d,\"ops\":%lld,\"ns_per_op\":%.2f,\"ops_per_sec\":%.0f,\"check\":%lld}\n",
+           impl->name, workload, count, threads, total, (double)cost_ns / total, total * 1e9 / (cost_ns ? cost_ns : 1), check);
+    fflush(stdout);
+    pthread_barrier_destroy(&barrier);
+    free(workers);
+    free(tids);
+    impl->free(map);
+}
+
+int main(int argc, char** argv) {
+    int count = argc > 1 ? atoi(argv[1]) : 100000;
+    long long ops = argc > 2 ? atoll(argv[2]) : 1000000;
+    char list[256] = "1,2,4,8,16,32";
+    if (argc > 3) {
+        snprintf(list, sizeof(list), "%s", argv[3]);
+    }
+    for (char* p = strtok(list, ","); p; p = strtok(0, ",")) {
+        int threads = atoi(p);
+        if (threads <= 0) {
+            continue;
+        }
+        for (int i = 0; i < (int)(sizeof(bench_impls_) / sizeof(bench_impls_[0])); i++) {
+            bench_scale_(&bench_impls_[i], "read_mostly", 95, 0, count, ops, threads);
+            bench_scale_(&bench_impls_[i], "write_heavy", 50, 25, count, ops, threads);
+        }
+    }
+    return 0;
+}
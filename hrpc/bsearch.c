@@ -1,6 +1,17 @@
 #include "bsearch.h"
 
+#include <limits.h>
 #include <memory.h>
+#include <stdlib.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#endif
+
+#define k_bsearch_node_bytes 64
+#define k_bsearch_batch 16
 
 int _binary_search(const void *array, int count, int element_size, cmpfunc cmp, const void *data) {
     char *arr = (char *)array;
@@ -36,7 +47,7 @@ int _bsearch_put(void *array, int element_size, int *count, int limit, cmpfunc c
         memmove(tar, data, element_size);
         return pos;
     } else {
-        if ((*count) + 1 >= limit) {
+        if ((*count) >= limit) {
             return -1;
         }
         pos = -pos - 1;
@@ -157,4 +168,151 @@ int cmp_2int(const void *a, const void *b) {
         return -1;
     }
     return 0;
-}
\ No newline at end of file
+}
+
+// 第k个节点的第i个子节点, 节点按层序编号
+static inline int bsearch_index_child_(int k, int i, int b) {
+    return k * (b + 1) + i + 1;
+}
+
+// 中序遍历依次填入有序的key
+static void bsearch_index_fill_(struct bsearch_index* self, const char* arr, int element_size, int key_offset, int k, int* t) {
+    int b = k_bsearch_node_bytes / self->key_size;
+    if (k >= self->nodes) {
+        return;
+    }
+    for (int i = 0; i < b; i++) {
+        bsearch_index_fill_(self, arr, element_size, key_offset, bsearch_index_child_(k, i, b), t);
+        int j = k * b + i;
+        int real = *t < self->count;
+        const char* key = arr + (long long)*t * element_size + key_offset;
+        if (self->key_size == 4) {
+            ((int*)self->keys)[j] = real ? *(const int*)key : INT_MAX;
+        } else {
+            ((long long*)self->keys)[j] = real ? *(const long long*)key : LLONG_MAX;
+        }
+        self->pos[j] = real ? (*t)++ : -1;
+    }
+    bsearch_index_fill_(self, arr, element_size, key_offset, bsearch_index_child_(k, b, b), t);
+}
+
+void bsearch_index_build(struct bsearch_index* self, const void* arr, int element_size, int count, int key_offset, int key_size) {
+    int b = k_bsearch_node_bytes / key_size;
+    int nodes = (count + b - 1) / b;
+    if (!self->keys || self->nodes != nodes || self->key_size != key_size) {
+        bsearch_index_free(self);
+        self->keys = aligned_alloc(k_bsearch_node_bytes, (long long)(nodes ? nodes : 1) * k_bsearch_node_bytes);
+        self->pos = malloc(sizeof(int) * (long long)(nodes ? nodes : 1) * b);
+    }
+    self->count = count;
+    self->key_size = key_size;
+    self->nodes = nodes;
+    self->height = 0;
+    for (int k = 0; k < nodes; k = bsearch_index_child_(k, 0, b)) {    // 层序编号, 最左边的路径最深
+        self->height++;
+    }
+    int t = 0;
+    bsearch_index_fill_(self, arr, element_size, key_offset, 0, &t);
+}
+
+void bsearch_index_free(struct bsearch_index* self) {
+    free(self->keys);
+    free(self->pos);
+    memset(self, 0, sizeof(struct bsearch_index));
+}
+
+// 节点内小于x的key个数, 也就是第一个>=x的位置
+static inline __attribute__((always_inline)) int bsearch_rank32_(const int* node, int x) {
+#if defined(__SSE2__)
+    __m128i v = _mm_set1_epi32(x);
+    unsigned int m = 0;
+    for (int i = 0; i < 4; i++) {
+        __m128i lt = _mm_cmpgt_epi32(v, _mm_load_si128((const __m128i*)node + i));
+        m |= (unsigned int)_mm_movemask_ps(_mm_castsi128_ps(lt)) << (i * 4);
+    }
+    return __builtin_popcount(m);
+#else
+    int r = 0;
+    for (int i = 0; i < 16; i++) {
+        r += node[i] < x;
+    }
+    return r;
+#endif
+}
+
+static inline __attribute__((always_inline)) int bsearch_rank64_(const long long* node, long long x) {
+#if defined(__SSE4_2__)
+    __m128i v = _mm_set1_epi64x(x);
+    unsigned int m = 0;
+    for (int i = 0; i < 4; i++) {
+        __m128i lt = _mm_cmpgt_epi64(v, _mm_load_si128((const __m128i*)node + i));
+        m |= (unsigned int)_mm_movemask_pd(_mm_castsi128_pd(lt)) << (i * 2);
+    }
+    return __builtin_popcount(m);
+#else
+    int r = 0;
+    for (int i = 0; i < 8; i++) {
+        r += node[i] < x;
+    }
+    return r;
+#endif
+}
+
+// 下降一层, res记录目前为止第一个>=x的key的位置
+#define bsearch_index_step_(keys, b, rank, k, res, x)   \
+    do {                                               \
+        int _i = rank(keys + (long long)(k) * (b), x); \
+        res = _i < (b) ? (k) * (b) + _i : res;         \
+        k = bsearch_index_child_(k, _i, b);            \
+    } while (0)
+
+int bsearch_index_find(const struct bsearch_index* self, long long key) {
+    int res = -1;
+    if (self->key_size == 4) {
+        const int* keys = self->keys;
+        int x = (int)key;
+        for (int k = 0; k < self->nodes;) {
+            bsearch_index_step_(keys, 16, bsearch_rank32_, k, res, x);
+        }
+        return res >= 0 && keys[res] == x ? self->pos[res] : -1;
+    }
+    const long long* keys = self->keys;
+    for (int k = 0; k < self->nodes;) {
+        bsearch_index_step_(keys, 8, bsearch_rank64_, k, res, key);
+    }
+    return res >= 0 && keys[res] == key ? self->pos[res] : -1;
+}
+
+#define bsearch_index_batch_(self, keys, b, rank, type, qs, n, out)                           \
+    do {                                                                                      \
+        for (int base = 0; base < n; base += k_bsearch_batch) {                               \
+            int m = n - base < k_bsearch_batch ? n - base : k_bsearch_batch;                  \
+            int k[k_bsearch_batch], res[k_bsearch_batch];                                     \
+            for (int j = 0; j < m; j++) {                                                     \
+                k[j] = 0;                                                                     \
+                res[j] = -1;                                                                  \
+            }                                                                                 \
+            for (int h = 0; h < self->height; h++) {                                          \
+                for (int j = 0; j < m; j++) {                                                 \
+                    if (k[j] < self->nodes) {                                                 \
+                        bsearch_index_step_(keys, b, rank, k[j], res[j], (type)qs[base + j]); \
+                        __builtin_prefetch(keys + (long long)k[j] * (b));                     \
+                    }                                                                         \
+                }                                                                             \
+            }                                                                                 \
+            for (int j = 0; j < m; j++) {                                                     \
+                int r = res[j];                                                               \
+                out[base + j] = r >= 0 && keys[r] == (type)qs[base + j] ? self->pos[r] : -1;  \
+            }                                                                                 \
+        }                                                                                     \
+    } while (0)
+
+void bsearch_index_find_batch(const struct bsearch_index* self, const long long* qs, int n, int* out) {
+    if (self->key_size == 4) {
+        const int* keys = self->keys;
+        bsearch_index_batch_(self, keys, 16, bsearch_rank32_, int, qs, n, out);
+    } else {
+        const long long* keys = self->keys;
+        bsearch_index_batch_(self, keys, 8, bsearch_rank64_, long long, qs, n, out);
+    }
+}
@@ -7,7 +7,7 @@ typedef int (*cmpfunc)(const void *, const void *);
 int _binary_search(const void *array, int count, int element_size, cmpfunc cmp, const void *data);
 void *_bsearch_get(const void *arr, int element_size, int count, cmpfunc cmp, const void *index);
 int _bsearch_get_pos(const void *arr, int element_size, int count, cmpfunc cmp, const void *index);    // 返回值小于0表示没有找到， 特殊用法：pos = -pos - 1 表示可以插入的位置，常用于获取遍历的起始位置
-int _bsearch_put(void *arr, int element_size, int *count, int limit, cmpfunc cmp, void *data);
+int _bsearch_put(void *arr, int element_size, int *count, int limit, cmpfunc cmp, void *data);    // 数组已满(count == limit)返回-1, 需要能增长的用btree
 int _bsearch_del(void *arr, int element_size, int *count, cmpfunc cmp, const void *index);
 int _bsearch_del_pos(void *array, int element_size, int *count, int pos);
 
@@ -41,4 +41,37 @@ int cmp_2int(const void *a, const void *b);
 #define bsearch_get(arr, cmp, index) (typeof(arr[0]) *)_bsearch_get(arr, sizeof(arr[0]), _concat(arr, _count_), cmp, index)
 #define bsearch_get_pos(arr, cmp, index) _bsearch_get_pos(arr, sizeof(arr[0]), _concat(arr, _count_), cmp, index)
 #define bsearch_del(arr, cmp, index) _bsearch_del(arr, sizeof(arr[0]), &_concat(arr, _count_), cmp, index)
-#define bsearch_del_pos(arr, pos) _bsearch_del_pos(arr, sizeof(arr[0]), &_concat(arr, _count_), pos)
\ No newline at end of file
+#define bsearch_del_pos(arr, pos) _bsearch_del_pos(arr, sizeof(arr[0]), &_concat(arr, _count_), pos)
+
+/**
+ * 有序数组的只读查找索引: key单独拷贝出来, 按静态B树的顺序排列, 每个节点正好一个缓存行(16个int或者8个int64)
+ *   - 每层只读一个缓存行, 节点内用SIMD一次比较完, 不调用cmpfunc, 没有分支
+ *   - 数组增删之后必须重新 bsearch_index_update, 索引里记的是数组下标
+ *   - key必须是int或者long long字段
+ *   bsearch_index_update(&index, arr, nid);
+ *   struct item* p = bsearch_index_get(&index, arr, nid);
+ */
+struct bsearch_index {
+    int count;
+    int key_size;    // 4或者8
+    int nodes;
+    int height;
+    void* keys;    // nodes个节点, 不足的位置填最大值
+    int* pos;    // 和keys一一对应, 在原数组里的下标, 填充位置是-1
+};
+
+void bsearch_index_build(struct bsearch_index* self, const void* arr, int element_size, int count, int key_offset, int key_size);
+void bsearch_index_free(struct bsearch_index* self);
+
+/**
+ * 返回原数组下标, 没有找到返回-1
+ */
+int bsearch_index_find(const struct bsearch_index* self, long long key);
+
+/**
+ * 一次查找多个key, 多个查找交错进行, 每层预取下一层的节点, 访存延迟互相重叠
+ */
+void bsearch_index_find_batch(const struct bsearch_index* self, const long long* keys, int n, int* out);
+
+#define bsearch_index_update(index, arr, field) bsearch_index_build(index, arr, sizeof(arr[0]), _concat(arr, _count_), (int)((char*)&arr[0].field - (char*)&arr[0]), sizeof(arr[0].field))
+#define bsearch_index_get(index, arr, key) ({ int _concat(_p, __LINE__) = bsearch_index_find(index, key); _concat(_p, __LINE__) < 0 ? (typeof(arr[0])*)0 : &arr[_concat(_p, __LINE__)]; })
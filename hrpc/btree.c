@@ -0,0 +1,297 @@
+#include "btree.h"
+
+#include <memory.h>
+#include <stdlib.h>
+
+#define k_btree_node_bytes 2048
+#define k_btree_min_cap 4
+#define k_btree_max_depth 32
+
+struct btree_node {
+    int leaf;
+    int count;    // 叶子: 元素个数. 内部节点: 子节点个数, key比子节点少一个
+    struct btree_node* next;    // 叶子链表
+    char data[];    // 叶子: 元素. 内部节点: 子节点指针, 后面跟着key
+};
+
+struct btree {
+    int element_size;
+    int leaf_cap;
+    int fanout;
+    int count;
+    int leaves;
+    cmpfunc cmp;
+    struct btree_node* root;
+    struct btree_node* first;
+};
+
+static inline char* btree_elem_(struct btree* self, struct btree_node* leaf, int i) {
+    return leaf->data + (long long)i * self->element_size;
+}
+
+static inline struct btree_node** btree_children_(struct btree_node* node) {
+    return (struct btree_node**)node->data;
+}
+
+// 子节点i的左边界是key[i-1]: 子树里的元素都大于等于它
+static inline char* btree_key_(struct btree* self, struct btree_node* node, int i) {
+    return node->data + sizeof(struct btree_node*) * self->fanout + (long long)i * self->element_size;
+}
+
+static struct btree_node* btree_node_new_(struct btree* self, int leaf) {
+    long long size = leaf ? (long long)self->element_size * self->leaf_cap : ((long long)sizeof(struct btree_node*) + self->element_size) * self->fanout;
+    struct btree_node* node = malloc(sizeof(struct btree_node) + size);
+    node->leaf = leaf;
+    node->count = 0;
+    node->next = 0;
+    self->leaves += leaf;
+    return node;
+}
+
+static void btree_node_free_(struct btree_node* node) {
+    if (!node->leaf) {
+        for (int i = 0; i < node->count; i++) {
+            btree_node_free_(btree_children_(node)[i]);
+        }
+    }
+    free(node);
+}
+
+// 第一个大于等于key的位置, found表示是否相等
+static int btree_lower_bound_(struct btree* self, const char* arr, int count, const void* key, int* found) {
+    int lo = 0, hi = count;
+    while (lo < hi) {
+        int mid = (lo + hi) >> 1;
+        if (self->cmp(arr + (long long)mid * self->element_size, key) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    *found = lo < count && self->cmp(arr + (long long)lo * self->element_size, key) == 0;
+    return lo;
+}
+
+// key应该进入的子节点
+static inline int btree_child_index_(struct btree* self, struct btree_node* node, const void* key) {
+    int found;
+    int i = btree_lower_bound_(self, btree_key_(self, node, 0), node->count - 1, key, &found);
+    return i + found;
+}
+
+static struct btree_node* btree_find_leaf_(struct btree* self, const void* key) {
+    struct btree_node* node = self->root;
+    while (!node->leaf) {
+        node = btree_children_(node)[btree_child_index_(self, node, key)];
+    }
+    return node;
+}
+
+struct btree* btree_create(int element_size, cmpfunc cmp) {
+    struct btree* self = (struct btree*)malloc(sizeof(struct btree));
+    memset(self, 0, sizeof(struct btree));
+    self->element_size = element_size;
+    self->cmp = cmp;
+    self->leaf_cap = k_btree_node_bytes / element_size;
+    self->leaf_cap = self->leaf_cap < k_btree_min_cap ? k_btree_min_cap : self->leaf_cap;
+    self->fanout = k_btree_node_bytes / (element_size + (int)sizeof(void*));
+    self->fanout = self->fanout < k_btree_min_cap ? k_btree_min_cap : self->fanout;
+    self->root = btree_node_new_(self, 1);
+    self->first = self->root;
+    return self;
+}
+
+void btree_free(struct btree* self) {
+    btree_node_free_(self->root);
+    free(self);
+}
+
+int btree_count(struct btree* self) {
+    return self->count;
+}
+
+// parent的第i个子节点满了, 分成两半, 右半边插到parent的i+1. 调用前保证parent没满
+static void btree_split_child_(struct btree* self, struct btree_node* parent, int i) {
+    struct btree_node* child = btree_children_(parent)[i];
+    struct btree_node* right = btree_node_new_(self, child->leaf);
+    int es = self->element_size;
+    const char* sep;
+    if (child->leaf) {
+        int h = child->count / 2;
+        right->count = child->count - h;
+        memcpy(right->data, btree_elem_(self, child, h), (long long)right->count * es);
+        child->count = h;
+        right->next = child->next;
+        child->next = right;
+        sep = right->data;
+    } else {
+        int h = child->count / 2;
+        right->count = child->count - h;
+        memcpy(btree_children_(right), btree_children_(child) + h, sizeof(struct btree_node*) * right->count);
+        memcpy(btree_key_(self, right, 0), btree_key_(self, child, h), (long long)(right->count - 1) * es);
+        sep = btree_key_(self, child, h - 1);    // 上移到parent, child里不再需要
+        child->count = h;
+    }
+    struct btree_node** children = btree_children_(parent);
+    memmove(children + i + 2, children + i + 1, sizeof(struct btree_node*) * (parent->count - i - 1));
+    memmove(btree_key_(self, parent, i + 1), btree_key_(self, parent, i), (long long)(parent->count - 1 - i) * es);
+    children[i + 1] = right;
+    memcpy(btree_key_(self, parent, i), sep, es);
+    parent->count++;
+}
+
+static inline int btree_full_(struct btree* self, struct btree_node* node) {
+    return node->count == (node->leaf ? self->leaf_cap : self->fanout);
+}
+
+void* btree_put(struct btree* self, const void* data) {
+    if (btree_full_(self, self->root)) {    // 自顶向下提前分裂满节点, 不需要回溯
+        struct btree_node* root = btree_node_new_(self, 0);
+        btree_children_(root)[0] = self->root;
+        root->count = 1;
+        self->root = root;
+        btree_split_child_(self, root, 0);
+    }
+    struct btree_node* node = self->root;
+    while (!node->leaf) {
+        int i = btree_child_index_(self, node, data);
+        if (btree_full_(self, btree_children_(node)[i])) {
+            btree_split_child_(self, node, i);
+            i = btree_child_index_(self, node, data);
+        }
+        node = btree_children_(node)[i];
+    }
+    int found;
+    int i = btree_lower_bound_(self, node->data, node->count, data, &found);
+    char* tar = btree_elem_(self, node, i);
+    if (!found) {
+        memmove(tar + self->element_size, tar, (long long)(node->count - i) * self->element_size);
+        node->count++;
+        self->count++;
+    }
+    memcpy(tar, data, self->element_size);
+    return tar;
+}
+
+void* btree_get(struct btree* self, const void* key) {
+    struct btree_node* leaf = btree_find_leaf_(self, key);
+    int found;
+    int i = btree_lower_bound_(self, leaf->data, leaf->count, key, &found);
+    return found ? btree_elem_(self, leaf, i) : 0;
+}
+
+int btree_del(struct btree* self, const void* key) {
+    struct btree_node* leaf = btree_find_leaf_(self, key);
+    int found;
+    int i = btree_lower_bound_(self, leaf->data, leaf->count, key, &found);
+    if (!found) {
+        return 0;
+    }
+    char* tar = btree_elem_(self, leaf, i);
+    memmove(tar, tar + self->element_size, (long long)(leaf->count - i - 1) * self->element_size);
+    leaf->count--;
+    self->count--;
+    // 节点不合并, 内部节点的key作为边界仍然有效. 太稀疏时整体重建
+    if (self->leaves > 1 && self->count * 4LL < (long long)self->leaves * self->leaf_cap) {
+        btree_compact(self, 0, 0);
+    }
+    return 1;
+}
+
+// 节点填到3/4, 重建之后马上插入不会立即分裂
+static inline int btree_fill_(int cap) {
+    int fill = cap - cap / 4;
+    return fill < 2 ? 2 : fill;
+}
+
+int btree_compact(struct btree* self, int (*func)(const void* val, void* ud), void* ud) {
+    int es = self->element_size;
+    int fill = btree_fill_(self->leaf_cap);
+    int leaves = (self->count + fill - 1) / fill;
+    leaves = leaves ? leaves : 1;
+    struct btree_node** level = malloc(sizeof(struct btree_node*) * leaves);
+    struct btree_node* old_root = self->root;
+    struct btree_node* old_first = self->first;
+    self->leaves = 0;
+    int n = 0;
+    int removed = 0;
+    struct btree_node* cur = btree_node_new_(self, 1);
+    level[n++] = cur;
+    for (struct btree_node* leaf = old_first; leaf; leaf = leaf->next) {
+        for (int i = 0; i < leaf->count; i++) {
+            const char* val = btree_elem_(self, leaf, i);
+            if (func && func(val, ud)) {
+                removed++;
+                continue;
+            }
+            if (cur->count == fill) {
+                struct btree_node* next = btree_node_new_(self, 1);
+                cur->next = next;
+                cur = next;
+                level[n++] = cur;
+            }
+            memcpy(btree_elem_(self, cur, cur->count++), val, es);
+        }
+    }
+    self->count -= removed;
+    self->first = level[0];
+    // 自底向上逐层建内部节点. lows[i]是level[i]子树里的最小元素
+    const char** lows = malloc(sizeof(char*) * n);
+    for (int i = 0; i < n; i++) {
+        lows[i] = level[i]->data;
+    }
+    int fanout = btree_fill_(self->fanout);
+    while (n > 1) {
+        int m = 0;
+        for (int i = 0; i < n; m++) {
+            int take = n - i <= fanout ? n - i : fanout;
+            if (n - i - take == 1) {    // 不留下只有一个子节点的内部节点
+                take--;
+            }
+            struct btree_node* node = btree_node_new_(self, 0);
+            for (int j = 0; j < take; j++) {
+                btree_children_(node)[j] = level[i + j];
+                if (j > 0) {
+                    memcpy(btree_key_(self, node, j - 1), lows[i + j], es);
+                }
+            }
+            node->count = take;
+            level[m] = node;
+            lows[m] = lows[i];
+            i += take;
+        }
+        n = m;
+    }
+    self->root = level[0];
+    free(lows);
+    free(level);
+    btree_node_free_(old_root);
+    return removed;
+}
+
+struct btree_itor btree_itor_first(struct btree* self) {
+    struct btree_itor it = {self->first, -1};
+    return btree_itor_next(self, it);
+}
+
+struct btree_itor btree_itor_ge(struct btree* self, const void* key) {
+    struct btree_node* leaf = btree_find_leaf_(self, key);
+    int found;
+    struct btree_itor it = {leaf, btree_lower_bound_(self, leaf->data, leaf->count, key, &found) - 1};
+    return btree_itor_next(self, it);
+}
+
+struct btree_itor btree_itor_next(struct btree* self, struct btree_itor it) {
+    (void)self;
+    struct btree_node* leaf = it.leaf;
+    int i = it.i + 1;
+    while (leaf && i >= leaf->count) {    // 跳过删空的叶子
+        leaf = leaf->next;
+        i = 0;
+    }
+    return (struct btree_itor){leaf, i};
+}
+
+void* btree_itor_val(struct btree* self, struct btree_itor it) {
+    return btree_elem_(self, it.leaf, it.i);
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+/**
+ * 可增长的有序容器(B+树), 用于bsearch数组放不下或者增删频繁的场景
+ *   - 元素按cmpfunc排序, 复制一份存在叶子节点里, 叶子串成链表按顺序遍历
+ *   - 增删 O(log n), 只在节点内移动元素, 不会整体memmove
+ *   - 删除不合并节点, 元素少于容量的1/4时整体重建一次, 均摊下来还是 O(log n)
+ *   - 返回的元素指针在下一次 put/del/compact 之前有效
+ */
+
+typedef int (*cmpfunc)(const void*, const void*);
+
+struct btree;
+
+struct btree* btree_create(int element_size, cmpfunc cmp);
+void btree_free(struct btree* self);
+int btree_count(struct btree* self);
+
+/**
+ * 存在则替换, 返回元素的位置
+ */
+void* btree_put(struct btree* self, const void* data);
+void* btree_get(struct btree* self, const void* key);
+
+/**
+ * 返回是否删除了
+ */
+int btree_del(struct btree* self, const void* key);
+
+/**
+ * 批量删除func返回非0的元素, 同时重建成紧凑的树. 和 remove_deleted 一样, 适合先标记后统一删除. 返回删除的数量
+ * func为0时只重建
+ */
+int btree_compact(struct btree* self, int (*func)(const void* val, void* ud), void* ud);
+
+struct btree_itor {
+    void* leaf;    // 0表示结束
+    int i;
+};
+struct btree_itor btree_itor_first(struct btree* self);
+struct btree_itor btree_itor_ge(struct btree* self, const void* key);    // 第一个大于等于key的元素
+struct btree_itor btree_itor_next(struct btree* self, struct btree_itor it);
+void* btree_itor_val(struct btree* self, struct btree_itor it);
+
+#ifndef _concat
+#define _concat_impl(a, b) a##b
+#define _concat(a, b) _concat_impl(a, b)
+#endif
+#define btree_foreach(type, val, tree)                                                                                                                        \
+    for (struct btree_itor _concat(__bt_it, __LINE__) = btree_itor_first(tree); _concat(__bt_it, __LINE__).leaf; _concat(__bt_it, __LINE__).leaf = 0)          \
+        for (type val; _concat(__bt_it, __LINE__).leaf && (val = btree_itor_val(tree, _concat(__bt_it, __LINE__)), 1); _concat(__bt_it, __LINE__) = btree_itor_next(tree, _concat(__bt_it, __LINE__)))
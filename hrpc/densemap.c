@@ -0,0 +1,143 @@
+#include "densemap.h"
+
+#include <memory.h>
+#include <stdlib.h>
+
+#include "mempool.h"
+#include "swissmap.h"
+
+struct densemap {
+    struct swissmap_raw raw;    // 槽位里存entries的下标
+    void** entries;    // 紧凑的元素数组
+    int* slots;    // entries[i]所在的槽位, 删除换位置时用来修正槽位里的下标
+    int entry_capacity;
+    int element_size;
+    struct mempool* pool;    // element_size不为0时元素都从这里分配
+    int (*func_hashcode)(const void*);
+    int (*func_equal)(const void*, const void*);
+};
+
+static inline unsigned long long densemap_hashcode_(struct densemap* self, const void* data) {
+    return swissmap_mix64((unsigned int)self->func_hashcode(data));
+}
+
+static int densemap_eq_(void* ud, const void* slot, const void* key) {
+    struct densemap* self = ud;
+    return self->func_equal(self->entries[*(const int*)slot], key) == 1;
+}
+
+static inline int densemap_find_(struct densemap* self, unsigned long long hash, const void* key) {
+    return swissmap_find_(&self->raw, hash, key, sizeof(int), densemap_eq_, self);
+}
+
+static void densemap_entries_reserve_(struct densemap* self, int capacity) {
+    if (capacity <= self->entry_capacity) {
+        return;
+    }
+    self->entry_capacity = capacity;
+    self->entries = realloc(self->entries, sizeof(void*) * capacity);
+    self->slots = realloc(self->slots, sizeof(int) * capacity);
+}
+
+struct densemap* densemap_create(int init_cap, int element_size, int (*func_hashcode)(const void*), int (*func_equal)(const void*, const void*)) {
+    struct densemap* self = (struct densemap*)malloc(sizeof(struct densemap));
+    memset(self, 0, sizeof(struct densemap));
+    swissmap_raw_init_(&self->raw, init_cap, sizeof(int));
+    densemap_entries_reserve_(self, init_cap > 16 ? init_cap : 16);
+    self->element_size = element_size;
+    self->pool = element_size ? mempool_create(element_size) : 0;
+    self->func_hashcode = func_hashcode;
+    self->func_equal = func_equal;
+    return self;
+}
+
+void densemap_free(struct densemap* self) {
+    if (self->pool) {
+        mempool_destroy(self->pool);
+    }
+    swissmap_raw_free_(&self->raw);
+    free(self->entries);
+    free(self->slots);
+    free(self);
+}
+
+int densemap_count(struct densemap* self) {
+    return self->raw.count;
+}
+
+void* densemap_at(struct densemap* self, int i) {
+    return self->entries[i];
+}
+
+// 按entries的顺序重建索引
+void densemap_resize(struct densemap* self, int capacity) {
+    int count = self->raw.count;
+    swissmap_raw_free_(&self->raw);
+    swissmap_raw_init_(&self->raw, capacity > count ? capacity : count, sizeof(int));
+    for (int i = 0; i < count; i++) {
+        int j = swissmap_claim_(&self->raw, densemap_hashcode_(self, self->entries[i]));
+        ((int*)self->raw.slots)[j] = i;
+        self->slots[i] = j;
+    }
+}
+
+static void* densemap_insert_(struct densemap* self, unsigned long long hash, void* data) {
+    if (self->element_size) {
+        void* tmp = mempool_alloc(self->pool);
+        memcpy(tmp, data, self->element_size);
+        data = tmp;
+    }
+    if (self->raw.growth_left == 0) {    // 删除标记多的时候原容量重建, 否则翻倍
+        int growth = swissmap_growth_(self->raw.capacity);
+        densemap_resize(self, self->raw.count * 2 < growth ? growth : growth * 2);
+    }
+    int i = self->raw.count;
+    densemap_entries_reserve_(self, i < self->entry_capacity ? 0 : self->entry_capacity * 2);
+    int j = swissmap_claim_(&self->raw, hash);
+    ((int*)self->raw.slots)[j] = i;
+    self->entries[i] = data;
+    self->slots[i] = j;
+    return data;
+}
+
+void* densemap_add(struct densemap* self, void* data) {    // must not exist
+    return densemap_insert_(self, densemap_hashcode_(self, data), data);
+}
+
+void* densemap_put(struct densemap* self, void* data) {
+    unsigned long long hash = densemap_hashcode_(self, data);
+    int j = densemap_find_(self, hash, data);
+    if (j < 0) {
+        return densemap_insert_(self, hash, data);
+    }
+    void** entry = &self->entries[((int*)self->raw.slots)[j]];
+    if (self->element_size) {
+        memcpy(*entry, data, self->element_size);
+    } else {
+        *entry = data;
+    }
+    return *entry;
+}
+
+void* densemap_get(struct densemap* self, const void* key) {
+    int j = densemap_find_(self, densemap_hashcode_(self, key), key);
+    return j < 0 ? 0 : self->entries[((int*)self->raw.slots)[j]];
+}
+
+void densemap_del(struct densemap* self, const void* key) {
+    int j = densemap_find_(self, densemap_hashcode_(self, key), key);
+    if (j < 0) {
+        return;
+    }
+    int i = ((int*)self->raw.slots)[j];
+    if (self->element_size) {
+        mempool_free(self->pool, self->entries[i]);
+    }
+    swissmap_erase_(&self->raw, j);
+    int last = self->raw.count;
+    if (i != last) {    // 最后一个换过来
+        self->entries[i] = self->entries[last];
+        self->slots[i] = self->slots[last];
+        ((int*)self->raw.slots)[self->slots[i]] = i;
+    }
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+/**
+ * 元素紧凑存放的hash表: 元素指针按插入顺序放在一个连续数组里, hash索引(swiss table)里只存数组下标
+ *   - 遍历只扫描存活的元素, 和容量无关. 可以从任意位置开始遍历(densemap_at)
+ *   - 删除时把最后一个元素换到被删除的位置, 所以删除过之后不再保持插入顺序
+ *   - 遍历中删除当前元素会把最后一个换过来, 需要删除时倒序遍历
+ *   - 不会自动缩容, 需要时手动调用 densemap_resize
+ */
+
+struct densemap;
+
+/**
+ * @param init_cap 初始容量
+ * @param element_size 0表示不存储数据，只对指针进行索引. 否则添加时复制一份到map自己的对象池里(mempool), 删除时回收, 释放map时整体释放
+ * @param func_hashcode hash函数, 不可为空
+ * @param func_equal 比较函数，不可为空。返回0表示不相等，1表示相等
+ */
+struct densemap* densemap_create(int init_cap, int element_size, int (*func_hashcode)(const void*), int (*func_equal)(const void*, const void*));
+void densemap_free(struct densemap* self);
+int densemap_count(struct densemap* self);
+void densemap_resize(struct densemap* self, int capacity);
+
+/**
+ * 添加元素，⚠ 必须保证不存在
+ */
+void* densemap_add(struct densemap* self, void* data);
+void* densemap_put(struct densemap* self, void* data);
+void* densemap_get(struct densemap* self, const void* key);
+void densemap_del(struct densemap* self, const void* key);
+
+/**
+ * 第i个元素, 0 <= i < densemap_count
+ */
+void* densemap_at(struct densemap* self, int i);
+
+#ifndef _concat
+#define _concat_impl(a, b) a##b
+#define _concat(a, b) _concat_impl(a, b)
+#endif
+#define densemap_foreach(type, val, map)                                                                                     \
+    for (int _concat(__dmap_i, __LINE__) = 0, _concat(__dmap_once, __LINE__) = 1; _concat(__dmap_once, __LINE__); _concat(__dmap_once, __LINE__) = 0) \
+        for (type val; _concat(__dmap_i, __LINE__) < densemap_count(map) && (val = densemap_at(map, _concat(__dmap_i, __LINE__)), 1); ++_concat(__dmap_i, __LINE__))
@@ -12,11 +12,26 @@
 #include <time.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+#ifdef __APPLE__
+#include <sys/clonefile.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#endif
 
 #define fmap_max_level 12
 #define fmap_max_factor 272
 #define fmap_max_files 16
 #define fmap_max_idles 64
+#define fmap_dirty_bytes 128
+#define fmap_index_map_size (1LL << 38)    // 索引文件预留的虚拟地址空间, 扩容只ftruncate, 地址不变
 
 struct fmap_ptr {
     unsigned long long file : 8;    // 1 是索引文件，2以上是数据块。 0 表示空指针
@@ -29,9 +44,28 @@ struct fmap_ptr {
 #define fmap_ptr_eqaul(a, b) (a.file == b.file && a.offset == b.offset)
 #define fmap_ptr_val(ptr) ((void*)(mp->faddr[ptr.file] + ptr.offset));
 
+// 并发读模式下链表指针的发布与读取, 读线程看到指针时节点内容一定已经写好
+union fmap_ptr_bits_ {
+    struct fmap_ptr ptr;
+    unsigned long long bits;
+};
+
+static inline struct fmap_ptr fmap_ptr_load_(const struct fmap_ptr* src) {
+    union fmap_ptr_bits_ u;
+    u.bits = __atomic_load_n((const unsigned long long*)src, __ATOMIC_ACQUIRE);
+    return u.ptr;
+}
+
+static inline void fmap_ptr_store_(struct fmap_ptr* dst, struct fmap_ptr val) {
+    union fmap_ptr_bits_ u;
+    u.ptr = val;
+    __atomic_store_n((unsigned long long*)dst, u.bits, __ATOMIC_RELEASE);
+}
+
 struct fmap_index {
     char key[128];
-    unsigned long long val_size;
+    unsigned int val_size;
+    unsigned int crc;    // key/val_size/size/val的CRC32C, 0表示没有校验(旧文件)
     unsigned long long size;
     fmap_ptr_type(void*) val;
     fmap_ptr_type(struct fmap_index*) next[fmap_max_level];
@@ -46,7 +80,61 @@ struct fmap_skiplist {
     int count;
     long long fsize;      // 当前文件大小
     long long foffset;    // 下一次内存申请偏移
-    char align[224];
+    long long gen;        // 结构变更计数, 用于校验hash索引是否过期
+    unsigned long long seq;    // 顺序锁, 奇数表示写入中。只读挂载的进程据此发现并发修改并重试
+    long long version;         // 文件格式版本, 0是最早没有版本号的格式
+    int clean;                 // 正常卸载时置1, 第一次结构修改前清0
+    int dirty_shift;           // dirty_map每一位对应索引文件中 1<<dirty_shift 字节
+    unsigned char dirty_map[fmap_dirty_bytes];    // 上次检查点之后修改过的索引区域, 崩溃后只检查这些
+    char align[64];
+};
+
+struct fmap_hash_slot {
+    unsigned long long code;    // ptr为空时: code==0 表示空槽, 否则是已删除
+    struct fmap_ptr ptr;
+};
+
+struct fmap_hash {
+    long long gen;    // 与skiplist->gen一致时表示索引有效
+    long long capacity;
+    long long count;
+    long long used;    // count + 已删除的槽
+    char align[32];
+    struct fmap_hash_slot slots[];
+};
+
+#define fmap_max_readers 64
+
+// 1: 前驱指针只在插入时设置, 删除时count可能多减
+// 2: 前驱指针全程维护, count准确
+// 3: 节点带CRC32C校验, 干净卸载标记与修改区域位图
+#define fmap_version 3
+
+#define k_fmap_mount_hash 0b1
+#define k_fmap_mount_concurrent 0b10
+#define k_fmap_mount_readonly 0b100
+#define k_fmap_mount_prefault 0b1000
+#define k_fmap_mount_mlock 0b10000
+#define k_fmap_mount_hugepage 0b100000
+#define k_fmap_mount_random 0b1000000
+#define k_fmap_mount_sequential 0b10000000
+#define k_fmap_mount_dontneed 0b100000000
+
+#define fmap_dontneed_min (64 * 1024)    // 更小的块很快会被复用, 不归还
+#define fmap_lock_step (1 << 21)
+
+#define k_fmap_durability_none 0
+#define k_fmap_durability_periodic 1
+#define k_fmap_durability_group 2
+
+struct fmap_reader_ {
+    long long epoch;    // 0表示空闲, 否则是读线程进入时的全局epoch
+    char align[56];
+};
+
+struct fmap_retired_ {
+    struct fmap_ptr it;
+    long long epoch;
 };
 
 struct fmap {
@@ -54,10 +142,204 @@ struct fmap {
     char* faddr[fmap_max_files];
     int fd[fmap_max_files];
     struct fmap_skiplist* skiplist;
+    struct fmap_hash* hash;    // 可选的hash索引, 只加速精确查找
+    long long hash_fsize;
+    int hash_fd;
+
+    // 并发读模式: 挂载线程是唯一的写线程, 删除的节点等所有更早进入的读线程退出后才回收
+    int concurrent;
+    int readonly;
+    int torn;                    // 只读挂载时读到了越界指针, 需要重试
+    // 只读挂载时上一次返回的节点, 返回时的seq和在顺序锁内读到的key. seq没变可以直接沿着节点走, 变了按key重新定位
+    struct fmap_index* ro_last;
+    unsigned long long ro_seq;
+    char ro_key[128];
+    pthread_t owner;
+    long long epoch;
+    struct fmap_retired_* retired;
+    int retired_count;
+    int retired_cap;
+    int retired_next;    // 长到这个数再尝试回收, 回收后按剩下的数量翻倍, 读线程长期不动时避免每次删除都扫一遍
+    struct fmap_reader_ readers[fmap_max_readers];
+
+    // 持久化: 记录上次提交后写过的文件(bit0表示新建了数据文件, 需要同步目录), 脏页本身由内核跟踪
+    int durability;
+    int interval_ms;
+    unsigned int dirty;
+    int flusher_stop;
+    pthread_t flusher;
+    pthread_mutex_t flusher_lock;
+    pthread_cond_t flusher_cond;
+
+    // 页面驻留
+    int flag;
+    long long locked;    // 已mlock的索引文件字节数
+    struct rusage usage;    // 挂载时的缺页计数
+};
+
+struct fmap_stat {
+    long long minflt;
+    long long majflt;
+    long long index_bytes;
+    long long index_resident;
+    long long data_bytes;
+    long long data_resident;
+    long long locked;
 };
 
+// 索引文件按已用部分分段锁定, 未用的空洞不占内存
+static void fmap_index_lock_(struct fmap* mp) {
+    long long end = (mp->skiplist->foffset + fmap_lock_step - 1) & ~(long long)(fmap_lock_step - 1);
+    if (end > mp->skiplist->fsize) {
+        end = mp->skiplist->fsize;
+    }
+    if (end > mp->locked && mlock(mp->faddr[1] + mp->locked, end - mp->locked) == 0) {    // RLIMIT_MEMLOCK不够时不锁, 从fmap_stat可以看到
+        mp->locked = end;
+    }
+}
+
+// 按文件角色设置内核提示: 索引文件常驻, 数据文件按访问模式
+static void fmap_advise_(struct fmap* mp, int i, char* addr, unsigned long long size) {
+#ifdef MADV_HUGEPAGE
+    if (mp->flag & k_fmap_mount_hugepage) {
+        madvise(addr, size, MADV_HUGEPAGE);
+    }
+#endif
+    if (i == 1) {
+        if (mp->flag & k_fmap_mount_mlock) {
+            fmap_index_lock_(mp);
+        }
+        return;
+    }
+    if (mp->flag & k_fmap_mount_random) {
+        madvise(addr, size, MADV_RANDOM);
+    } else if (mp->flag & k_fmap_mount_sequential) {
+        madvise(addr, size, MADV_SEQUENTIAL);
+    }
+}
+
+// 释放回空闲链的大块, 页面不再需要常驻。共享文件映射上MADV_DONTNEED只解除映射, 页缓存还在,
+// 所以优先MADV_REMOVE(打洞, 内存和磁盘都释放, 再次使用时读到0), 文件系统不支持时退回DONTNEED
+static void fmap_block_release_(struct fmap* mp, struct fmap_ptr it) {
+    struct fmap_index* idx = fmap_ptr_val(it);
+    if ((mp->flag & k_fmap_mount_dontneed) && idx->size >= fmap_dontneed_min) {
+        char* addr = fmap_ptr_val(idx->val);
+#ifdef MADV_REMOVE
+        if (madvise(addr, idx->size, MADV_REMOVE) == 0) {
+            return;
+        }
+#endif
+        madvise(addr, idx->size, MADV_DONTNEED);
+    }
+}
+
+static inline void fmap_dirty_(struct fmap* mp, int file) {
+    unsigned int bit = 1u << file;
+    if (!(__atomic_load_n(&mp->dirty, __ATOMIC_RELAXED) & bit)) {
+        __atomic_fetch_or(&mp->dirty, bit, __ATOMIC_RELEASE);
+    }
+}
+
+static unsigned int fmap_crc32c_table_[256];
+
+static void fmap_crc32c_init_() {
+    for (unsigned int i = 0; i < 256; i++) {
+        unsigned int crc = i;
+        for (int k = 0; k < 8; k++) {
+            crc = crc & 1 ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+        }
+        fmap_crc32c_table_[i] = crc;
+    }
+}
+
+static unsigned int fmap_crc32c_sw_(unsigned int crc, const unsigned char* data, size_t len) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, fmap_crc32c_init_);
+    while (len--) {
+        crc = fmap_crc32c_table_[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static unsigned int fmap_crc32c_hw_(unsigned int crc, const unsigned char* data, size_t len) {
+    unsigned long long crc64 = crc;
+    for (; len >= 8; len -= 8, data += 8) {
+        unsigned long long v;
+        memcpy(&v, data, 8);
+        crc64 = _mm_crc32_u64(crc64, v);
+    }
+    crc = crc64;
+    while (len--) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+#endif
+
+static unsigned int fmap_crc32c_(unsigned int crc, const void* data, size_t len) {
+#if defined(__x86_64__)
+    static int hw = -1;
+    if (hw < 0) {
+        hw = __builtin_cpu_supports("sse4.2");
+    }
+    if (hw) {
+        return fmap_crc32c_hw_(crc, data, len);
+    }
+#endif
+    return fmap_crc32c_sw_(crc, data, len);
+}
+
+// 节点自身的内容, 链接指针不在内, 由检查时的顺序关系保证
+static unsigned int fmap_record_crc_(struct fmap_index* it) {
+    unsigned int crc = fmap_crc32c_(~0u, it->key, strnlen(it->key, sizeof(it->key)));
+    crc = fmap_crc32c_(crc, &it->val_size, sizeof(it->val_size));
+    crc = fmap_crc32c_(crc, &it->size, sizeof(it->size));
+    crc = fmap_crc32c_(crc, &it->val, sizeof(it->val));
+    crc = ~crc;
+    return crc ? crc : 1;
+}
+
+static inline void fmap_seal_(struct fmap_index* it) {
+    it->crc = fmap_record_crc_(it);
+}
+
+// 修改索引节点之前标记所在区域。标记必须先于数据落盘, 所以每个区域每个检查点周期同步一次文件头
+static inline void fmap_mark_(struct fmap* mp, const void* node) {
+    unsigned long long chunk = ((const char*)node - mp->faddr[1]) >> mp->skiplist->dirty_shift;
+    unsigned char bit = 1 << (chunk & 7);
+    unsigned char* map = &mp->skiplist->dirty_map[chunk >> 3];
+    if (!(*map & bit)) {
+        *map |= bit;
+        mp->skiplist->clean = 0;
+        msync(mp->faddr[1], 4096, MS_SYNC);
+    }
+}
+
+// 索引文件变大后区域合并, 保证位图能覆盖整个文件
+static void fmap_dirty_shift_fix_(struct fmap* mp) {
+    struct fmap_skiplist* sl = mp->skiplist;
+    if (sl->dirty_shift == 0) {
+        sl->dirty_shift = 16;
+    }
+    while ((sl->fsize >> sl->dirty_shift) > fmap_dirty_bytes * 8) {
+        for (int j = 0; j < fmap_dirty_bytes * 8; j++) {
+            int a = 2 * j, b = 2 * j + 1;
+            int v = a < fmap_dirty_bytes * 8 && ((sl->dirty_map[a >> 3] >> (a & 7)) & 1);
+            v |= b < fmap_dirty_bytes * 8 && ((sl->dirty_map[b >> 3] >> (b & 7)) & 1);
+            if (v) {
+                sl->dirty_map[j >> 3] |= 1 << (j & 7);
+            } else {
+                sl->dirty_map[j >> 3] &= ~(1 << (j & 7));
+            }
+        }
+        sl->dirty_shift++;
+    }
+}
+
 static void fmap_element_free_(struct fmap* mp, fmap_ptr_type(struct fmap_index*) it) {
     struct fmap_index* idx = fmap_ptr_val(it);
+    fmap_mark_(mp, idx);    // 链表头可能先于节点落盘, 挂到空闲链之前标记, 崩溃后由 fmap_verify 检查空闲链
     idx->val_size = 0;
     idx->key[0] = 0;
     idx->prev.file = 0;
@@ -67,26 +349,76 @@ static void fmap_element_free_(struct fmap* mp, fmap_ptr_type(struct fmap_index*
     mp->skiplist->idles[n] = it;
 }
 
+static void fmap_reclaim_(struct fmap* mp) {
+    long long min = __LONG_LONG_MAX__;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (int i = 0; i < fmap_max_readers; i++) {
+        long long epoch = __atomic_load_n(&mp->readers[i].epoch, __ATOMIC_SEQ_CST);
+        if (epoch && epoch < min) {
+            min = epoch;
+        }
+    }
+    int k = 0;
+    for (int i = 0; i < mp->retired_count; i++) {
+        if (mp->retired[i].epoch < min) {
+            fmap_block_release_(mp, mp->retired[i].it);
+            fmap_element_free_(mp, mp->retired[i].it);
+        } else {
+            mp->retired[k++] = mp->retired[i];
+        }
+    }
+    mp->retired_count = k;
+    mp->retired_next = k * 2;
+}
+
+// 已经从跳表摘下的节点, 并发读模式下延迟到没有读线程可能持有时再回收
+static void fmap_element_retire_(struct fmap* mp, fmap_ptr_type(struct fmap_index*) it) {
+    if (!mp->concurrent) {
+        fmap_block_release_(mp, it);
+        fmap_element_free_(mp, it);
+        return;
+    }
+    if (mp->retired_count == mp->retired_cap) {
+        mp->retired_cap = mp->retired_cap ? mp->retired_cap * 2 : 64;
+        mp->retired = realloc(mp->retired, sizeof(struct fmap_retired_) * mp->retired_cap);
+    }
+    struct fmap_retired_* r = &mp->retired[mp->retired_count++];
+    r->it = it;
+    r->epoch = __atomic_fetch_add(&mp->epoch, 1, __ATOMIC_SEQ_CST);
+    if (mp->retired_count >= 64 && mp->retired_count >= mp->retired_next) {
+        fmap_reclaim_(mp);
+    }
+}
+
 static fmap_ptr_type(struct fmap_index*) fmap_index_new_(struct fmap* mp) {
     struct fmap_ptr rst = {0};
     if (mp->skiplist->foffset + (long long)sizeof(struct fmap_index) > mp->skiplist->fsize) {
-        munmap(mp->faddr[1], mp->skiplist->fsize);
         long long size = mp->skiplist->fsize * 2;
-        if (ftruncate(mp->fd[1], size) == -1) {
-            return rst;
-        }
-        char* ptr = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, mp->fd[1], 0);
-        if (ptr == MAP_FAILED) {
+        if (size > fmap_index_map_size || ftruncate(mp->fd[1], size) == -1) {
             return rst;
         }
         mp->skiplist->fsize = size;
+        fmap_dirty_shift_fix_(mp);
     }
     rst.file = 1;
     rst.offset = mp->skiplist->foffset;
     mp->skiplist->foffset += sizeof(struct fmap_index);
+    if ((mp->flag & k_fmap_mount_mlock) && mp->skiplist->foffset > mp->locked) {
+        fmap_index_lock_(mp);
+    }
     return rst;
 }
 
+static struct fmap_ptr fmap_idles_pop_(struct fmap* mp, int n) {
+    struct fmap_ptr rptr = mp->skiplist->idles[n];
+    struct fmap_index* rst = fmap_ptr_val(rptr);
+    fmap_mark_(mp, rst);
+    mp->skiplist->idles[n] = rst->next[0];
+    memset(&rst->next, 0, sizeof(struct fmap_ptr) * (fmap_max_level + 1));
+    rst->val_size = 0;
+    return rptr;
+}
+
 static fmap_ptr_type(struct fmap_index*) fmap_element_malloc_val_(struct fmap* mp, unsigned int total_size) {
     if (total_size < 4096) {    // 页缓存最小单位，保证能回存
         total_size = 4096;
@@ -100,6 +432,7 @@ static fmap_ptr_type(struct fmap_index*) fmap_element_malloc_val_(struct fmap* m
                 // pop 一个
                 struct fmap_ptr e1p = mp->skiplist->idles[i];
                 struct fmap_index* e1 = fmap_ptr_val(e1p);
+                fmap_mark_(mp, e1);
                 mp->skiplist->idles[i] = e1->next[0];
                 // push 分割成两块
                 unsigned long long size = pow(2, i - 1);
@@ -110,10 +443,10 @@ static fmap_ptr_type(struct fmap_index*) fmap_element_malloc_val_(struct fmap* m
                 e2->size = size;
                 e2->val.file = e1->val.file;
                 e2->val.offset = e1->val.offset + size;
-                fmap_element_free_(mp, e1p);
                 fmap_element_free_(mp, e2p);
+                fmap_element_free_(mp, e1p);    // 低地址在栈顶, 连续申请时顺序写
                 msync(e1, sizeof(struct fmap_index), MS_ASYNC);
-                msync(e1, sizeof(struct fmap_index), MS_ASYNC);
+                msync(e2, sizeof(struct fmap_index), MS_ASYNC);
                 splited = 1;
                 break;
             }
@@ -156,6 +489,9 @@ static fmap_ptr_type(struct fmap_index*) fmap_element_malloc_val_(struct fmap* m
             }
             mp->faddr[i] = ptr;
             mp->fd[i] = fd;
+            fmap_advise_(mp, i, ptr, size);
+            fmap_dirty_(mp, 0);
+            fmap_dirty_(mp, i);
 
             struct fmap_ptr iptr = fmap_index_new_(mp);
             struct fmap_index* idx = fmap_ptr_val(iptr);
@@ -170,253 +506,1204 @@ static fmap_ptr_type(struct fmap_index*) fmap_element_malloc_val_(struct fmap* m
         assert(file_created);
     }
 
-    struct fmap_ptr rptr = mp->skiplist->idles[n];
-    struct fmap_index* rst = fmap_ptr_val(rptr);
-    mp->skiplist->idles[n] = rst->next[0];
-    memset(&rst->next, 0, sizeof(struct fmap_ptr) * (fmap_max_level + 1));
-    rst->val_size = 0;
-    return rptr;
+    return fmap_idles_pop_(mp, n);
+}
+
+// 空闲的索引节点(不持有数据块)挂在idles[0]上, 数据块最小64字节所以不会冲突
+static void fmap_index_spare_(struct fmap* mp, struct fmap_ptr it) {
+    struct fmap_index* idx = fmap_ptr_val(it);
+    fmap_mark_(mp, idx);
+    idx->val_size = 0;
+    idx->size = 0;
+    idx->key[0] = 0;
+    idx->prev.file = 0;
+    idx->val.file = 0;
+    idx->next[0] = mp->skiplist->idles[0];
+    mp->skiplist->idles[0] = it;
+}
+
+static struct fmap_ptr fmap_index_node_(struct fmap* mp) {
+    if (fmap_ptr_no_null(mp->skiplist->idles[0])) {
+        return fmap_idles_pop_(mp, 0);
+    }
+    return fmap_index_new_(mp);
+}
+
+// 批量写入时, 小于一页的值从连续的大块里按对齐顺序切分, 避免逐个拆分大块以及每个值独占一页
+#define fmap_carve_region (1 << 21)
+#define fmap_carve_min 64
+
+struct fmap_carve_ {
+    struct fmap_ptr cur;
+    unsigned long long end;
+};
+
+// 把[start, end)按对齐拆成若干空闲块
+static void fmap_carve_release_(struct fmap* mp, int file, unsigned long long start, unsigned long long end) {
+    while (start < end) {
+        unsigned long long size = start ? (start & -start) : fmap_carve_region;
+        while (start + size > end) {
+            size >>= 1;
+        }
+        struct fmap_ptr ptr = fmap_index_node_(mp);
+        struct fmap_index* idx = fmap_ptr_val(ptr);
+        idx->size = size;
+        idx->val.file = file;
+        idx->val.offset = start;
+        fmap_element_free_(mp, ptr);
+        start += size;
+    }
+}
+
+static void fmap_carve_finish_(struct fmap* mp, struct fmap_carve_* carve) {
+    if (fmap_ptr_no_null(carve->cur)) {
+        fmap_carve_release_(mp, carve->cur.file, carve->cur.offset, carve->end);
+        carve->cur.file = 0;
+    }
+}
+
+static struct fmap_ptr fmap_carve_malloc_val_(struct fmap* mp, struct fmap_carve_* carve, unsigned int total_size) {
+    if (total_size >= 4096) {
+        return fmap_element_malloc_val_(mp, total_size);
+    }
+    if (total_size < fmap_carve_min) {
+        total_size = fmap_carve_min;
+    }
+    int n = 64 - __builtin_clzll(total_size - 1);
+    if (fmap_ptr_no_null(mp->skiplist->idles[n])) {
+        return fmap_idles_pop_(mp, n);
+    }
+    unsigned long long size = 1ULL << n;
+    unsigned long long start = (carve->cur.offset + size - 1) & ~(size - 1);
+    if (fmap_ptr_is_null(carve->cur) || start + size > carve->end) {
+        fmap_carve_finish_(mp, carve);
+        struct fmap_ptr rptr = fmap_element_malloc_val_(mp, fmap_carve_region);
+        struct fmap_index* region = fmap_ptr_val(rptr);
+        carve->cur = region->val;
+        carve->end = region->val.offset + region->size;
+        fmap_index_spare_(mp, rptr);
+        start = carve->cur.offset;
+    }
+    if (start > carve->cur.offset) {
+        fmap_carve_release_(mp, carve->cur.file, carve->cur.offset, start);
+    }
+    struct fmap_ptr ptr = fmap_index_node_(mp);
+    struct fmap_index* idx = fmap_ptr_val(ptr);
+    idx->size = size;
+    idx->val.file = carve->cur.file;
+    idx->val.offset = start;
+    carve->cur.offset = start + size;
+    return ptr;
+}
+
+static unsigned int random_next_() {
+    static unsigned long long seed = 88172645463325252ULL;    // xorshift64, 比rand()便宜
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return seed >> 32;
 }
 
 static int random_level_() {
     int lv = 1;
-    while (rand() % 1001 < fmap_max_factor && lv < fmap_max_level) {
+    while (random_next_() % 1001 < fmap_max_factor && lv < fmap_max_level) {
         ++lv;
     }
     return lv;
 }
 
-static inline struct fmap_ptr select_closest_(struct fmap* mp, struct fmap_ptr search, int i, const char* key) {
-    struct fmap_index* psearch = fmap_ptr_val(search);
-    while (fmap_ptr_no_null(psearch->next[i])) { 
-        struct fmap_index* ptr = fmap_ptr_val(psearch->next[i]);
-        if (strcmp(ptr->key, key) < 0) {
-            search = psearch->next[i];
-            psearch = fmap_ptr_val(search);
-        } else {
-            break;
+static inline void fmap_write_begin_(struct fmap* mp) {
+    fmap_dirty_(mp, 1);
+    __atomic_store_n(&mp->skiplist->seq, mp->skiplist->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void fmap_write_end_(struct fmap* mp) {
+    __atomic_store_n(&mp->skiplist->seq, mp->skiplist->seq + 1, __ATOMIC_RELEASE);
+}
+
+unsigned long long fmap_seq_begin(struct fmap* mp) {
+    for (int i = 0;; i++) {
+        unsigned long long seq = __atomic_load_n(&mp->skiplist->seq, __ATOMIC_ACQUIRE);
+        if (!(seq & 1) || i >= 1000) {    // 写进程在写入中途挂掉会一直是奇数, 不无限等待
+            return seq;
         }
+        sched_yield();
     }
-    return search;
 }
 
-struct fmap* fmap_mount(const char* fpath) {
-    struct fmap* mp = malloc(sizeof(struct fmap));
-    if (!mp || !fpath) {
-        ("malloc fmap failed");
+int fmap_seq_retry(struct fmap* mp, unsigned long long seq) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&mp->skiplist->seq, __ATOMIC_RELAXED) != seq;
+}
+
+// 只读挂载时写进程新建的数据文件按需映射
+static int fmap_ro_map_file_(struct fmap* mp, int i) {
+    char path[1024];
+    path[snprintf(path, sizeof(path), "%s.%d", mp->fpath, i)] = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
         return 0;
     }
-    memset(mp, 0, sizeof(struct fmap));
-    strcpy(mp->fpath, fpath);
-    char path[1024];
+    unsigned long long size = pow(2, i + 27);
+    char* ptr = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED) {
+        close(fd);
+        return 0;
+    }
+    mp->faddr[i] = ptr;
+    mp->fd[i] = fd;
+    fmap_advise_(mp, i, ptr, size);
+    return 1;
+}
 
-    // load index
-    {
-        path[snprintf(path, sizeof(path), "%s.1", mp->fpath)] = 0;
-        FILE* file = fopen(path, "r");
-        long long size = 0;
-        if (file) {
-            fseek(file, 0, SEEK_END);
-            size = ftell(file);
-            fclose(file);
-        }
-        int fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
-        if (fd == -1) {
-            free(mp);
-            return 0;
-        }
-        if (!size) {
-            size = 1024 * 1024 * 512;
-            if (ftruncate(fd, size) == -1) {
-                close(fd);
-                return 0;
-            }
-        }
-        struct flock fl;
-        fl.l_type = F_WRLCK;
-        fl.l_whence = SEEK_SET;
-        fl.l_start = 0;
-        fl.l_len = size;
-        fl.l_pid = getpid();
-        if (fcntl(fd, F_SETLK, &fl) == -1) {
-            close(fd);
-            free(mp);
+// 只读挂载时, 指针可能是写进程写了一半的, 解引用前检查范围
+static int fmap_ro_valid_(struct fmap* mp, struct fmap_ptr ptr, unsigned long long size) {
+    if (ptr.file == 1) {
+        if (ptr.offset != 0 && (ptr.offset - sizeof(struct fmap_skiplist)) % sizeof(struct fmap_index) != 0) {
             return 0;
         }
-        char* ptr = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-        if (ptr == MAP_FAILED) {
-            close(fd);
-            free(mp);
-            return 0;
-        }
-        mp->faddr[1] = ptr;
-        mp->fd[1] = fd;
-        mp->skiplist = (struct fmap_skiplist*)ptr;
-        if (mp->skiplist->fsize == 0) {
-            mp->skiplist->fsize = size;
-            mp->skiplist->foffset = sizeof(struct fmap_skiplist);
+        return ptr.offset + size <= (unsigned long long)__atomic_load_n(&mp->skiplist->fsize, __ATOMIC_RELAXED);
+    }
+    if (ptr.file >= fmap_max_files || (!mp->faddr[ptr.file] && !fmap_ro_map_file_(mp, ptr.file))) {
+        return 0;
+    }
+    return ptr.offset + size <= (1ULL << (ptr.file + 27));
+}
+
+static inline struct fmap_index* fmap_node_(struct fmap* mp, struct fmap_ptr ptr) {
+    if (fmap_ptr_is_null(ptr)) {
+        return 0;
+    }
+    if (mp->readonly && (ptr.file != 1 || !fmap_ro_valid_(mp, ptr, sizeof(struct fmap_index)))) {
+        mp->torn = 1;
+        return 0;
+    }
+    return fmap_ptr_val(ptr);
+}
+
+static inline struct fmap_ptr select_closest_(struct fmap* mp, struct fmap_ptr search, int i, const char* key) {
+    struct fmap_index* psearch = fmap_ptr_val(search);
+    struct fmap_ptr next = fmap_ptr_load_(&psearch->next[i]);
+    while (fmap_ptr_no_null(next)) {
+        struct fmap_index* ptr = fmap_node_(mp, next);
+        if (ptr && strcmp(ptr->key, key) < 0) {
+            search = next;
+            psearch = ptr;
+            next = fmap_ptr_load_(&psearch->next[i]);
         } else {
-            assert(mp->skiplist->fsize == size);
+            break;
         }
-        mp->skiplist->head.file = 1;
-        mp->skiplist->head.offset = 0;
     }
+    return search;
+}
 
-    for (int i = 2; i < fmap_max_files; i++) {
-        path[snprintf(path, sizeof(path), "%s.%d", mp->fpath, i)] = 0;
-        FILE* file = fopen(path, "r");
-        if (!file) {
-            continue;
-        }
-        fclose(file);
+static inline int fmap_level_(struct fmap* mp) {
+    int level = __atomic_load_n(&mp->skiplist->level, __ATOMIC_ACQUIRE);
+    return level > fmap_max_level ? fmap_max_level : level;
+}
 
-        int fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
-        if (fd == -1) {
-            free(mp);
-            return 0;
-        }
-        unsigned long long size = pow(2, i + 27);
-        struct flock fl;
-        fl.l_type = F_WRLCK;
-        fl.l_whence = SEEK_SET;
-        fl.l_start = 0;
-        fl.l_len = size;
-        fl.l_pid = getpid();
-        if (fcntl(fd, F_SETLK, &fl) == -1) {
-            close(fd);
-            free(mp);
-            return 0;
-        }
-        char* ptr = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-        if (ptr == MAP_FAILED) {
-            close(fd);
-            free(mp);
-            return 0;
-        }
-        mp->faddr[i] = ptr;
-        mp->fd[i] = fd;
+#define fmap_hash_min_capacity 1024
+
+static unsigned long long fmap_hash_code_(const char* key) {
+    unsigned long long code = 14695981039346656037ULL;    // FNV-1a
+    while (*key) {
+        code ^= (unsigned char)*key++;
+        code *= 1099511628211ULL;
     }
-    return mp;
+    return code;
 }
 
-void fmap_unmount(struct fmap* mp) {
-    for (int i = 2; i < fmap_max_files; i++) {
-        if (!mp->faddr[i]) {
+static void fmap_hash_insert_(struct fmap* mp, struct fmap_ptr element, unsigned long long code) {
+    struct fmap_hash* hash = mp->hash;
+    unsigned long long mask = hash->capacity - 1;
+    for (unsigned long long i = code & mask;; i = (i + 1) & mask) {
+        struct fmap_hash_slot* slot = &hash->slots[i];
+        if (fmap_ptr_no_null(slot->ptr)) {
             continue;
         }
-        unsigned long long size = pow(2, i + 27);
-        munmap(mp->faddr[i], size);
-        close(mp->fd[i]);
+        if (slot->code == 0) {
+            hash->used++;
+        }
+        slot->code = code;
+        slot->ptr = element;
+        hash->count++;
+        return;
     }
-    munmap(mp->faddr[1], mp->skiplist->fsize);
-    close(mp->fd[1]);
-
-    memset(mp, 0, sizeof(struct fmap));
-    free(mp);
 }
 
-int fmap_count(struct fmap* mp) {
-    return mp->skiplist->count;
-}
+// 从有序索引重建, 同时按当前数量调整容量
+static int fmap_hash_rebuild_(struct fmap* mp) {
+    long long capacity = fmap_hash_min_capacity;
+    while (capacity < (long long)(mp->skiplist->count + 1) * 4) {
+        capacity *= 2;
+    }
+    long long size = sizeof(struct fmap_hash) + capacity * sizeof(struct fmap_hash_slot);
+    if (mp->hash) {
+        munmap(mp->hash, mp->hash_fsize);
+        mp->hash = 0;
+    }
+    if (ftruncate(mp->hash_fd, size) == -1) {
+        return 0;
+    }
+    void* ptr = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, mp->hash_fd, 0);
+    if (ptr == MAP_FAILED) {
+        return 0;
+    }
+    mp->hash = ptr;
+    mp->hash_fsize = size;
+    memset(mp->hash, 0, size);
+    mp->hash->capacity = capacity;
 
-struct fmap_index* fmap_get(struct fmap* mp, const char* key) {
+    struct fmap_ptr it = mp->skiplist->_head.next[0];
+    while (fmap_ptr_no_null(it)) {
+        struct fmap_index* pit = fmap_ptr_val(it);
+        fmap_hash_insert_(mp, it, fmap_hash_code_(pit->key));
+        it = pit->next[0];
+    }
+    mp->hash->gen = mp->skiplist->gen;
+    return 1;
+}
+
+static void fmap_hash_add_(struct fmap* mp, struct fmap_ptr element) {
+    if ((mp->hash->used + 1) * 2 > mp->hash->capacity) {
+        if (!fmap_hash_rebuild_(mp)) {    // 重建失败退化为只用跳表, 下次挂载时发现过期会再重建
+            return;
+        }
+    } else {
+        struct fmap_index* pelement = fmap_ptr_val(element);
+        fmap_hash_insert_(mp, element, fmap_hash_code_(pelement->key));
+    }
+    mp->hash->gen = mp->skiplist->gen;
+}
+
+static void fmap_hash_del_(struct fmap* mp, struct fmap_ptr element) {
+    struct fmap_hash* hash = mp->hash;
+    struct fmap_index* pelement = fmap_ptr_val(element);
+    unsigned long long code = fmap_hash_code_(pelement->key);
+    unsigned long long mask = hash->capacity - 1;
+    for (unsigned long long i = code & mask;; i = (i + 1) & mask) {
+        struct fmap_hash_slot* slot = &hash->slots[i];
+        if (fmap_ptr_is_null(slot->ptr)) {
+            if (slot->code == 0) {
+                break;
+            }
+            continue;
+        }
+        if (fmap_ptr_eqaul(slot->ptr, element)) {
+            slot->ptr.file = 0;
+            slot->ptr.offset = 0;
+            slot->code = 1;    // 标记删除, 不打断探测链
+            hash->count--;
+            break;
+        }
+    }
+    hash->gen = mp->skiplist->gen;
+}
+
+static struct fmap_index* fmap_hash_get_(struct fmap* mp, const char* key) {
+    struct fmap_hash* hash = mp->hash;
+    unsigned long long code = fmap_hash_code_(key);
+    unsigned long long mask = hash->capacity - 1;
+    for (unsigned long long i = code & mask;; i = (i + 1) & mask) {
+        struct fmap_hash_slot* slot = &hash->slots[i];
+        if (fmap_ptr_is_null(slot->ptr)) {
+            if (slot->code == 0) {
+                return 0;
+            }
+            continue;
+        }
+        if (slot->code == code) {
+            struct fmap_index* pit = fmap_ptr_val(slot->ptr);
+            if (strcmp(pit->key, key) == 0) {
+                return pit;
+            }
+        }
+    }
+}
+
+static int fmap_hash_mount_(struct fmap* mp) {
+    char path[1024];
+    path[snprintf(path, sizeof(path), "%s.hash", mp->fpath)] = 0;
+    int fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (fd == -1) {
+        return 0;
+    }
+    struct flock fl;
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = 0;
+    fl.l_len = 0;
+    fl.l_pid = getpid();
+    if (fcntl(fd, F_SETLK, &fl) == -1) {
+        close(fd);
+        return 0;
+    }
+    mp->hash_fd = fd;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > (long long)sizeof(struct fmap_hash)) {
+        void* ptr = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (ptr != MAP_FAILED) {
+            mp->hash = ptr;
+            mp->hash_fsize = st.st_size;
+            struct fmap_hash* hash = mp->hash;
+            if (hash->gen == mp->skiplist->gen && hash->count == mp->skiplist->count &&
+                sizeof(struct fmap_hash) + hash->capacity * sizeof(struct fmap_hash_slot) == (unsigned long long)st.st_size) {
+                return 1;
+            }
+        }
+    }
+    if (!fmap_hash_rebuild_(mp)) {    // 缺失或者过期
+        close(fd);
+        mp->hash_fd = 0;
+        return 0;
+    }
+    return 1;
+}
+
+void fmap_unmount(struct fmap* mp);
+
+// 旧版本文件原地升级: 沿最底层重建前驱指针, 补上校验, 并重新计数
+static void fmap_upgrade_(struct fmap* mp) {
+    struct fmap_ptr prev = mp->skiplist->head;
+    struct fmap_index* pprev = fmap_ptr_val(prev);
+    int count = 0;
+    while (fmap_ptr_no_null(pprev->next[0])) {
+        struct fmap_ptr it = pprev->next[0];
+        struct fmap_index* pit = fmap_ptr_val(it);
+        pit->prev = prev;
+        fmap_seal_(pit);
+        prev = it;
+        pprev = pit;
+        count++;
+    }
+    mp->skiplist->count = count;
+    mp->skiplist->gen++;    // hash索引按新的计数重建
+    mp->skiplist->version = fmap_version;
+}
+
+// 崩溃后检查用: 指针是否指向一个已分配的索引节点
+static struct fmap_index* fmap_check_node_(struct fmap* mp, struct fmap_ptr ptr) {
+    if (ptr.file != 1 || ptr.offset % sizeof(struct fmap_index) != 0 || ptr.offset >= (unsigned long long)mp->skiplist->foffset) {
+        return 0;
+    }
+    if (ptr.offset != 0 && ptr.offset < sizeof(struct fmap_skiplist)) {
+        return 0;
+    }
+    return fmap_ptr_val(ptr);
+}
+
+static int fmap_check_record_(struct fmap* mp, struct fmap_index* it) {
+    if (it->crc && it->crc != fmap_record_crc_(it)) {
+        return 0;
+    }
+    struct fmap_ptr val = it->val;
+    if (val.file < 2 || val.file >= fmap_max_files || !mp->faddr[val.file]) {
+        return 0;
+    }
+    return it->val_size <= it->size && val.offset + it->size <= 1ULL << (val.file + 27);
+}
+
+// 按最底层的顺序重建整个跳表: 丢弃校验失败或顺序错误的节点, 断开的地方尝试从坏节点之后或者上层指针接上
+// 上层按序号重新分层, 和 fmap_bulk_load 一致。丢弃的节点不回收。返回丢弃的数量
+static int fmap_repair_(struct fmap* mp) {
+    struct fmap_ptr head = mp->skiplist->head;
+    struct fmap_index* phead = fmap_ptr_val(head);
+    struct fmap_ptr tail[fmap_max_level];
+    struct fmap_ptr orig[fmap_max_level];    // 保留下来的节点原来在每层最近的指针, 断开时从上层跳过去
+    for (int i = 0; i < fmap_max_level; i++) {
+        tail[i] = head;
+    }
+    memcpy(orig, phead->next, sizeof(orig));
+    struct fmap_index* last = phead;
+    int count = 0, dropped = 0, level = 1, skip = 8, i = 0;
+    struct fmap_ptr cur = orig[0];
+    while (1) {
+        struct fmap_index* pcur = fmap_ptr_is_null(cur) ? 0 : fmap_check_node_(mp, cur);
+        if (pcur && pcur != phead && pcur->prev.file && fmap_check_record_(mp, pcur) && (last == phead || strncmp(pcur->key, last->key, sizeof(last->key)) > 0)) {
+            unsigned long long n = count + 1;
+            int lv = 1;
+            while ((n & 3) == 0 && lv < fmap_max_level) {
+                n >>= 2;
+                lv++;
+            }
+            for (int k = 0; k < fmap_max_level; k++) {
+                if (k == 0 || fmap_ptr_no_null(pcur->next[k])) {
+                    orig[k] = pcur->next[k];
+                }
+            }
+            pcur->prev = tail[0];
+            for (int k = 0; k < lv; k++) {
+                struct fmap_index* ptail = fmap_ptr_val(tail[k]);
+                ptail->next[k] = cur;
+                tail[k] = cur;
+            }
+            level = lv > level ? lv : level;
+            last = pcur;
+            count++;
+            cur = orig[0];
+            skip = 8;
+            i = 0;
+            continue;
+        }
+        if (fmap_ptr_no_null(cur)) {
+            dropped++;
+        }
+        if (pcur && pcur != phead && skip-- > 0 && fmap_ptr_no_null(pcur->next[0])) {    // 坏节点之后的可能还是好的
+            cur = pcur->next[0];
+            continue;
+        }
+        for (i++; i < fmap_max_level; i++) {    // 跳过指向已经处理过的位置的指针
+            struct fmap_index* pnext = fmap_check_node_(mp, orig[i]);
+            if (pnext && pnext != phead && (last == phead || strncmp(pnext->key, last->key, sizeof(last->key)) > 0)) {
+                break;
+            }
+        }
+        if (i >= fmap_max_level) {
+            break;
+        }
+        cur = orig[i];
+        skip = 8;
+    }
+    for (int k = 0; k < fmap_max_level; k++) {
+        struct fmap_index* ptail = fmap_ptr_val(tail[k]);
+        ptail->next[k].file = 0;
+        ptail->next[k].offset = 0;
+    }
+    mp->skiplist->level = level;
+    mp->skiplist->count = count;
+    mp->skiplist->gen++;
+    return dropped;
+}
+
+// 检查一个区域内在链表中的节点(前驱指向它), 前驱指针错误直接按最底层修正, 其它问题返回0需要重建
+static int fmap_verify_chunk_(struct fmap* mp, unsigned long long start, unsigned long long end, int* fixed) {
+    if (end > (unsigned long long)mp->skiplist->foffset) {
+        end = mp->skiplist->foffset;
+    }
+    for (unsigned long long off = start; off < end; off += sizeof(struct fmap_index)) {
+        if (off != 0 && off < sizeof(struct fmap_skiplist)) {
+            continue;    // 文件头里只有头节点
+        }
+        struct fmap_ptr ptr = {.file = 1, .offset = off};
+        struct fmap_index* it = fmap_ptr_val(ptr);
+        if (off != 0) {
+            struct fmap_index* prev = fmap_check_node_(mp, it->prev);
+            if (!it->prev.file || !prev || !fmap_ptr_eqaul(prev->next[0], ptr)) {
+                continue;    // 空闲节点或者已经摘下还没回收的节点
+            }
+            if (!fmap_check_record_(mp, it)) {
+                return 0;
+            }
+        }
+        for (int i = 0; i < fmap_max_level; i++) {
+            if (fmap_ptr_is_null(it->next[i])) {
+                continue;
+            }
+            struct fmap_index* next = fmap_check_node_(mp, it->next[i]);
+            if (!next || next == it || (off != 0 && strncmp(it->key, next->key, sizeof(it->key)) >= 0)) {
+                return 0;
+            }
+            if (i == 0 && !fmap_ptr_eqaul(next->prev, ptr)) {
+                next->prev = ptr;
+                (*fixed)++;
+            }
+        }
+    }
+    return 1;
+}
+
+// 空闲链上只能是已经摘下的节点: 没有前驱, 大小和所在的链一致。崩溃时链表头先于节点落盘会接到存活的记录上,
+// 从第一个不合格的节点截断, 之后的节点不再回收。返回截断的链数
+static int fmap_verify_idles_(struct fmap* mp) {
+    struct fmap_index* head = fmap_ptr_val(mp->skiplist->head);
+    unsigned long long limit = mp->skiplist->foffset / sizeof(struct fmap_index);
+    int dropped = 0;
+    for (int n = 0; n < fmap_max_idles; n++) {
+        struct fmap_ptr* link = &mp->skiplist->idles[n];
+        for (unsigned long long steps = 0; link->file; steps++) {
+            struct fmap_index* it = fmap_check_node_(mp, *link);
+            int ok = it && it != head && !it->prev.file && steps < limit;    // 步数超过节点总数说明成环
+            if (ok && n == 0) {
+                ok = it->size == 0;
+            } else if (ok) {
+                struct fmap_ptr val = it->val;
+                ok = it->size == 1ULL << n && val.file >= 2 && val.file < fmap_max_files && mp->faddr[val.file] && val.offset % it->size == 0 &&
+                     val.offset + it->size <= 1ULL << (val.file + 27);
+            }
+            if (!ok) {
+                link->file = 0;
+                link->offset = 0;
+                dropped++;
+                break;
+            }
+            link = &it->next[0];
+        }
+    }
+    return dropped;
+}
+
+int fmap_verify(struct fmap* mp, int full) {
+    if (mp->readonly) {
+        return -1;
+    }
+    struct fmap_skiplist* sl = mp->skiplist;
+    int fixed = 0;
+    int ok = 1;
+    unsigned long long chunk = 1ULL << sl->dirty_shift;
+    for (int c = 0; ok && c < fmap_dirty_bytes * 8; c++) {
+        if (full || ((sl->dirty_map[c >> 3] >> (c & 7)) & 1)) {
+            ok = fmap_verify_chunk_(mp, c * chunk, (c + 1) * chunk, &fixed);
+        }
+    }
+    if (!ok) {
+        fixed += fmap_repair_(mp) + 1;
+    }
+    if (full || !sl->clean) {
+        fixed += fmap_verify_idles_(mp);
+    }
+    return fixed;
+}
+
+int fmap_checkpoint(struct fmap* mp) {
+    if (mp->readonly) {
+        return -1;
+    }
+    for (int i = 1; i < fmap_max_files; i++) {
+        if (mp->faddr[i] && fdatasync(mp->fd[i]) == -1) {
+            return -1;
+        }
+    }
+    memset(mp->skiplist->dirty_map, 0, sizeof(mp->skiplist->dirty_map));
+    return msync(mp->faddr[1], 4096, MS_SYNC);
+}
+
+static void fmap_touch_pages_(const char* addr, unsigned long long size) {
+    volatile char sum = 0;
+    for (unsigned long long i = 0; i < size; i += 4096) {
+        sum += addr[i];
+    }
+    if (size) {
+        sum += addr[size - 1];
+    }
+}
+
+// 预热: 索引文件已用部分以及所有存活元素的值, 重启后的首批请求不再逐页缺页
+static void fmap_prefault_(struct fmap* mp) {
+    fmap_touch_pages_(mp->faddr[1], mp->skiplist->foffset);
+    if (mp->hash) {
+        fmap_touch_pages_((char*)mp->hash, mp->hash_fsize);
+    }
+    struct fmap_index* head = fmap_ptr_val(mp->skiplist->head);
+    struct fmap_index* it = fmap_node_(mp, head->next[0]);
+    while (it) {
+        if (it->val_size && (!mp->readonly || fmap_ro_valid_(mp, it->val, it->val_size))) {
+            char* val = fmap_ptr_val(it->val);
+            fmap_touch_pages_(val, it->val_size);
+        }
+        it = fmap_node_(mp, it->next[0]);
+    }
+}
+
+struct fmap* fmap_mount_ex(const char* fpath, int flag) {
+    struct fmap* mp = malloc(sizeof(struct fmap));
+    if (!mp || !fpath) {
+        ("malloc fmap failed");
+        return 0;
+    }
+    memset(mp, 0, sizeof(struct fmap));
+    strcpy(mp->fpath, fpath);
+    mp->flag = flag;
+    getrusage(RUSAGE_SELF, &mp->usage);
+    mp->readonly = (flag & k_fmap_mount_readonly) != 0;
+    mp->concurrent = (flag & k_fmap_mount_concurrent) != 0 && !mp->readonly;
+    mp->owner = pthread_self();
+    mp->epoch = 1;
+    char path[1024];
+    int oflag = mp->readonly ? O_RDONLY : O_RDWR | O_CREAT;
+    int prot = mp->readonly ? PROT_READ : PROT_READ | PROT_WRITE;
+
+    // load index
+    {
+        path[snprintf(path, sizeof(path), "%s.1", mp->fpath)] = 0;
+        FILE* file = fopen(path, "r");
+        long long size = 0;
+        if (file) {
+            fseek(file, 0, SEEK_END);
+            size = ftell(file);
+            fclose(file);
+        }
+        int fd = open(path, oflag, S_IRUSR | S_IWUSR);
+        if (fd == -1) {
+            free(mp);
+            return 0;
+        }
+        if (!size && mp->readonly) {
+            close(fd);
+            free(mp);
+            return 0;
+        }
+        if (!size) {
+            size = 1024 * 1024 * 512;
+            if (ftruncate(fd, size) == -1) {
+                close(fd);
+                return 0;
+            }
+        }
+        struct flock fl;
+        fl.l_type = F_WRLCK;
+        fl.l_whence = SEEK_SET;
+        fl.l_start = 0;
+        fl.l_len = 0;    // 包括之后扩容的部分
+        fl.l_pid = getpid();
+        if (!mp->readonly && fcntl(fd, F_SETLK, &fl) == -1) {    // 只读挂载不加锁, 也不修改任何内容
+            close(fd);
+            free(mp);
+            return 0;
+        }
+        char* ptr = mmap(0, fmap_index_map_size, prot, MAP_SHARED, fd, 0);
+        if (ptr == MAP_FAILED) {
+            close(fd);
+            free(mp);
+            return 0;
+        }
+        mp->faddr[1] = ptr;
+        mp->fd[1] = fd;
+        mp->skiplist = (struct fmap_skiplist*)ptr;
+        if (mp->readonly) {
+            if (mp->skiplist->fsize == 0) {
+                munmap(ptr, fmap_index_map_size);
+                close(fd);
+                free(mp);
+                return 0;
+            }
+        } else if (mp->skiplist->fsize == 0) {
+            mp->skiplist->fsize = size;
+            mp->skiplist->foffset = sizeof(struct fmap_skiplist);
+            mp->skiplist->head.file = 1;
+            mp->skiplist->version = fmap_version;
+        } else if (mp->skiplist->fsize != size) {    // 正常情况下挂载不写任何页面
+            assert(mp->skiplist->fsize <= size);
+            mp->skiplist->fsize = size;    // 扩容ftruncate之后可能还没来得及记录
+        }
+        if (!mp->readonly && (mp->skiplist->seq & 1)) {
+            mp->skiplist->seq++;    // 上次写入中途退出
+        }
+        if (!mp->readonly) {
+            fmap_dirty_shift_fix_(mp);
+        }
+        if (!mp->readonly && mp->skiplist->version < fmap_version) {
+            fmap_upgrade_(mp);
+        }
+    }
+
+    for (int i = 2; i < fmap_max_files; i++) {
+        path[snprintf(path, sizeof(path), "%s.%d", mp->fpath, i)] = 0;
+        FILE* file = fopen(path, "r");
+        if (!file) {
+            continue;
+        }
+        fclose(file);
+
+        int fd = open(path, oflag, S_IRUSR | S_IWUSR);
+        if (fd == -1) {
+            free(mp);
+            return 0;
+        }
+        unsigned long long size = pow(2, i + 27);
+        struct flock fl;
+        fl.l_type = F_WRLCK;
+        fl.l_whence = SEEK_SET;
+        fl.l_start = 0;
+        fl.l_len = size;
+        fl.l_pid = getpid();
+        if (!mp->readonly && fcntl(fd, F_SETLK, &fl) == -1) {
+            close(fd);
+            free(mp);
+            return 0;
+        }
+        char* ptr = mmap(0, size, prot, MAP_SHARED, fd, 0);
+        if (ptr == MAP_FAILED) {
+            close(fd);
+            free(mp);
+            return 0;
+        }
+        mp->faddr[i] = ptr;
+        mp->fd[i] = fd;
+        fmap_advise_(mp, i, ptr, size);
+    }
+    fmap_advise_(mp, 1, mp->faddr[1], fmap_index_map_size);
+    if (!mp->readonly && !mp->skiplist->clean) {    // 上次没有正常卸载, 检查上个检查点之后修改过的区域
+        fmap_verify(mp, 0);
+    }
+
+    if ((flag & k_fmap_mount_hash) && !mp->readonly) {
+        if (!fmap_hash_mount_(mp)) {
+            fmap_unmount(mp);
+            return 0;
+        }
+    }
+    if (flag & k_fmap_mount_prefault) {
+        fmap_prefault_(mp);
+    }
+    return mp;
+}
+
+struct fmap* fmap_mount(const char* fpath) {
+    return fmap_mount_ex(fpath, 0);
+}
+
+struct fmap* fmap_mount_readonly(const char* fpath) {
+    return fmap_mount_ex(fpath, k_fmap_mount_readonly);
+}
+
+static void fmap_durability_stop_(struct fmap* mp);
+static int fmap_flush_(struct fmap* mp);
+
+void fmap_unmount(struct fmap* mp) {
+    if (mp->durability != k_fmap_durability_none) {
+        fmap_durability_stop_(mp);
+        fmap_flush_(mp);
+    }
+    for (int i = 0; i < mp->retired_count; i++) {    // 卸载时不应再有读线程
+        fmap_element_free_(mp, mp->retired[i].it);
+    }
+    free(mp->retired);
+    if (!mp->readonly && fmap_checkpoint(mp) == 0) {
+        mp->skiplist->clean = 1;
+        msync(mp->faddr[1], 4096, MS_SYNC);
+    }
+    if (mp->hash) {
+        munmap(mp->hash, mp->hash_fsize);
+    }
+    if (mp->hash_fd) {
+        close(mp->hash_fd);
+    }
+    for (int i = 2; i < fmap_max_files; i++) {
+        if (!mp->faddr[i]) {
+            continue;
+        }
+        unsigned long long size = pow(2, i + 27);
+        munmap(mp->faddr[i], size);
+        close(mp->fd[i]);
+    }
+    munmap(mp->faddr[1], fmap_index_map_size);
+    close(mp->fd[1]);
+
+    memset(mp, 0, sizeof(struct fmap));
+    free(mp);
+}
+
+int fmap_count(struct fmap* mp) {
+    return mp->skiplist->count;
+}
+
+// 只读挂载时, 在顺序锁内执行查找, 期间写进程有结构修改就重试
+// keep: 返回的是节点, 在顺序锁内记下它的key. 节点之后可能被删除复用, 下一次fmap_nxt/fmap_prv按记下的key重新定位
+#define fmap_ro_retry_(mp, rst, call, keep)                                         \
+    while (1) {                                                                     \
+        unsigned long long _seq = fmap_seq_begin(mp);                               \
+        mp->torn = 0;                                                               \
+        rst = call;                                                                 \
+        if (keep && rst) {                                                          \
+            memcpy(mp->ro_key, ((struct fmap_index*)rst)->key, sizeof(mp->ro_key)); \
+            mp->ro_key[sizeof(mp->ro_key) - 1] = 0;                                 \
+        }                                                                           \
+        if (!fmap_seq_retry(mp, _seq)) {                                            \
+            if (mp->torn) { /* 没有并发修改却读到坏指针 */                          \
+                rst = 0;                                                            \
+            }                                                                       \
+            if (keep) {                                                             \
+                mp->ro_last = (struct fmap_index*)rst;                              \
+                mp->ro_seq = _seq;                                                  \
+            }                                                                       \
+            break;                                                                  \
+        }                                                                           \
+    }
+
+static struct fmap_index* fmap_get_(struct fmap* mp, const char* key) {
     struct fmap_ptr search = mp->skiplist->head;
-    for (int i = mp->skiplist->level - 1; i >= 0; i--) {
+    for (int i = fmap_level_(mp) - 1; i >= 0; i--) {
         search = select_closest_(mp, search, i, key);
         struct fmap_index* psearch = fmap_ptr_val(search);
-        struct fmap_ptr tar = psearch->next[i];
-        if (fmap_ptr_no_null(tar)) {
-            struct fmap_index* ptar = fmap_ptr_val(tar);
-            if (0 == strcmp(ptar->key, key)) {
-                return ptar;
-            }
+        struct fmap_index* ptar = fmap_node_(mp, fmap_ptr_load_(&psearch->next[i]));
+        if (ptar && 0 == strcmp(ptar->key, key)) {
+            return ptar;
+        }
+    }
+    return 0;
+}
+
+struct fmap_index* fmap_get(struct fmap* mp, const char* key) {
+    if (mp->hash && (!mp->concurrent || pthread_equal(mp->owner, pthread_self()))) {    // hash索引重建会重新映射, 只给写线程用
+        return fmap_hash_get_(mp, key);
+    }
+    if (mp->readonly) {
+        struct fmap_index* rst;
+        fmap_ro_retry_(mp, rst, fmap_get_(mp, key), 1);
+        return rst;
+    }
+    return fmap_get_(mp, key);
+}
+
+#define fmap_buddy_scan 32    // 查找空闲伙伴块时最多扫描的空闲链长度
+
+// 块的后一半伙伴如果空闲, 从空闲链摘下, 原块原地扩大一倍。刚拆分出来的伙伴总在链表头附近
+static int fmap_buddy_merge_(struct fmap* mp, struct fmap_index* element) {
+    unsigned long long size = element->size;
+    if (element->val.offset & size) {    // 在后一半, 合并需要搬动数据
+        return 0;
+    }
+    int n = log2(size);
+    struct fmap_ptr* link = &mp->skiplist->idles[n];
+    for (int i = 0; i < fmap_buddy_scan; i++) {
+        struct fmap_ptr ptr = *link;
+        if (fmap_ptr_is_null(ptr)) {
+            break;
+        }
+        struct fmap_index* idle = fmap_ptr_val(ptr);
+        if (idle->val.file == element->val.file && idle->val.offset == element->val.offset + size) {
+            fmap_mark_(mp, link);    // 前一个空闲节点或者文件头
+            *link = idle->next[0];
+            fmap_index_spare_(mp, ptr);
+            element->size = size * 2;
+            return 1;
         }
+        link = &idle->next[0];
     }
     return 0;
 }
 
+// keep为0时调用方会整体覆盖, 不复制旧值也不清零
+static struct fmap_index* fmap_resize_(struct fmap* mp, struct fmap_index* element, unsigned int new_size, int keep) {
+    unsigned long long old_size = keep ? element->val_size : new_size;
+    fmap_write_begin_(mp);
+    fmap_mark_(mp, element);
+    while (element->size < new_size && fmap_buddy_merge_(mp, element)) {
+    }
+    if (element->size < new_size) {    // 只搬迁值: 新块复制后与原节点交换, 原块随临时节点回收
+        struct fmap_ptr ptr = fmap_element_malloc_val_(mp, new_size);
+        struct fmap_index* tmp = fmap_ptr_val(ptr);
+        void* src = fmap_ptr_val(element->val);
+        void* tar = fmap_ptr_val(tmp->val);
+        if (keep) {
+            memcpy(tar, src, old_size < new_size ? old_size : new_size);
+        }
+        struct fmap_ptr val = element->val;
+        unsigned long long size = element->size;
+        element->size = tmp->size;
+        fmap_ptr_store_(&element->val, tmp->val);
+        tmp->val = val;
+        tmp->size = size;
+        fmap_element_retire_(mp, ptr);    // 并发读线程可能还在读旧值
+    }
+    fmap_dirty_(mp, element->val.file);
+    if (new_size > old_size) {
+        char* tar = fmap_ptr_val(element->val);
+        memset(tar + old_size, 0, new_size - old_size);
+    }
+    __atomic_store_n(&element->val_size, new_size, __ATOMIC_RELEASE);
+    fmap_seal_(element);
+    fmap_write_end_(mp);
+    return element;
+}
+
+struct fmap_index* fmap_resize(struct fmap* mp, struct fmap_index* element, unsigned int new_size) {
+    if (mp->readonly) {
+        return 0;
+    }
+    return fmap_resize_(mp, element, new_size, 1);
+}
+
 struct fmap_index* fmap_add(struct fmap* mp, const char* key, const void* val, unsigned int size);
-struct fmap_index* fmap_del(struct fmap* mp, const char* key);
 struct fmap_index* fmap_touch(struct fmap* mp, const char* key, unsigned int size) {
     struct fmap_index* it = fmap_get(mp, key);
     if (it) {
-        if (it->val_size != size) {
+        if (it->val_size > size) {
             assert(0);    // 直接跪掉，不然丢数据
         }
+        if (it->val_size < size) {
+            return fmap_resize(mp, it, size);    // 结构体末尾新增字段, 原数据保留, 新增部分清零
+        }
         return it;
     }
     return fmap_add(mp, key, 0, size);
 }
 struct fmap_index* fmap_put(struct fmap* mp, const char* key, const void* val, unsigned int size) {
+    if (mp->readonly) {
+        return 0;
+    }
     struct fmap_index* it = fmap_get(mp, key);
     if (it) {
         if (it->size < size) {
-            fmap_del(mp, key);
+            fmap_resize_(mp, it, size, 0);
+        }
+        fmap_write_begin_(mp);
+        fmap_mark_(mp, it);
+        __atomic_store_n(&it->val_size, size, __ATOMIC_RELEASE);
+        fmap_seal_(it);
+        fmap_dirty_(mp, it->val.file);
+        void* tar = fmap_ptr_val(it->val);
+        if (val) {
+            memcpy(tar, val, size);
         } else {
-            it->val_size = size;
-            void* tar = fmap_ptr_val(it->val);
-            if (val) {
-                memcpy(tar, val, size);
-            } else {
-                memset(tar, 0, size);
-            }
-            return it;
+            memset(tar, 0, size);
         }
+        fmap_write_end_(mp);
+        return it;
     }
     return fmap_add(mp, key, val, size);
 }
 
-static void fmap_add_(struct fmap* mp, struct fmap_ptr element) {
-    int lv = random_level_();
-    for (int i = mp->skiplist->level; i < lv; i++) {
-        mp->skiplist->_head.next[i] = element;
-    }
+// 在update[i]之后链接element, 先填好element自身的指针再自底向上挂入
+static void fmap_link_(struct fmap* mp, struct fmap_ptr element, struct fmap_ptr* update, int lv) {
+    mp->skiplist->gen++;
+    fmap_write_begin_(mp);
     struct fmap_index* pelement = fmap_ptr_val(element);
-    struct fmap_ptr search = mp->skiplist->head;
-    struct fmap_index* psearch = fmap_ptr_val(search);
-    for (int i = mp->skiplist->level - 1; i >= 0; i--) {
-        search = select_closest_(mp, search, i, pelement->key);
-        psearch = fmap_ptr_val(search);
-        if (i >= lv)
-            continue;
-        if (fmap_ptr_no_null(psearch->next[i]))
-            pelement->next[i] = psearch->next[i];
-        psearch->next[i] = element;
-        if (i == 0) {
-            pelement->prev = search;
-        }
+    fmap_mark_(mp, pelement);
+    for (int i = 0; i < lv; i++) {
+        struct fmap_index* pupdate = fmap_ptr_val(update[i]);
+        fmap_mark_(mp, pupdate);
+        pelement->next[i] = pupdate->next[i];
+    }
+    pelement->prev = update[0];
+    for (int i = 0; i < lv; i++) {
+        struct fmap_index* pupdate = fmap_ptr_val(update[i]);
+        fmap_ptr_store_(&pupdate->next[i], element);
+    }
+    if (fmap_ptr_no_null(pelement->next[0])) {
+        struct fmap_index* pnext = fmap_ptr_val(pelement->next[0]);
+        fmap_mark_(mp, pnext);
+        fmap_ptr_store_(&pnext->prev, element);
     }
     if (lv > mp->skiplist->level) {
-        mp->skiplist->level = lv;
+        __atomic_store_n(&mp->skiplist->level, lv, __ATOMIC_RELEASE);
     }
     mp->skiplist->count++;
+    fmap_write_end_(mp);
+    if (mp->hash) {
+        fmap_hash_add_(mp, element);
+    }
 }
-struct fmap_index* fmap_add(struct fmap* mp, const char* key, const void* val, unsigned int size) {
-    struct fmap_ptr ptr = fmap_element_malloc_val_(mp, size);
+
+static void fmap_add_(struct fmap* mp, struct fmap_ptr element) {
+    struct fmap_index* pelement = fmap_ptr_val(element);
+    struct fmap_ptr update[fmap_max_level];
+    int lv = random_level_();
+    int top = lv > mp->skiplist->level ? lv : mp->skiplist->level;
+    struct fmap_ptr search = mp->skiplist->head;
+    for (int i = top - 1; i >= 0; i--) {
+        search = select_closest_(mp, search, i, pelement->key);
+        update[i] = search;
+    }
+    fmap_link_(mp, element, update, lv);
+}
+
+static struct fmap_ptr fmap_element_new_(struct fmap* mp, struct fmap_carve_* carve, const char* key, const void* val, unsigned int size) {
+    struct fmap_ptr ptr = carve ? fmap_carve_malloc_val_(mp, carve, size) : fmap_element_malloc_val_(mp, size);
     struct fmap_index* element = fmap_ptr_val(ptr);
     strncpy(element->key, key, sizeof(element->key) - 1);
     element->key[sizeof(element->key) - 1] = 0;
     element->val_size = size;
+    fmap_mark_(mp, element);
+    fmap_seal_(element);
+    fmap_dirty_(mp, 1);
+    fmap_dirty_(mp, element->val.file);
     void* tar = fmap_ptr_val(element->val);
     if (val) {
         memcpy(tar, val, size);
     } else {
         memset(tar, 0, size);
     }
+    return ptr;
+}
+
+struct fmap_index* fmap_add(struct fmap* mp, const char* key, const void* val, unsigned int size) {
+    if (mp->readonly) {
+        return 0;
+    }
+    struct fmap_ptr ptr = fmap_element_new_(mp, 0, key, val, size);
     fmap_add_(mp, ptr);
-    return element;
+    return fmap_ptr_val(ptr);
 }
 
-struct fmap_index* fmap_get_ge(struct fmap* mp, const char* key) {
+struct fmap_kv {
+    const char* key;
+    const void* val;
+    unsigned int size;
+};
+
+int fmap_bulk_load(struct fmap* mp, int (*next)(void* ud, struct fmap_kv* kv), void* ud) {
+    if (mp->readonly) {
+        return -1;
+    }
+    // 每层的尾节点
+    struct fmap_ptr tail[fmap_max_level];
+    struct fmap_ptr search = mp->skiplist->head;
+    for (int i = fmap_max_level - 1; i >= 0; i--) {
+        struct fmap_index* psearch = fmap_ptr_val(search);
+        while (fmap_ptr_no_null(psearch->next[i])) {
+            search = psearch->next[i];
+            psearch = fmap_ptr_val(search);
+        }
+        tail[i] = search;
+    }
+
+    mp->skiplist->gen++;
+    int rst = 0;
+    struct fmap_kv kv;
+    struct fmap_carve_ carve = {0};
+    struct fmap_index* last = fmap_ptr_val(tail[0]);
+    while (next(ud, &kv)) {
+        if (!fmap_ptr_eqaul(tail[0], mp->skiplist->head) && strcmp(kv.key, last->key) <= 0) {
+            rst = -1;
+            break;
+        }
+        struct fmap_ptr ptr = fmap_element_new_(mp, &carve, kv.key, kv.val, kv.size);
+        struct fmap_index* pelement = fmap_ptr_val(ptr);
+        // 按序号确定层数, 每4个升一层, 与random_level_的概率接近
+        unsigned long long n = mp->skiplist->count + 1;
+        int lv = 1;
+        while ((n & 3) == 0 && lv < fmap_max_level) {
+            n >>= 2;
+            lv++;
+        }
+        fmap_write_begin_(mp);
+        pelement->prev = tail[0];
+        for (int i = 0; i < lv; i++) {
+            struct fmap_index* ptail = fmap_ptr_val(tail[i]);
+            fmap_mark_(mp, ptail);
+            fmap_ptr_store_(&ptail->next[i], ptr);
+            tail[i] = ptr;
+        }
+        if (lv > mp->skiplist->level) {
+            __atomic_store_n(&mp->skiplist->level, lv, __ATOMIC_RELEASE);
+        }
+        mp->skiplist->count++;
+        fmap_write_end_(mp);
+        last = pelement;
+        rst++;
+    }
+    fmap_carve_finish_(mp, &carve);
+    if (mp->hash) {
+        fmap_hash_rebuild_(mp);
+    }
+    return rst;
+}
+
+// 稳定的归并排序: 相同的key保持传入的顺序, 去重时留下最后一个, 和逐个fmap_put的结果一致
+static void fmap_kv_sort_(struct fmap_kv* kvs, int count) {
+    if (count < 2) {
+        return;
+    }
+    struct fmap_kv* tmp = malloc(sizeof(struct fmap_kv) * count);
+    struct fmap_kv* src = kvs;
+    struct fmap_kv* dst = tmp;
+    for (int width = 1; width < count; width *= 2) {
+        for (int lo = 0; lo < count; lo += width * 2) {
+            int mid = lo + width < count ? lo + width : count;
+            int hi = lo + width * 2 < count ? lo + width * 2 : count;
+            int i = lo, j = mid, k = lo;
+            while (i < mid && j < hi) {
+                dst[k++] = strcmp(src[j].key, src[i].key) < 0 ? src[j++] : src[i++];
+            }
+            while (i < mid) {
+                dst[k++] = src[i++];
+            }
+            while (j < hi) {
+                dst[k++] = src[j++];
+            }
+        }
+        struct fmap_kv* t = src;
+        src = dst;
+        dst = t;
+    }
+    if (src != kvs) {
+        memcpy(kvs, src, sizeof(struct fmap_kv) * count);
+    }
+    free(tmp);
+}
+
+struct fmap_kv_array_ {
+    struct fmap_kv* kvs;
+    int count;
+    int i;
+};
+
+static int fmap_kv_array_next_(void* ud, struct fmap_kv* kv) {
+    struct fmap_kv_array_* arr = ud;
+    if (arr->i >= arr->count) {
+        return 0;
+    }
+    while (arr->i + 1 < arr->count && strcmp(arr->kvs[arr->i].key, arr->kvs[arr->i + 1].key) == 0) {
+        arr->i++;
+    }
+    *kv = arr->kvs[arr->i++];
+    return 1;
+}
+
+struct fmap_index* fmap_put(struct fmap* mp, const char* key, const void* val, unsigned int size);
+int fmap_put_batch(struct fmap* mp, struct fmap_kv* kvs, int count) {
+    if (mp->readonly) {
+        return 0;
+    }
+    fmap_kv_sort_(kvs, count);
+    struct fmap_kv_array_ arr = {.kvs = kvs, .count = count, .i = 0};
+    if (mp->skiplist->count == 0) {
+        return fmap_bulk_load(mp, fmap_kv_array_next_, &arr);
+    }
+
+    // 有序归并: update保存上一个key在每层的前驱, 下一个key从更靠后的那个位置继续查找
+    struct fmap_ptr head = mp->skiplist->head;
+    struct fmap_ptr update[fmap_max_level];
+    for (int i = 0; i < fmap_max_level; i++) {
+        update[i] = head;
+    }
+    int rst = 0;
+    struct fmap_kv kv;
+    struct fmap_carve_ carve = {0};
+    while (fmap_kv_array_next_(&arr, &kv)) {
+        struct fmap_ptr search = head;
+        for (int i = fmap_max_level - 1; i >= 0; i--) {
+            if (!fmap_ptr_eqaul(update[i], head)) {
+                struct fmap_index* pupdate = fmap_ptr_val(update[i]);
+                struct fmap_index* psearch = fmap_ptr_val(search);
+                if (fmap_ptr_eqaul(search, head) || strcmp(pupdate->key, psearch->key) > 0) {
+                    search = update[i];
+                }
+            }
+            search = select_closest_(mp, search, i, kv.key);
+            update[i] = search;
+        }
+        rst++;
+        struct fmap_index* prev = fmap_ptr_val(update[0]);
+        if (fmap_ptr_no_null(prev->next[0])) {
+            struct fmap_index* it = fmap_ptr_val(prev->next[0]);
+            if (strcmp(it->key, kv.key) == 0) {
+                fmap_put(mp, kv.key, kv.val, kv.size);    // 前驱都小于key, 不会被删除
+                continue;
+            }
+        }
+        struct fmap_ptr ptr = fmap_element_new_(mp, &carve, kv.key, kv.val, kv.size);
+        int lv = random_level_();
+        fmap_link_(mp, ptr, update, lv);
+        for (int i = 0; i < lv; i++) {
+            update[i] = ptr;
+        }
+    }
+    fmap_carve_finish_(mp, &carve);
+    return rst;
+}
+
+static struct fmap_index* fmap_get_ge_(struct fmap* mp, const char* key) {
     struct fmap_ptr search = mp->skiplist->head;
     struct fmap_index* psearch = fmap_ptr_val(search);
     struct fmap_index* le = 0;
-    for (int i = mp->skiplist->level - 1; i >= 0; i--) {
+    for (int i = fmap_level_(mp) - 1; i >= 0; i--) {
         search = select_closest_(mp, search, i, key);
         psearch = fmap_ptr_val(search);
-        struct fmap_ptr tar = psearch->next[i];
-        if (fmap_ptr_no_null(tar)) {
-            struct fmap_index* ptar = fmap_ptr_val(tar);
+        struct fmap_index* ptar = fmap_node_(mp, fmap_ptr_load_(&psearch->next[i]));
+        if (ptar) {
             if (strcmp(ptar->key, key) == 0) {
                 return ptar;
             }
@@ -426,6 +1713,62 @@ struct fmap_index* fmap_get_ge(struct fmap* mp, const char* key) {
     return le;
 }
 
+struct fmap_index* fmap_get_ge(struct fmap* mp, const char* key) {
+    if (mp->readonly) {
+        struct fmap_index* rst;
+        fmap_ro_retry_(mp, rst, fmap_get_ge_(mp, key), 1);
+        return rst;
+    }
+    return fmap_get_ge_(mp, key);
+}
+
+// 只读挂载: 继续遍历的key. it是上一次返回的节点时用当时在顺序锁内记下的key, it可能已经被删除, 槽位被别的记录复用
+// 调用方拿着更早返回的节点时只能直接读it的key
+static void fmap_ro_key_(struct fmap* mp, struct fmap_index* it, char* key) {
+    memcpy(key, it == mp->ro_last ? mp->ro_key : it->key, sizeof(it->key));
+    key[sizeof(it->key) - 1] = 0;
+}
+
+// 只读挂载: 上次返回之后有结构修改的话it可能已经被回收, 按key重新定位
+static inline int fmap_ro_unchanged_(struct fmap* mp, struct fmap_index* it) {
+    return it == mp->ro_last && mp->ro_seq == __atomic_load_n(&mp->skiplist->seq, __ATOMIC_ACQUIRE);
+}
+
+static struct fmap_index* fmap_ro_nxt_(struct fmap* mp, struct fmap_index* it, const char* key) {
+    if (fmap_ro_unchanged_(mp, it)) {
+        return fmap_node_(mp, fmap_ptr_load_(&it->next[0]));
+    }
+    struct fmap_index* rst = fmap_get_ge_(mp, key);
+    if (rst && strcmp(rst->key, key) == 0) {
+        rst = fmap_node_(mp, fmap_ptr_load_(&rst->next[0]));
+    }
+    return rst;
+}
+
+static struct fmap_index* fmap_ro_prv_(struct fmap* mp, struct fmap_index* it, const char* key) {
+    if (!fmap_ro_unchanged_(mp, it)) {
+        it = fmap_get_ge_(mp, key);
+        if (!it) {    // 没有更大的, 取最后一个
+            struct fmap_ptr search = mp->skiplist->head;
+            for (int i = fmap_level_(mp) - 1; i >= 0; i--) {
+                struct fmap_index* psearch = fmap_ptr_val(search);
+                struct fmap_index* pnext;
+                while ((pnext = fmap_node_(mp, fmap_ptr_load_(&psearch->next[i])))) {
+                    search = psearch->next[i];
+                    psearch = pnext;
+                }
+            }
+            return fmap_ptr_eqaul(search, mp->skiplist->head) ? 0 : fmap_ptr_val(search);
+        }
+    }
+    struct fmap_ptr prev = fmap_ptr_load_(&it->prev);
+    if (fmap_ptr_eqaul(prev, mp->skiplist->head)) {
+        return 0;
+    }
+    return fmap_node_(mp, prev);
+}
+
+struct fmap_index* fmap_prv(struct fmap* mp, struct fmap_index* it);
 struct fmap_index* fmap_get_le(struct fmap* mp, const char* key) {
     struct fmap_index* rst = fmap_get_ge(mp, key);
     while (1) {
@@ -435,11 +1778,16 @@ struct fmap_index* fmap_get_le(struct fmap* mp, const char* key) {
         if (strcmp(rst->key, key) <= 0) {
             return rst;
         }
-        rst = fmap_ptr_val(rst->prev);
+        rst = fmap_prv(mp, rst);
     }
 }
 
 struct fmap_index* fmap_del(struct fmap* mp, const char* key) {
+    if (mp->readonly || (mp->hash && !fmap_hash_get_(mp, key))) {
+        return 0;
+    }
+    mp->skiplist->gen++;
+    fmap_write_begin_(mp);
     struct fmap_ptr search = mp->skiplist->head;
     struct fmap_index* psearch = fmap_ptr_val(search);
     struct fmap_ptr find = {0};
@@ -451,39 +1799,222 @@ struct fmap_index* fmap_del(struct fmap* mp, const char* key) {
         if (fmap_ptr_no_null(tar)) {
             struct fmap_index* ptar = fmap_ptr_val(tar);
             if (0 == strcmp(ptar->key, key)) {
-                psearch->next[i] = ptar->next[i];
+                fmap_mark_(mp, psearch);
+                fmap_ptr_store_(&psearch->next[i], ptar->next[i]);
                 next = ptar->next[i];
                 find = tar;
             }
         }
     }
-    mp->skiplist->count--;
     if (fmap_ptr_no_null(find)) {
-        fmap_element_free_(mp, find);
+        if (fmap_ptr_no_null(next)) {
+            struct fmap_index* pfind = fmap_ptr_val(find);
+            struct fmap_index* pnext = fmap_ptr_val(next);
+            fmap_mark_(mp, pnext);
+            fmap_ptr_store_(&pnext->prev, pfind->prev);
+        }
+        mp->skiplist->count--;
+        if (mp->hash) {
+            fmap_hash_del_(mp, find);
+        }
+        fmap_element_retire_(mp, find);
     }
+    fmap_write_end_(mp);
     return fmap_ptr_val(next);
 }
 
+int fmap_del_range(struct fmap* mp, const char* lo, const char* hi) {
+    if (mp->readonly || (hi && strcmp(lo, hi) >= 0)) {
+        return 0;
+    }
+    struct fmap_ptr update_lo[fmap_max_level];
+    struct fmap_ptr update_hi[fmap_max_level];
+    struct fmap_ptr search = mp->skiplist->head;
+    for (int i = mp->skiplist->level - 1; i >= 0; i--) {
+        search = select_closest_(mp, search, i, lo);
+        update_lo[i] = search;
+    }
+    search = mp->skiplist->head;
+    for (int i = mp->skiplist->level - 1; i >= 0; i--) {
+        if (hi) {
+            search = select_closest_(mp, search, i, hi);
+        } else {
+            struct fmap_index* psearch = fmap_ptr_val(search);
+            while (fmap_ptr_no_null(psearch->next[i])) {
+                search = psearch->next[i];
+                psearch = fmap_ptr_val(search);
+            }
+        }
+        update_hi[i] = search;
+    }
+    if (fmap_ptr_eqaul(update_lo[0], update_hi[0])) {
+        return 0;
+    }
+
+    // 整段摘下: 每层前驱直接指向区间之后的节点
+    mp->skiplist->gen++;
+    fmap_write_begin_(mp);
+    struct fmap_index* plo = fmap_ptr_val(update_lo[0]);
+    struct fmap_ptr first = plo->next[0];
+    for (int i = mp->skiplist->level - 1; i >= 0; i--) {
+        if (fmap_ptr_eqaul(update_lo[i], update_hi[i])) {
+            continue;
+        }
+        struct fmap_index* pl = fmap_ptr_val(update_lo[i]);
+        struct fmap_index* ph = fmap_ptr_val(update_hi[i]);
+        fmap_mark_(mp, pl);
+        fmap_ptr_store_(&pl->next[i], ph->next[i]);
+    }
+    struct fmap_index* plast = fmap_ptr_val(update_hi[0]);
+    if (fmap_ptr_no_null(plast->next[0])) {
+        struct fmap_index* pnext = fmap_ptr_val(plast->next[0]);
+        fmap_mark_(mp, pnext);
+        fmap_ptr_store_(&pnext->prev, update_lo[0]);
+    }
+
+    // 逐个回收, 预取下一个节点
+    int count = 0;
+    struct fmap_ptr it = first;
+    while (1) {
+        struct fmap_index* pit = fmap_ptr_val(it);
+        struct fmap_ptr next = pit->next[0];
+        int last = fmap_ptr_eqaul(it, update_hi[0]);
+        if (!last) {
+            struct fmap_index* pnext = fmap_ptr_val(next);
+            __builtin_prefetch(pnext);
+            __builtin_prefetch(&pnext->next[0]);
+        }
+        if (mp->hash) {
+            fmap_hash_del_(mp, it);
+        }
+        fmap_element_retire_(mp, it);
+        count++;
+        if (last) {
+            break;
+        }
+        it = next;
+    }
+    mp->skiplist->count -= count;
+    fmap_write_end_(mp);
+    return count;
+}
+
+struct fmap_index* fmap_nxt(struct fmap* mp, struct fmap_index* it);
+int fmap_scan_prefix(struct fmap* mp, const char* prefix, int (*cb)(void* ud, struct fmap_index* it), void* ud) {
+    size_t len = strlen(prefix);
+    int count = 0;
+    if (mp->readonly) {    // 只读挂载每一步都要校验重试, 走通用接口
+        for (struct fmap_index* it = fmap_get_ge(mp, prefix); it && strncmp(it->key, prefix, len) == 0; it = fmap_nxt(mp, it)) {
+            count++;
+            if (cb(ud, it)) {
+                break;
+            }
+        }
+        return count;
+    }
+    struct fmap_index* it = fmap_get_ge_(mp, prefix);
+    struct fmap_index* next = it ? fmap_node_(mp, fmap_ptr_load_(&it->next[0])) : 0;
+    while (it && strncmp(it->key, prefix, len) == 0) {
+        // 流水线: 处理当前节点时, 下一个节点的值和下下个节点已经在路上
+        struct fmap_index* after = 0;
+        if (next) {
+            after = fmap_node_(mp, fmap_ptr_load_(&next->next[0]));
+            char* val = fmap_ptr_val(next->val);
+            __builtin_prefetch(val);
+            if (after) {
+                __builtin_prefetch(after);
+                __builtin_prefetch(&after->next[0]);
+            }
+        }
+        count++;
+        if (cb(ud, it)) {
+            break;
+        }
+        it = next;
+        next = after;
+    }
+    return count;
+}
+
 struct fmap_index* fmap_nxt(struct fmap* mp, struct fmap_index* it) {
-    return fmap_ptr_val(it->next[0]);
+    if (mp->readonly) {
+        char key[sizeof(it->key)];
+        fmap_ro_key_(mp, it, key);
+        struct fmap_index* rst;
+        fmap_ro_retry_(mp, rst, fmap_ro_nxt_(mp, it, key), 1);
+        return rst;
+    }
+    struct fmap_ptr next = fmap_ptr_load_(&it->next[0]);
+    return fmap_ptr_val(next);
 }
 
 struct fmap_index* fmap_prv(struct fmap* mp, struct fmap_index* it) {
-    if (fmap_ptr_eqaul(it->prev, mp->skiplist->head)) {
+    if (mp->readonly) {
+        char key[sizeof(it->key)];
+        fmap_ro_key_(mp, it, key);
+        struct fmap_index* rst;
+        fmap_ro_retry_(mp, rst, fmap_ro_prv_(mp, it, key), 1);
+        return rst;
+    }
+    struct fmap_ptr prev = fmap_ptr_load_(&it->prev);
+    if (fmap_ptr_eqaul(prev, mp->skiplist->head)) {
+        return 0;
+    }
+    return fmap_ptr_val(prev);
+}
+
+int fmap_read_begin(struct fmap* mp) {
+    static __thread int hint = 0;
+    while (1) {
+        for (int i = 0; i < fmap_max_readers; i++) {
+            int slot = (hint + i) % fmap_max_readers;
+            long long expect = 0;
+            long long epoch = __atomic_load_n(&mp->epoch, __ATOMIC_SEQ_CST);
+            if (__atomic_compare_exchange_n(&mp->readers[slot].epoch, &expect, epoch, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+                hint = slot;
+                return slot;
+            }
+        }
+        sched_yield();
+    }
+}
+
+void fmap_read_end(struct fmap* mp, int slot) {
+    __atomic_store_n(&mp->readers[slot].epoch, 0, __ATOMIC_RELEASE);
+}
+
+// 只读挂载: 大小只读一次, 和值的位置一起在顺序锁内取
+static void* fmap_ro_val_(struct fmap* mp, struct fmap_index* element, unsigned int safe_size) {
+    if (__atomic_load_n(&element->val_size, __ATOMIC_ACQUIRE) != safe_size) {
+        return 0;
+    }
+    struct fmap_ptr val = fmap_ptr_load_(&element->val);
+    if (!fmap_ro_valid_(mp, val, safe_size)) {
         return 0;
     }
-    return fmap_ptr_val(it->prev);
+    return fmap_ptr_val(val);
 }
 
 void* fmap_val(struct fmap* mp, struct fmap_index* element, unsigned int safe_size) {
-    if (element->val_size != safe_size) {
-        assert(0);
+    if (mp->readonly) {
+        void* rst;
+        fmap_ro_retry_(mp, rst, fmap_ro_val_(mp, element, safe_size), 0);
+        return rst;
+    }
+    // 大小只读一次. 读线程在fmap_val_size和这里之间, 写线程可能刚好resize/put改了大小, 返回0让读线程重新取
+    if (__atomic_load_n(&element->val_size, __ATOMIC_ACQUIRE) != safe_size) {
+        if (!mp->concurrent || pthread_equal(mp->owner, pthread_self())) {
+            assert(0);    // 写线程自己传错了大小, 直接跪掉, 不然丢数据
+        }
+        return 0;
     }
-    return fmap_ptr_val(element->val);
+    struct fmap_ptr val = fmap_ptr_load_(&element->val);
+    fmap_dirty_(mp, val.file);    // 拿到指针之后可能会写
+    return fmap_ptr_val(val);
 }
 
 unsigned int fmap_val_size(struct fmap_index* element) {
-    return element->val_size;
+    return __atomic_load_n(&element->val_size, __ATOMIC_ACQUIRE);
 }
 
 const char* fmap_key(struct fmap_index* element) {
@@ -506,3 +2037,201 @@ int fmap_sync(struct fmap_index* element, int flag) {
     }
     return msync(element, element->size, _flag);
 }
+
+// 用reflink把src复制到path: 只复制元数据, 之后两边的修改按页写时复制。文件系统不支持时返回-1, 不退化成整个复制
+static int fmap_snapshot_file_(int src, const char* path) {
+#ifdef __APPLE__
+    unlink(path);
+    if (fclonefileat(src, AT_FDCWD, path, 0) == 0) {
+        return 0;
+    }
+    return -1;
+#else
+    int rst = -1;
+    int dst = open(path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (dst == -1) {
+        return -1;
+    }
+#ifdef FICLONE
+    rst = ioctl(dst, FICLONE, src);
+#endif
+    close(dst);
+    if (rst != 0) {
+        unlink(path);
+    }
+    return rst == 0 ? 0 : -1;
+#endif
+}
+
+int fmap_snapshot(struct fmap* mp, const char* dest) {
+    if (mp->readonly) {
+        return -1;
+    }
+    char path[1024];
+    for (int i = 1; i < fmap_max_files; i++) {
+        path[snprintf(path, sizeof(path), "%s.%d", dest, i)] = 0;
+        if (!mp->faddr[i]) {
+            unlink(path);    // 目标上残留的旧文件
+            continue;
+        }
+        if (fmap_snapshot_file_(mp->fd[i], path) == -1) {
+            while (--i >= 1) {    // 不留下挂载不了的半份快照
+                path[snprintf(path, sizeof(path), "%s.%d", dest, i)] = 0;
+                unlink(path);
+            }
+            return -1;
+        }
+    }
+    path[snprintf(path, sizeof(path), "%s.hash", dest)] = 0;
+    unlink(path);    // 哈希索引不复制, 挂载时按需重建
+    return 0;
+}
+
+// 同步上次提交以来写过的文件. fdatasync只会下发内核记录的脏页, 所以代价和修改量成正比
+static int fmap_flush_(struct fmap* mp) {
+    unsigned int dirty = __atomic_exchange_n(&mp->dirty, 0, __ATOMIC_ACQUIRE);
+    int rst = 0;
+    for (int i = 1; i < fmap_max_files; i++) {
+        if (!(dirty & (1u << i)) || !mp->fd[i]) {
+            continue;
+        }
+        if (fdatasync(mp->fd[i]) == -1) {
+            fmap_dirty_(mp, i);    // 下次再试
+            rst = -1;
+        }
+    }
+    if (dirty & 1) {    // 新建的数据文件, 目录项也要落盘
+        char path[1024];
+        strcpy(path, mp->fpath);
+        char* slash = strrchr(path, '/');
+        if (slash) {
+            slash[slash == path ? 1 : 0] = 0;
+        } else {
+            strcpy(path, ".");
+        }
+        int fd = open(path, O_RDONLY);
+        if (fd == -1 || fsync(fd) == -1) {
+            fmap_dirty_(mp, 0);
+            rst = -1;
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+    return rst;
+}
+
+static void* fmap_flusher_(void* ud) {
+    struct fmap* mp = ud;
+    pthread_mutex_lock(&mp->flusher_lock);
+    while (!mp->flusher_stop) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += mp->interval_ms / 1000;
+        ts.tv_nsec += (mp->interval_ms % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&mp->flusher_cond, &mp->flusher_lock, &ts);
+        if (mp->flusher_stop) {
+            break;
+        }
+        pthread_mutex_unlock(&mp->flusher_lock);
+        fmap_flush_(mp);
+        pthread_mutex_lock(&mp->flusher_lock);
+    }
+    pthread_mutex_unlock(&mp->flusher_lock);
+    return 0;
+}
+
+static void fmap_durability_stop_(struct fmap* mp) {
+    if (mp->durability != k_fmap_durability_periodic) {
+        return;
+    }
+    pthread_mutex_lock(&mp->flusher_lock);
+    mp->flusher_stop = 1;
+    pthread_cond_signal(&mp->flusher_cond);
+    pthread_mutex_unlock(&mp->flusher_lock);
+    pthread_join(mp->flusher, 0);
+    pthread_cond_destroy(&mp->flusher_cond);
+    pthread_mutex_destroy(&mp->flusher_lock);
+}
+
+int fmap_durability(struct fmap* mp, int mode, int interval_ms) {
+    if (mp->readonly) {
+        return -1;
+    }
+    fmap_durability_stop_(mp);
+    mp->durability = k_fmap_durability_none;
+    if (mode == k_fmap_durability_periodic) {
+        mp->interval_ms = interval_ms > 0 ? interval_ms : 1000;
+        mp->flusher_stop = 0;
+        pthread_mutex_init(&mp->flusher_lock, 0);
+        pthread_cond_init(&mp->flusher_cond, 0);
+        if (pthread_create(&mp->flusher, 0, fmap_flusher_, mp) != 0) {
+            pthread_cond_destroy(&mp->flusher_cond);
+            pthread_mutex_destroy(&mp->flusher_lock);
+            return -1;
+        }
+    } else if (mode != k_fmap_durability_group && mode != k_fmap_durability_none) {
+        return -1;
+    }
+    mp->durability = mode;
+    return 0;
+}
+
+int fmap_commit(struct fmap* mp) {
+    if (mp->durability != k_fmap_durability_group) {
+        return 0;
+    }
+    return fmap_flush_(mp);
+}
+
+void fmap_dirty(struct fmap* mp, const void* ptr) {
+    const char* p = ptr;
+    if (p >= mp->faddr[1] && p < mp->faddr[1] + fmap_index_map_size) {
+        fmap_dirty_(mp, 1);
+        return;
+    }
+    for (int i = 2; i < fmap_max_files; i++) {
+        if (mp->faddr[i] && p >= mp->faddr[i] && p < mp->faddr[i] + (1ULL << (i + 27))) {
+            fmap_dirty_(mp, i);
+            return;
+        }
+    }
+}
+
+int fmap_stat(struct fmap* mp, struct fmap_stat* st) {
+    memset(st, 0, sizeof(struct fmap_stat));
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    st->minflt = usage.ru_minflt - mp->usage.ru_minflt;
+    st->majflt = usage.ru_majflt - mp->usage.ru_majflt;
+    st->locked = mp->locked;
+    for (int i = 1; i < fmap_max_files; i++) {
+        if (!mp->faddr[i]) {
+            continue;
+        }
+        unsigned long long size = i == 1 ? (unsigned long long)mp->skiplist->fsize : 1ULL << (i + 27);
+        unsigned long long pages = (size + 4095) / 4096;
+        unsigned char* vec = malloc(pages);
+        if (!vec || mincore(mp->faddr[i], size, (void*)vec) == -1) {
+            free(vec);
+            return -1;
+        }
+        long long resident = 0;
+        for (unsigned long long p = 0; p < pages; p++) {
+            resident += vec[p] & 1;
+        }
+        free(vec);
+        if (i == 1) {
+            st->index_bytes = size;
+            st->index_resident = resident * 4096;
+        } else {
+            st->data_bytes += size;
+            st->data_resident += resident * 4096;
+        }
+    }
+    return 0;
+}
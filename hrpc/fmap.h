@@ -11,6 +11,7 @@ struct fmap;
 性能测试参考:
     -O0: 100w插入: 1467ms. 100w查找: 390ms
     -O3: 100w查找: 263ms
+    完整的基准套件(吞吐, 延迟分位, 文件大小, RSS, 输出json行): make bench && ./bench_fmap suite
 */
 
 /**
@@ -18,6 +19,80 @@ struct fmap;
  */
 struct fmap* fmap_mount(const char* fpath);
 
+/**
+ * 带选项挂载
+ * k_fmap_mount_hash: 额外维护一份持久化的hash索引(fpath.hash), fmap_get/fmap_del 变为O(1)查找。
+ *   有序接口(fmap_get_ge/fmap_nxt等)不受影响。索引缺失或过期时挂载阶段会从跳表重建
+ */
+#define k_fmap_mount_hash 0b1
+/**
+ * k_fmap_mount_concurrent: 单写多读。挂载的线程是唯一的写线程, 其它线程可以无锁执行只读接口
+ *   (fmap_get/fmap_get_ge/fmap_get_le/fmap_nxt/fmap_prv/fmap_val...), 前后需要 fmap_read_begin/fmap_read_end。
+ *   删除的节点会延迟到所有更早进入的读线程退出后才回收, 所以读期间拿到的 fmap_index* 不会被复用。
+ *   ⚠ 只保证索引结构, 值内容的并发修改需要业务自己同步
+ */
+#define k_fmap_mount_concurrent 0b10
+struct fmap* fmap_mount_ex(const char* fpath, int flag);
+
+/**
+ * 只读挂载, 供其它进程(监控、排查)查看正在使用的数据库。不加锁, PROT_READ映射, 不写任何内容
+ * 查询接口内部通过 fmap_skiplist 中的顺序锁发现写进程的并发结构修改并重试, 每次调用返回的结果是一致的
+ * 写接口直接返回失败。hash索引不会被使用
+ */
+#define k_fmap_mount_readonly 0b100
+struct fmap* fmap_mount_readonly(const char* fpath);
+
+/**
+ * 页面驻留相关的挂载选项, 可以与上面的组合
+ * k_fmap_mount_prefault: 挂载时预热索引文件和所有存活元素的值所在页面, 耗时与数据量成正比
+ * k_fmap_mount_mlock: 索引文件锁定在内存中(包括之后的扩容), 受RLIMIT_MEMLOCK限制, 失败时不锁
+ * k_fmap_mount_hugepage: 映射区域建议使用透明大页(MADV_HUGEPAGE), 需要内核和文件系统支持
+ * k_fmap_mount_random: 数据文件随机访问(MADV_RANDOM), 关闭预读, 适合点查
+ * k_fmap_mount_sequential: 数据文件顺序访问(MADV_SEQUENTIAL), 适合大范围遍历
+ * k_fmap_mount_dontneed: 删除后释放的大块(>=64KB)页面交还内核(MADV_REMOVE打洞, 不支持时MADV_DONTNEED)
+ */
+#define k_fmap_mount_prefault 0b1000
+#define k_fmap_mount_mlock 0b10000
+#define k_fmap_mount_hugepage 0b100000
+#define k_fmap_mount_random 0b1000000
+#define k_fmap_mount_sequential 0b10000000
+#define k_fmap_mount_dontneed 0b100000000
+
+/**
+ * minflt/majflt: 挂载以来的缺页次数, 统计的是整个进程
+ * *_bytes: 映射的文件大小, *_resident: 其中驻留在内存中的字节数
+ * locked: 已mlock的索引字节数
+ */
+struct fmap_stat {
+    long long minflt;
+    long long majflt;
+    long long index_bytes;
+    long long index_resident;
+    long long data_bytes;
+    long long data_resident;
+    long long locked;
+};
+
+/**
+ * 获取页面驻留统计, 会对所有映射做一次mincore, 不要在热路径调用
+ * 成功返回0, 失败返回-1
+ */
+int fmap_stat(struct fmap* mp, struct fmap_stat* st);
+
+/**
+ * 顺序锁, 需要跨多次调用保持一致时使用(比如只读挂载时复制出一段范围):
+ *   do { seq = fmap_seq_begin(mp); ...读取并复制... } while (fmap_seq_retry(mp, seq));
+ * ⚠ 只覆盖fmap自身的结构修改和fmap_put, 业务通过指针直接写值不会被发现
+ */
+unsigned long long fmap_seq_begin(struct fmap* mp);
+int fmap_seq_retry(struct fmap* mp, unsigned long long seq);
+
+/**
+ * 读线程进入/退出, 返回的slot传给fmap_read_end。最多同时64个读线程
+ */
+int fmap_read_begin(struct fmap* mp);
+void fmap_read_end(struct fmap* mp, int slot);
+
 /**
  * 卸载
  */
@@ -49,12 +124,42 @@ struct fmap_index* fmap_put(struct fmap* mp, const char* key, const void* val, u
  */
 struct fmap_index* fmap_add(struct fmap* mp, const char* key, const void* val, unsigned int size);
 
+/**
+ * 批量写入的条目, val==0 的时候按照size创建并清零
+ */
+struct fmap_kv {
+    const char* key;
+    const void* val;
+    unsigned int size;
+};
+
+/**
+ * 有序批量导入。next 每次填充一个kv并返回1, 返回0表示结束
+ * ⚠ key 必须严格递增, 并且大于map中已有的所有key(空map最常用)。自底向上一次性构建索引, 不做查找
+ * 返回导入的数量, 遇到乱序时停止并返回-1(之前的已经导入)
+ */
+int fmap_bulk_load(struct fmap* mp, int (*next)(void* ud, struct fmap_kv* kv), void* ud);
+
+/**
+ * 无序批量写入, 语义同 fmap_put。会对kvs原地排序, 然后与已有数据做一次有序归并
+ * 同一批次中重复的key和逐个fmap_put一样, 排在后面的生效(排序是稳定的)
+ * 返回写入的数量
+ */
+int fmap_put_batch(struct fmap* mp, struct fmap_kv* kvs, int count);
+
 /**
  * 查找获取，如果不存则创建
- * ⚠ 如果存在但是大小不一致的话，为了安全会直接assert
+ * 存在但是更小的时候原地扩大(同 fmap_resize), 新增部分清零
+ * ⚠ 如果存在但是比size更大的话，为了安全会直接assert
  */
 struct fmap_index* fmap_touch(struct fmap* mp, const char* key, unsigned int size);
 
+/**
+ * 修改值的大小, 保留原内容(扩大部分清零), 返回的仍是同一个element
+ * 块内放得下直接修改; 否则先尝试合并紧邻的空闲伙伴块; 都不行只搬迁值, 索引节点和跳表不变
+ */
+struct fmap_index* fmap_resize(struct fmap* mp, struct fmap_index* element, unsigned int new_size);
+
 /**
  * 按key获取，不存在返回null
  */
@@ -65,6 +170,20 @@ struct fmap_index* fmap_get(struct fmap* mp, const char* key);
  */
 struct fmap_index* fmap_del(struct fmap* mp, const char* key);
 
+/**
+ * 删除 [lo, hi) 区间内的所有元素, hi==0 表示直到末尾。一次查找, 整段摘下
+ * 删除某个前缀可以把前缀最后一个字符加一作为hi, 比如 "/send/1/" 对应 "/send/10"
+ * 返回删除的数量
+ */
+int fmap_del_range(struct fmap* mp, const char* lo, const char* hi);
+
+/**
+ * 按顺序遍历所有以prefix开头的元素, cb返回非0时停止
+ * ⚠ cb中不能修改map, 需要删除的话遍历结束后用 fmap_del_range
+ * 返回遍历的数量
+ */
+int fmap_scan_prefix(struct fmap* mp, const char* prefix, int (*cb)(void* ud, struct fmap_index* it), void* ud);
+
 /**
  * 按key返回第一个大于等于的元素
  */
@@ -87,7 +206,8 @@ struct fmap_index* fmap_prv(struct fmap* mp, struct fmap_index* it);
 
 /**
  * 获取element的val指针
- * ⚠ 如果大小不一致的话，为了安全会直接assert
+ * ⚠ 写线程(非并发挂载时就是调用者)传的大小不一致的话，为了安全会直接assert
+ *   并发读线程和只读挂载时返回0: 写线程可能刚好改了大小, 重新取 fmap_val_size 再读
  */
 void* fmap_val(struct fmap* mp, struct fmap_index* element, unsigned int safe_size);
 
@@ -100,3 +220,50 @@ unsigned int fmap_val_size(struct fmap_index* element);
  * 获取element的key
  */
 const char* fmap_key(struct fmap_index* element);
+
+/**
+ * 生成一份一致的快照到 dest.1 dest.2 ..., 可以直接用 fmap_mount(dest) 挂载
+ * 使用reflink(btrfs/xfs/apfs等), 只复制元数据, 之后两边的修改按页写时复制, 耗时和数据量无关
+ * 不支持reflink的文件系统(ext4等)直接返回-1, 不做整个复制, 也不留下目标文件
+ * ⚠ 需要在写线程调用, 调用期间不能有写操作; 读线程不受影响
+ * 成功返回0, 失败返回-1
+ */
+int fmap_snapshot(struct fmap* mp, const char* dest);
+
+#define k_fmap_durability_none 0        // 不主动落盘, 依赖内核回写
+#define k_fmap_durability_periodic 1    // 后台线程每interval_ms把脏页落盘, 崩溃最多丢失一个周期
+#define k_fmap_durability_group 2       // 每次 fmap_commit 把上次提交以来的修改一次性落盘
+
+/**
+ * 设置持久化模式, 默认 k_fmap_durability_none
+ * 卸载时 periodic/group 模式会再做一次落盘
+ * 成功返回0, 失败返回-1
+ */
+int fmap_durability(struct fmap* mp, int mode, int interval_ms);
+
+/**
+ * group 模式下的提交点: 对上次提交以来写过的文件各做一次fdatasync, 其他模式直接返回0
+ * 成功返回0, 失败返回-1(未落盘的部分留到下次提交)
+ */
+int fmap_commit(struct fmap* mp);
+
+/**
+ * 通过之前 fmap_val 拿到的指针修改了数据时, 需要用这个标记一下, 否则下次 fmap_commit 可能不会落盘
+ */
+void fmap_dirty(struct fmap* mp, const void* ptr);
+
+/**
+ * 检查点: 所有文件落盘, 清空修改区域记录。崩溃后挂载只检查上一个检查点之后修改过的索引区域
+ * 建议定期调用(比如每几分钟), 卸载时会自动执行并写入正常卸载标记
+ * 成功返回0, 失败返回-1
+ */
+int fmap_checkpoint(struct fmap* mp);
+
+/**
+ * 一致性检查, 每个节点带有CRC32C校验(key/大小/值位置, 不含值内容, 值由业务通过指针直接写入)
+ * full==0 只检查上个检查点之后修改过的区域, 非正常卸载后挂载时会自动执行
+ * 前驱指针错误按最底层顺序直接修正; 节点损坏或者顺序错误时按最底层重建整个跳表, 丢弃坏节点
+ * 空闲链接到存活节点或者不合格的节点时从那里截断, 之后的空闲块不再回收
+ * 返回修复的问题数量, 0表示一致
+ */
+int fmap_verify(struct fmap* mp, int full);
@@ -1,10 +1,15 @@
 #include "hashmap.h"
 
 #include <assert.h>
+#include <limits.h>
 #include <memory.h>
 #include <stdlib.h>
 
+#include "mempool.h"
+
 #define k_hash_conflict_list 8
+#define k_hash_migrate_step 2    // 每次写操作从旧表迁移的桶数
+#define k_hash_shrink_default 4
 
 struct hashmap_element {
     int overflow;                         // 溢出大小，溢出后向前查找
@@ -15,36 +20,42 @@ struct hashmap_element {
 
 struct hashmap {
     int element_size;
+    struct mempool* pool;    // element_size不为0时元素都从这里分配
     int count;
     int capacity;
     int init_capacity;
+    int shrink;    // count * shrink < capacity 时缩容, 0表示只手动缩容
     struct hashmap_element* arr;
+    struct hashmap_element* old;    // 渐进式rehash中的旧表, 0表示没有在迁移
+    int old_capacity;
+    int migrate;    // 旧表中下一个要迁移的桶
     int (*func_hashcode)(const void*);
     int (*func_equal)(const void*, const void*);
 };
 
 struct hashmap* hashmap_create(int init_cap, int element_size, int (*func_hashcode)(const void*), int (*func_equal)(const void*, const void*)) {
     struct hashmap* self = (struct hashmap*)malloc(sizeof(struct hashmap));
+    memset(self, 0, sizeof(struct hashmap));
     self->capacity = init_cap;
     self->count = 0;
     self->element_size = element_size;
     self->func_equal = func_equal;
     self->func_hashcode = func_hashcode;
     self->init_capacity = init_cap;
+    self->shrink = k_hash_shrink_default;
+    self->pool = element_size ? mempool_create(element_size) : 0;
     self->arr = (struct hashmap_element*)malloc(sizeof(struct hashmap_element) * self->capacity);
     memset(self->arr, 0, sizeof(struct hashmap_element) * self->capacity);
     return self;
 }
 
 void hashmap_free(struct hashmap* self) {
-    if (self->element_size) {
-        hashmap_foreach(void*, val, self) {
-            free(val);
-        }
-        self->element_size = 0;
+    if (self->pool) {
+        mempool_destroy(self->pool);
     }
     memset(self->arr, 0, sizeof(struct hashmap_element) * self->capacity);
     free(self->arr);
+    free(self->old);
     free(self);
 }
 
@@ -52,34 +63,19 @@ int hashmap_count(struct hashmap* self) {
     return self->count;
 }
 
-void hashmap_resize(struct hashmap* self, int capacity) {
-    struct hashmap_element* old = self->arr;
-    int old_cap = self->capacity;
-    self->capacity = capacity;
-    self->arr = (struct hashmap_element*)malloc(sizeof(struct hashmap_element) * self->capacity);
-    self->count = 0;
-    memset(self->arr, 0, sizeof(struct hashmap_element) * self->capacity);
-    for (int i = 0; i < old_cap; i++) {
-        struct hashmap_element* tmp = &old[i];
-        for (int j = 0; j < tmp->count; j++) {
-            hashmap_add(self, tmp->datas[j]);
-        }
-        for (int j = 0; j < tmp->borrow; j++) {
-            hashmap_add(self, tmp->datas[k_hash_conflict_list - 1 - j]);
-        }
-    }
-    free(old);
+void hashmap_shrink(struct hashmap* self, int ratio) {
+    self->shrink = ratio;
 }
 
-#define hashmap_init_hashcode(name, data) \
-    int name = self->func_hashcode(data); \
-    name ^= (name >> 16);
+#define hashmap_init_hashcode(name, data)                   \
+    unsigned int name = self->func_hashcode(data);          \
+    name ^= (name >> 16);    // 无符号取模, 负数hash不会得到负下标
 
-static inline struct hashmap_element* hashmap_get_(struct hashmap* self, const void* key, int* pos) {
+static inline struct hashmap_element* hashmap_get_(struct hashmap* self, struct hashmap_element* arr, int capacity, const void* key, int* pos) {
     hashmap_init_hashcode(hashcode, key);
 
-    int p = hashcode % self->capacity;
-    struct hashmap_element* it = &self->arr[p];
+    int p = hashcode % (unsigned int)capacity;
+    struct hashmap_element* it = &arr[p];
     if (it->count > 0) {
         for (int i = 0; i < it->count; i++) {
             if (self->func_equal(it->datas[i], key) == 1) {
@@ -94,18 +90,18 @@ static inline struct hashmap_element* hashmap_get_(struct hashmap* self, const v
     while (overflow > 0) {
         p = p - 1;
         if (p < 0) {
-            p = self->capacity - 1;
+            p = capacity - 1;
         }
         if (p == ep) {
             break;
         }
-        it = &self->arr[p];
+        it = &arr[p];
         if (it->borrow > 0) {
             for (int i = 0; i < it->borrow; i++) {
                 int k = k_hash_conflict_list - 1 - i;
                 hashmap_init_hashcode(ohashcode, it->datas[k]);
-                if (ohashcode == hashcode) {
-                    if (self->func_equal(it->datas[k], key) == 1) {
+                if (ohashcode % (unsigned int)capacity == (unsigned int)ep) {    // 同一个桶溢出出来的, 找完overflow个就可以停了
+                    if (ohashcode == hashcode && self->func_equal(it->datas[k], key) == 1) {
                         *pos = k;
                         return it;
                     }
@@ -117,67 +113,146 @@ static inline struct hashmap_element* hashmap_get_(struct hashmap* self, const v
     return 0;
 }
 
-void* hashmap_add(struct hashmap* self, void* data) {    // must not exist
-    if (self->count > self->capacity) {
-        hashmap_resize(self, self->capacity * 2);
-        return hashmap_add(self, data);
-    }
-
-    if (self->element_size) {
-        void* tmp = malloc(self->element_size);
-        memcpy(tmp, data, self->element_size);
-        data = tmp;
+// 迁移中先查新表再查旧表, 返回所在的表
+static inline struct hashmap_element* hashmap_find_(struct hashmap* self, const void* key, int* pos, int* in_old) {
+    *in_old = 0;
+    struct hashmap_element* it = hashmap_get_(self, self->arr, self->capacity, key, pos);
+    if (!it && self->old) {
+        it = hashmap_get_(self, self->old, self->old_capacity, key, pos);
+        *in_old = it != 0;
     }
+    return it;
+}
 
+static void hashmap_insert_(struct hashmap* self, struct hashmap_element* arr, int capacity, void* data) {
     hashmap_init_hashcode(hashcode, data);
-    int p = hashcode % self->capacity;
-    struct hashmap_element* it = &self->arr[p];
+    int p = hashcode % (unsigned int)capacity;
+    struct hashmap_element* it = &arr[p];
     if (it->count + it->borrow < k_hash_conflict_list) {
         it->datas[it->count++] = (void*)data;
-        ++self->count;
-        return data;
+        return;
     }
 
     it->overflow++;
-    self->count++;
     int ep = p;
     while (1) {
         p = p - 1;
         if (p < 0) {
-            p = self->capacity - 1;
+            p = capacity - 1;
         }
         if (p == ep) {
             assert(0);
             break;
         }
-        it = &self->arr[p];
+        it = &arr[p];
         if (it->count + it->borrow < k_hash_conflict_list) {
             it->datas[k_hash_conflict_list - 1 - it->borrow] = data;
             it->borrow++;
-            return data;
+            return;
         }
     }
-    return 0;
+}
+
+// 从表里摘掉it->datas[pos], 不释放
+static void hashmap_remove_(struct hashmap* self, struct hashmap_element* arr, int capacity, struct hashmap_element* it, int pos) {
+    hashmap_init_hashcode(hashcode, it->datas[pos]);
+    int p = hashcode % (unsigned int)capacity;
+    struct hashmap_element* tar = &arr[p];
+    if (it == tar) {
+        if (it->count > 0) {
+            it->datas[pos] = it->datas[it->count - 1];
+        }
+        it->count--;
+        assert(it->count >= 0);
+    } else {
+        if (it->borrow > 1) {
+            it->datas[pos] = it->datas[k_hash_conflict_list - it->borrow];
+        }
+        it->borrow--;
+        tar->overflow--;
+        assert(it->borrow >= 0);
+        assert(tar->overflow >= 0);
+    }
+}
+
+// 从旧表迁移最多buckets个桶到新表, 迁移完释放旧表
+static void hashmap_migrate_(struct hashmap* self, int buckets) {
+    if (!self->old) {
+        return;
+    }
+    for (; buckets > 0 && self->migrate < self->old_capacity; buckets--, self->migrate++) {
+        struct hashmap_element* it = &self->old[self->migrate];
+        while (it->count > 0) {
+            void* data = it->datas[0];
+            hashmap_remove_(self, self->old, self->old_capacity, it, 0);
+            hashmap_insert_(self, self->arr, self->capacity, data);
+        }
+        while (it->borrow > 0) {
+            int k = k_hash_conflict_list - it->borrow;
+            void* data = it->datas[k];
+            hashmap_remove_(self, self->old, self->old_capacity, it, k);
+            hashmap_insert_(self, self->arr, self->capacity, data);
+        }
+    }
+    if (self->migrate >= self->old_capacity) {
+        free(self->old);
+        self->old = 0;
+        self->old_capacity = 0;
+    }
+}
+
+// 开始迁移到新容量. 上一次没迁移完的先迁移完
+static void hashmap_rehash_(struct hashmap* self, int capacity) {
+    hashmap_migrate_(self, INT_MAX);
+    self->old = self->arr;
+    self->old_capacity = self->capacity;
+    self->migrate = 0;
+    self->capacity = capacity;
+    self->arr = (struct hashmap_element*)calloc(self->capacity, sizeof(struct hashmap_element));    // 大块calloc直接拿清零的页, 不用一次性memset
+}
+
+void hashmap_resize(struct hashmap* self, int capacity) {
+    if (capacity < self->count) {
+        capacity = self->count;
+    }
+    hashmap_rehash_(self, capacity);
+    hashmap_migrate_(self, INT_MAX);
+}
+
+void* hashmap_add(struct hashmap* self, void* data) {    // must not exist
+    hashmap_migrate_(self, k_hash_migrate_step);
+    if (self->count > self->capacity) {
+        hashmap_rehash_(self, self->capacity * 2);
+    }
+
+    if (self->element_size) {
+        void* tmp = mempool_alloc(self->pool);
+        memcpy(tmp, data, self->element_size);
+        data = tmp;
+    }
+
+    hashmap_insert_(self, self->arr, self->capacity, data);
+    self->count++;
+    return data;
 }
 
 void* hashmap_put(struct hashmap* self, void* data) {
-    int i;
-    struct hashmap_element* it = hashmap_get_(self, data, &i);
+    int i, in_old;
+    struct hashmap_element* it = hashmap_find_(self, data, &i, &in_old);
     if (it) {
-        if (self->element_size) {
-            void* tmp = malloc(self->element_size);
-            memcpy(tmp, data, self->element_size);
-            data = tmp;
+        if (self->element_size) {    // 复制到原来的内存里, 指针不变
+            memcpy(it->datas[i], data, self->element_size);
+        } else {
+            it->datas[i] = data;
         }
-        it->datas[i] = data;
         return it->datas[i];
     }
     return hashmap_add(self, data);
 }
 
 void* hashmap_get(struct hashmap* self, const void* key) {
-    int i;
-    struct hashmap_element* it = hashmap_get_(self, key, &i);
+    int i, in_old;
+    struct hashmap_element* it = hashmap_find_(self, key, &i, &in_old);
     if (it) {
         return it->datas[i];
     }
@@ -185,43 +260,31 @@ void* hashmap_get(struct hashmap* self, const void* key) {
 }
 
 void hashmap_del(struct hashmap* self, const void* key) {
-    int pos;
-    struct hashmap_element* it = hashmap_get_(self, key, &pos);
+    hashmap_migrate_(self, k_hash_migrate_step);
+    int pos, in_old;
+    struct hashmap_element* it = hashmap_find_(self, key, &pos, &in_old);
     if (!it) {
         return;
     }
 
-    hashmap_init_hashcode(hashcode, key);
-    int p = hashcode % self->capacity;
-    if (self->element_size) {
-        free(it->datas[pos]);
-        it->datas[pos] = 0;
-    }
-    
-    struct hashmap_element* tar = &self->arr[p];
-    if (it == tar) {
-        if (it->count > 0) {
-            it->datas[pos] = it->datas[it->count - 1];
-        }
-        it->count--;
-        assert(it->count >= 0);
+    void* data = it->datas[pos];
+    if (in_old) {
+        hashmap_remove_(self, self->old, self->old_capacity, it, pos);
     } else {
-        if (it->borrow > 1) {
-            it->datas[pos] = it->datas[k_hash_conflict_list - it->borrow];
-        }
-        it->borrow--;
-        tar->overflow--;
-        assert(it->borrow >= 0);
-        assert(tar->overflow >= 0);
+        hashmap_remove_(self, self->arr, self->capacity, it, pos);
+    }
+    if (self->element_size) {
+        mempool_free(self->pool, data);
     }
     self->count--;
     assert(self->count >= 0);
 
-    if (self->capacity > self->init_capacity && self->count * 3 < self->capacity) {
-        hashmap_resize(self, self->capacity / 2);
+    if (self->shrink && !self->old && self->capacity > self->init_capacity && (long long)self->count * self->shrink < self->capacity) {
+        hashmap_rehash_(self, self->capacity / 2);
     }
 }
 
+// where: 1/2 新表的自有/借用部分, 3/4 迁移中旧表的自有/借用部分
 struct hashmap_itor hashmap_itor_next(struct hashmap* self, struct hashmap_itor it) {
     int i = it.i;
     int j = it.j;
@@ -233,35 +296,39 @@ struct hashmap_itor hashmap_itor_next(struct hashmap* self, struct hashmap_itor
     } else {
         j += 1;
     }
-    for (; i < self->capacity; i++) {
-        if (where == 1) {
-            if (self->arr[i].count > 0) {
-                if (j < self->arr[i].count) {
+    for (int base = where > 2 ? 2 : 0; base <= 2; base += 2) {
+        struct hashmap_element* arr = base ? self->old : self->arr;
+        int capacity = base ? self->old_capacity : self->capacity;
+        for (; arr && i < capacity; i++) {
+            if (where == base + 1) {
+                if (j < arr[i].count) {
                     return (struct hashmap_itor){.i = i, .j = j, .where = where};
                 }
+                j = 0;
+                where = base + 2;
             }
-            j = 0;
-            where = 2;
-        }
-        if (where == 2) {
-            if (self->arr[i].borrow > 0) {
-                if (j < self->arr[i].borrow) {
+            if (where == base + 2) {
+                if (j < arr[i].borrow) {
                     return (struct hashmap_itor){.i = i, .j = j, .where = where};
                 }
+                j = 0;
+                where = base + 1;
             }
-            j = 0;
-            where = 1;
         }
+        i = 0;
+        j = 0;
+        where = 3;
     }
     return (struct hashmap_itor){.i = 0, .j = 0, .where = 0};
 }
 
 void* hashmap_itor_val(struct hashmap* self, struct hashmap_itor it) {
-    if (it.where == 1) {
-        return self->arr[it.i].datas[it.j];
+    struct hashmap_element* arr = it.where > 2 ? self->old : self->arr;
+    if (it.where == 1 || it.where == 3) {
+        return arr[it.i].datas[it.j];
     }
-    if (it.where == 2) {
-        return self->arr[it.i].datas[k_hash_conflict_list - it.j - 1];
+    if (it.where == 2 || it.where == 4) {
+        return arr[it.i].datas[k_hash_conflict_list - it.j - 1];
     }
     return 0;
-}
\ No newline at end of file
+}
@@ -4,7 +4,7 @@ struct hashmap;
 
 /**
  * @param init_cap 初始容量
- * @param element_size 0表示不存储数据，只对指针进行索引. 否则会在创建的时候申请内存，删除的时候释放内存
+ * @param element_size 0表示不存储数据，只对指针进行索引. 否则添加时复制一份到map自己的对象池里(mempool), 删除时回收, 释放map时整体释放
  * @param func_hashcode hash函数, 不可为空
  * @param func_equal 比较函数，不可为空。返回0表示不相等，1表示相等
  */
@@ -21,14 +21,25 @@ void hashmap_free(struct hashmap* self);
 int hashmap_count(struct hashmap* self);
 
 /**
- * 调整容量
+ * 调整容量, 立即完成迁移
+ * 自动扩容/缩容是渐进式的: 新旧两张表同时存在, 每次add/del迁移几个桶, 不会一次性停顿
  */
 void hashmap_resize(struct hashmap* self, int capacity);
 
+/**
+ * 缩容条件: count * ratio < capacity 时容量减半, 默认4(扩容在 count > capacity 时), 两者之间留出余量避免来回扩缩
+ * 0表示不自动缩容, 只能手动 hashmap_resize
+ */
+void hashmap_shrink(struct hashmap* self, int ratio);
+
 /**
  * 添加元素，⚠ 必须保证不存在
  */
 void* hashmap_add(struct hashmap* self, void* data);
+
+/**
+ * 存在则替换. element_size不为0时复制到原来的内存里, 返回的指针不变
+ */
 void* hashmap_put(struct hashmap* self, void* data);
 void* hashmap_get(struct hashmap* self, const void* key);
 void hashmap_del(struct hashmap* self, const void* key);
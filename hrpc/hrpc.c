@@ -1,12 +1,18 @@
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
+#include <assert.h>
 #include <errno.h>
+#include <linux/errqueue.h>
 #include <math.h>
 #include <memory.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/time.h>
@@ -15,8 +21,11 @@
 #include <unistd.h>
 
 #include "bsearch.h"
+#include "densemap.h"
 #include "fmap.h"
 #include "hashmap.h"
+#include "hrpc.h"
+#include "lz.h"
 
 static long long time_curruent_us() {
     long long now;
@@ -86,7 +95,90 @@ struct hrpc_frame {
     } data;
 };
 
+// 数据帧去掉数据的部分, 和hrpc_frame的布局一致. 发送时和pack里的数据拼成iovec, 不再复制数据
+struct hrpc_frame_head {
+    unsigned long long id;
+    unsigned int nid;
+    unsigned int size;
+    long long connect_time;
+    unsigned int type;
+    unsigned int _pad;
+    unsigned int i;
+} __attribute__((packed, aligned(4)));
+_Static_assert(sizeof(struct hrpc_frame_head) == offsetof(struct hrpc_frame, data.pack.buff), "hrpc_frame_head layout");
+
+// 帧格式版本. 版本1是上面的结构体按主机字节序直接发送, 只有小端机器之间能互通. 小端时第8个字节是64位id的最高字节, 永远是0
+// 版本2在第8个字节放版本号, 收到时按它区分, 所有字段显式小端:
+//   [0]类型 [1]连接纪元 [2..5]nid [6]id字节数编码 [7]版本号
+//   数据帧: id的低位(1/2/4/8字节, 相对对端已确认的reci还原) + varint size [+ varint 解压后大小] + varint i + 数据
+//   ack帧:  varint id + varint count + 帧序号的varint差值
+// 连接纪元是connect_time折叠成的一个字节, 只用来丢弃旧连接还在路上的帧. 连接重建和心跳仍然用版本1的完整帧
+// 心跳是版本1的布局, 但每个字段都显式按小端编码(小端机器上和旧节点发的完全一样), 大端机器也能靠它协商到版本2
+// 心跳在sync后面多带一个字节声明自己支持的最高版本, 版本1的节点只读前面的字段, 收到声明之前一直按版本1发送
+// 大端机器协商到版本2之前不发数据帧和ack, 也不接收版本1的数据帧和ack, 不能和只支持版本1的节点通信
+#define k_hrpc_wire_v1 1
+#define k_hrpc_wire_v2 2
+#define k_hrpc_wire_head_v2 8
+#define k_hrpc_wire_v1_native (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)    // 版本1的数据帧和ack按主机字节序, 只在小端机器上可用
+#define k_hrpc_wire_heartbeat (offsetof(struct hrpc_frame, data.sync._) + 1)
+#define k_hrpc_wire_compressed 0x80    // 版本2类型字节的最高位: 数据是压缩过的, size后面跟着varint的解压后大小
+
+#define k_hrpc_send_batch 64    // 一次sendmmsg最多发的帧数
+#define k_hrpc_zc_flush_timeout 200    // 重连时等待zerocopy发送完成的最长时间, 毫秒
+
+// 开启MSG_ZEROCOPY时, 发送包确认完成之后不能立即从fmap删除, 等内核不再引用这之前提交的所有发送
+struct hrpc_zc_defer {
+    unsigned int barrier;    // 删除时已经提交的zerocopy发送数
+    char lo[48];
+    char hi[48];    // 不为空时删除区间 [lo, hi)
+};
+
+// 内核不保证按序号顺序通知完成, 先到的区间[lo, hi]记下来, 接上zc_done之后再一起推进
+struct hrpc_zc_range {
+    unsigned int lo;
+    unsigned int hi;
+};
+
+// 持久化在fmap中, 后面紧跟: done位图(已收到/已确认), acked位图(接收方已回复ack), 数据
+// 不保存指针, 位置由size算出, 挂载时不需要改写
 struct hrpc_pack {
+    unsigned long long id;
+    unsigned int nid;
+    unsigned int size;
+    long long connect_time;
+    long long last_time;
+    unsigned int retry;
+    unsigned int raw_size;    // 压缩过的消息解压后的大小, 0表示没有压缩. 占用原来的对齐空洞, 布局不变
+};
+_Static_assert(sizeof(struct hrpc_pack) == 40, "hrpc_pack persisted layout");
+
+#define hrpc_pack_bitmap_size(size) ((get_frame_count(size) + 7) / 8)
+#define hrpc_pack_total_size(size) (sizeof(struct hrpc_pack) + hrpc_pack_bitmap_size(size) * 2 + (size))
+#define hrpc_pack_done(pack) ((unsigned char*)((pack) + 1))
+#define hrpc_pack_acked(pack) (hrpc_pack_done(pack) + hrpc_pack_bitmap_size((pack)->size))
+#define hrpc_pack_buff(pack) ((char*)hrpc_pack_acked(pack) + hrpc_pack_bitmap_size((pack)->size))
+#define hrpc_bit_get(map, i) (((map)[(i) >> 3] >> ((i) & 7)) & 1)
+#define hrpc_bit_set(map, i) ((map)[(i) >> 3] |= 1 << ((i) & 7))
+#define hrpc_bit_clear(map, i) ((map)[(i) >> 3] &= ~(1 << ((i) & 7)))
+
+static int hrpc_bits_full_(const unsigned char* map, int count) {
+    for (int i = 0; i < count / 8; i++) {
+        if (map[i] != 0xff) {
+            return 0;
+        }
+    }
+    return count % 8 == 0 || map[count / 8] == (1 << (count % 8)) - 1;
+}
+
+static void hrpc_bits_fill_(unsigned char* map, int count) {    // 和hrpc_bits_full_对应, 最后一个字节只置有效的位
+    memset(map, 0xff, count / 8);
+    if (count % 8) {
+        map[count / 8] = (1 << (count % 8)) - 1;
+    }
+}
+
+// 版本1的pack: 带有运行时指针, 每帧一个字节的done(0未收到, 1收到, 2已回复ack)
+struct hrpc_pack_v1 {
     unsigned long long id;
     unsigned int nid;
     unsigned int size;
@@ -97,8 +189,76 @@ struct hrpc_pack {
     char* buff;
 };
 
+// 1: 没有版本号的旧库, pack带运行时指针 2: 位图格式的pack 3: 接收缓存的id补齐到20位, 同一个nid的key按id排序
+#define k_hrpc_db_version 3
+
+// 接收缓存的key, id补齐成定长, 连续处理完的一段消息可以一次区间删除
+static inline void hrpc_reci_path_(char* path, int size, unsigned int nid, unsigned long long id) {
+    snprintf(path, size, "/reci/%u/%020llu", nid, id);
+}
+
+#define k_hrpc_ring_size (1 << 22)    // 每个提交线程一个环形队列, 单条消息不超过一半
+
+// 单生产者单消费者的环, 记录是 hrpc_ring_head + 8字节对齐的消息. 位置只增不减, 取模得到下标
+struct hrpc_ring {
+    unsigned long long tail __attribute__((aligned(64)));    // 生产者提交到的位置
+    unsigned long long reserve;    // 生产者申请了还没提交的结束位置, 只有生产者访问
+    unsigned long long head __attribute__((aligned(64)));    // 消费者处理到的位置
+    int closed;    // 生产者线程已经退出, 消费完之后释放
+    struct hrpc_ring* next;
+    char buff[k_hrpc_ring_size] __attribute__((aligned(64)));
+};
+
+struct hrpc_ring_head {
+    int nid;    // 0表示环尾部的填充, 跳到开头
+    int size;
+};
+
+// 线程模式下交给工作线程的消息, 处理完原样放回完成队列
+struct hrpc_job {
+    struct hrpc_job* next;
+    int nid;
+    unsigned int size;
+    unsigned long long id;
+    long long connect_time;    // 处理完时连接已经重建就不再推进reci
+    char data[];
+};
+
+struct hrpc_worker {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct hrpc_job* head;
+    struct hrpc_job* tail;
+    int stop;
+} __attribute__((aligned(64)));
+
+struct hrpc_dispatched {    // 每个nid已经交给工作线程的最大id
+    int nid;
+    long long connect_time;
+    unsigned long long id;
+};
+
+struct hrpc_compress_policy {    // 按nid单独设置的压缩阈值
+    int nid;
+    int min_size;
+};
+
+struct hrpc_pool {
+    pthread_t io;
+    int stop;
+    int workers;
+    void (*on_message)(int nid, void* message, unsigned int size);
+    struct hrpc_worker* worker;
+    pthread_mutex_t done_lock;
+    struct hrpc_job* done_head;    // 完成队列, 同一个nid按处理顺序排列
+    struct hrpc_job* done_tail;
+    struct hashmap* dispatched;
+};
+
 struct hrpc_connection {
     int nid;
+    unsigned char wire_version;    // 和对端协商出的帧格式版本, 占用原来的对齐空洞, 启动时清零重新协商
     unsigned long long send;     // 发送
     unsigned long long acked;    // 已经发送并且被acked了的
     unsigned long long reci;     // 已经接收完毕并且处理掉了的
@@ -114,16 +274,41 @@ struct hrpc_connections {                             // 需要持久化。内
 };
 
 static struct {
-    struct hashmap* send;
-    struct hashmap* reci;
+    struct densemap* send;
+    struct densemap* reci;
     struct hashmap* done;
     struct fmap* db;
     struct hrpc_connections* connections;
+    struct bsearch_index connection_index;    // connections按nid的查找索引, 每收发一帧都要查, 连接变化时重建
+    int connections_dirty;    // 本轮send/reci/acked或者连接有变化, 提交时才标记connections需要落盘
     int sockfd;
     int is_server;
     int nid;
     struct sockaddr_in (*get_addr)(int nid);
     long long once_timeout;
+    struct hrpc_ring* rings;    // 所有提交线程的环, 新线程无锁插到链表头
+    int submit_fd;    // eventfd, 有新提交时可读
+    int submit_signaled;
+    struct hrpc_pool* pool;    // hrpc_start之后不为0
+    struct hrpc_message* batch;    // hrpc_once_batch收集消息用, 只增不减
+    int batch_cap;
+    int zc_min;    // 不小于这个大小的包用MSG_ZEROCOPY发送, 0表示不开启
+    unsigned int zc_sent;    // 已经提交的zerocopy发送数, 和内核的通知序号一致
+    unsigned int zc_done;    // 序号小于它的都已经完成
+    struct hrpc_zc_range* zc_ranges;    // zc_done之后已经完成的区间, 按序号排序不相交也不相邻
+    int zc_range_count;
+    int zc_range_cap;
+    struct hrpc_zc_defer* zc_defer;
+    int zc_defer_count;
+    int zc_defer_cap;
+    int wire_version;    // 本节点声明并使用的最高帧格式版本
+    int compress_min;    // 默认的压缩阈值, 0表示不压缩
+    struct hashmap* compress;    // 按nid单独设置的压缩阈值
+    struct hrpc_pack* fresh;    // 本轮新发送的待压缩消息, 只用id和nid, 落盘之前压缩
+    int fresh_count;
+    int fresh_cap;
+    char* zbuf;    // 压缩/解压用的临时缓冲区, 只增不减
+    int zbuf_cap;
 } self;
 
 int hrpc_pack_hashcode_(const void* ptr) {
@@ -139,6 +324,90 @@ int hrpc_pack_equal_(const void* a, const void* b) {
     return m->id == n->id && m->nid == n->nid;
 }
 
+static int hrpc_load_pack_(void* ud, struct fmap_index* it) {
+    densemap_add(ud, fmap_val(self.db, it, fmap_val_size(it)));
+    return 0;
+}
+
+// 把prefix下的版本1的pack原地转换成当前格式, 新格式更小, 转换后缩小值
+static void hrpc_upgrade_packs_(const char* prefix) {
+    size_t len = strlen(prefix);
+    for (struct fmap_index* it = fmap_get_ge(self.db, prefix); it && strncmp(fmap_key(it), prefix, len) == 0; it = fmap_nxt(self.db, it)) {
+        struct hrpc_pack_v1* old = fmap_val(self.db, it, fmap_val_size(it));
+        int frame_count = get_frame_count(old->size);
+        int psize = hrpc_pack_total_size(old->size);
+        struct hrpc_pack* pack = calloc(1, psize);
+        pack->id = old->id;
+        pack->nid = old->nid;
+        pack->size = old->size;
+        pack->connect_time = old->connect_time;
+        pack->last_time = old->last_time;
+        pack->retry = old->retry;
+        char* done = ((char*)old) + sizeof(struct hrpc_pack_v1);
+        for (int p = 0; p < frame_count; p++) {
+            if (done[p]) {
+                hrpc_bit_set(hrpc_pack_done(pack), p);
+            }
+            if (done[p] == 2) {
+                hrpc_bit_set(hrpc_pack_acked(pack), p);
+            }
+        }
+        memcpy(hrpc_pack_buff(pack), done + frame_count, old->size);
+        memcpy(old, pack, psize);
+        fmap_resize(self.db, it, psize);
+        free(pack);
+    }
+}
+
+// 版本3之前接收缓存的key里id没有补齐, 改成定长的key
+static void hrpc_upgrade_reci_keys_() {
+    int count = 0;
+    for (struct fmap_index* it = fmap_get_ge(self.db, "/reci/"); it && strncmp(fmap_key(it), "/reci/", 6) == 0; it = fmap_nxt(self.db, it)) {
+        count++;
+    }
+    char** keys = malloc(sizeof(char*) * (count + 1));
+    count = 0;
+    for (struct fmap_index* it = fmap_get_ge(self.db, "/reci/"); it && strncmp(fmap_key(it), "/reci/", 6) == 0; it = fmap_nxt(self.db, it)) {
+        keys[count++] = strdup(fmap_key(it));
+    }
+    for (int i = 0; i < count; i++) {
+        unsigned int nid;
+        unsigned long long id;
+        char path[128];
+        if (sscanf(keys[i], "/reci/%u/%llu", &nid, &id) == 2) {
+            hrpc_reci_path_(path, sizeof(path), nid, id);
+            struct fmap_index* it = fmap_get(self.db, keys[i]);
+            unsigned int size = fmap_val_size(it);
+            void* val = malloc(size);
+            memcpy(val, fmap_val(self.db, it, size), size);
+            fmap_del(self.db, keys[i]);
+            fmap_add(self.db, path, val, size);
+            free(val);
+        }
+        free(keys[i]);
+    }
+    free(keys);
+}
+
+static int hrpc_drop_pack_(void* ud, struct fmap_index* it) {
+    densemap_del(ud, fmap_val(self.db, it, fmap_val_size(it)));
+    return 0;
+}
+
+static struct hrpc_connection* hrpc_connection_get_(int nid) {
+    return bsearch_index_get(&self.connection_index, self.connections->connections, nid);
+}
+
+static struct hrpc_connection* hrpc_connection_put_(struct hrpc_connection* conn) {    // 连接数已满返回0
+    int p = bsearch_put(self.connections->connections, cmp_int, conn);
+    if (p < 0) {
+        return 0;
+    }
+    bsearch_index_update(&self.connection_index, self.connections->connections, nid);
+    self.connections_dirty = 1;
+    return &self.connections->connections[p];
+}
+
 int hrpc_init(const char* dbpath, int nid, int bind_port, struct sockaddr_in (*get_addr)(int nid)) {    // 初始化
     self.get_addr = get_addr;
     self.nid = nid;
@@ -146,6 +415,7 @@ int hrpc_init(const char* dbpath, int nid, int bind_port, struct sockaddr_in (*g
     if (self.sockfd < 0) {
         return 0;
     }
+    self.submit_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
     int buffer_size = 26214400;    // 25 MB
     socklen_t len = sizeof(buffer_size);
     setsockopt(self.sockfd, SOL_SOCKET, SO_RCVBUF, &buffer_size, len);
@@ -154,30 +424,22 @@ int hrpc_init(const char* dbpath, int nid, int bind_port, struct sockaddr_in (*g
     self.db = fmap_mount(dbpath);
     struct fmap_index* fi = fmap_touch(self.db, "/connections", sizeof(struct hrpc_connections));
     self.connections = fmap_val(self.db, fi, sizeof(struct hrpc_connections));
-    self.send = hashmap_create(1000, 0, hrpc_pack_hashcode_, hrpc_pack_equal_);
-    self.reci = hashmap_create(1000, 0, hrpc_pack_hashcode_, hrpc_pack_equal_);
-
-    struct fmap_index* start = fmap_get_ge(self.db, "/send/");
-    struct fmap_index* end = fmap_get_ge(self.db, "/send/~");
-    while (start && start != end) {
-        struct fmap_index* current = start;
-        start = fmap_nxt(self.db, start);
-        struct hrpc_pack* pack = fmap_val(self.db, current, fmap_val_size(current));
-        pack->done = ((char*)pack) + sizeof(struct hrpc_pack);
-        pack->buff = ((char*)pack) + sizeof(struct hrpc_pack) + get_frame_count(pack->size);
-        hashmap_add(self.send, pack);
-    }
-
-    start = fmap_get_ge(self.db, "/reci/");
-    end = fmap_get_ge(self.db, "/reci/~");
-    while (start && start != end) {
-        struct fmap_index* current = start;
-        start = fmap_nxt(self.db, start);
-        struct hrpc_pack* pack = fmap_val(self.db, current, fmap_val_size(current));
-        pack->done = ((char*)pack) + sizeof(struct hrpc_pack);
-        pack->buff = ((char*)pack) + sizeof(struct hrpc_pack) + get_frame_count(pack->size);
-        hashmap_add(self.reci, pack);
+    bsearch_index_update(&self.connection_index, self.connections->connections, nid);
+    fi = fmap_touch(self.db, "/version", sizeof(int));
+    int* version = fmap_val(self.db, fi, sizeof(int));
+    if (*version < 2) {    // 0: 没有版本号的旧库(或者新库)
+        hrpc_upgrade_packs_("/send/");
+        hrpc_upgrade_packs_("/reci/");
+    }
+    if (*version < 3) {
+        hrpc_upgrade_reci_keys_();
     }
+    *version = k_hrpc_db_version;
+    self.send = densemap_create(1000, 0, hrpc_pack_hashcode_, hrpc_pack_equal_);
+    self.reci = densemap_create(1000, 0, hrpc_pack_hashcode_, hrpc_pack_equal_);
+
+    fmap_scan_prefix(self.db, "/send/", hrpc_load_pack_, self.send);
+    fmap_scan_prefix(self.db, "/reci/", hrpc_load_pack_, self.reci);
 
     if (bind_port) {
         struct sockaddr_in server_addr = {0};
@@ -187,10 +449,13 @@ int hrpc_init(const char* dbpath, int nid, int bind_port, struct sockaddr_in (*g
         int ret = bind(self.sockfd, (struct sockaddr*)&server_addr, sizeof(server_addr));
         if (ret == -1) {
             close(self.sockfd);
-            hashmap_free(self.reci);
-            hashmap_free(self.send);
+            close(self.submit_fd);
+            densemap_free(self.reci);
+            densemap_free(self.send);
             fmap_unmount(self.db);
+            bsearch_index_free(&self.connection_index);
             self.sockfd = 0;
+            self.submit_fd = 0;
             self.reci = 0;
             self.send = 0;
             self.db = 0;
@@ -201,23 +466,31 @@ int hrpc_init(const char* dbpath, int nid, int bind_port, struct sockaddr_in (*g
     for (int i = 0; i < self.connections->connections_count_; i++) {
         struct hrpc_connection* conn = &self.connections->connections[i];
         conn->last_heartbeat_time = 0;
+        conn->wire_version = 0;
     }
+    self.wire_version = k_hrpc_wire_v2;
     return self.sockfd;
 }
 
+int hrpc_durability(int mode, int interval_ms) {
+    return fmap_durability(self.db, mode, interval_ms) == 0;
+}
+
 int hrpc_touch_connect(int nid) {
     if (self.is_server) {
         return 0;
     }
-    struct hrpc_connection* conn = bsearch_get(self.connections->connections, cmp_int, &nid);
+    struct hrpc_connection* conn = hrpc_connection_get_(nid);
     if (!conn) {
         static typeof(*conn) tmp = {0};
         tmp.nid = nid;
         tmp.connect_time = time_curruent_us();
         tmp.active_time = 0;
         tmp.target_addr = self.get_addr(nid);
-        int p = bsearch_put(self.connections->connections, cmp_int, &tmp);
-        conn = &self.connections->connections[p];
+        conn = hrpc_connection_put_(&tmp);
+        if (!conn) {
+            return 0;
+        }
     } else {
         conn->target_addr = self.get_addr(nid);
     }
@@ -225,7 +498,7 @@ int hrpc_touch_connect(int nid) {
 }
 
 int hrpc_is_connected(int nid) {
-    struct hrpc_connection* conn = bsearch_get(self.connections->connections, cmp_int, &nid);
+    struct hrpc_connection* conn = hrpc_connection_get_(nid);
     return conn != 0;
 }
 
@@ -233,26 +506,438 @@ int hrpc_once_timeout() {
     return self.once_timeout;
 }
 
-void hrpc_send_udp_(struct hrpc_connection* conn, struct hrpc_frame* frame) {
+static int hrpc_sendable_(struct hrpc_connection* conn, unsigned int type) {
     if (!conn) {
-        return;
+        return 0;
     }
     if (self.is_server) {
         if (conn->active_time + 3000 < time_curruent_ms()) {    // 未活跃，直接放弃发送，等待活跃后发送
-            return;
+            return 0;
         }
     } else {
-        if (conn->active_time + 3000 < time_curruent_ms() && frame->type != k_hrpc_frame_heartbeat) {
-            return;
+        if (conn->active_time + 3000 < time_curruent_ms() && type != k_hrpc_frame_heartbeat) {
+            return 0;
         }
     }
+    return 1;
+}
+
+// 一次系统调用发出多帧, 发不出去的和丢包一样等重试
+static void hrpc_send_frames_(struct mmsghdr* msgs, int n, int flags) {
+    int sent = sendmmsg(self.sockfd, msgs, n, flags);
+    if (flags & MSG_ZEROCOPY && sent > 0) {
+        self.zc_sent += sent;    // 每个成功的报文占一个通知序号
+    }
+}
+
+int hrpc_zerocopy(int min_size) {
+    int one = 1;
+    if (min_size > 0 && setsockopt(self.sockfd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) != 0) {
+        return 0;
+    }
+    self.zc_min = min_size > 0 ? min_size : 0;
+    return 1;
+}
+
+int hrpc_wire_version(int version) {
+    if (version < (k_hrpc_wire_v1_native ? k_hrpc_wire_v1 : k_hrpc_wire_v2) || version > k_hrpc_wire_v2) {    // 大端机器不能用版本1
+        return 0;
+    }
+    self.wire_version = version;
+    return 1;
+}
+
+static int hrpc_compress_hashcode_(const void* ptr) {
+    return ((const struct hrpc_compress_policy*)ptr)->nid;
+}
+
+static int hrpc_compress_equal_(const void* a, const void* b) {
+    return ((const struct hrpc_compress_policy*)a)->nid == ((const struct hrpc_compress_policy*)b)->nid;
+}
+
+int hrpc_compress(int nid, int min_size) {
+    if (min_size < 0) {
+        return 0;
+    }
+    if (!nid) {
+        self.compress_min = min_size;
+        return 1;
+    }
+    if (!self.compress) {
+        self.compress = hashmap_create(64, sizeof(struct hrpc_compress_policy), hrpc_compress_hashcode_, hrpc_compress_equal_);
+    }
+    struct hrpc_compress_policy tmp = {.nid = nid, .min_size = min_size};
+    hashmap_put(self.compress, &tmp);
+    return 1;
+}
+
+static int hrpc_compress_min_(int nid) {    // 不压缩时返回INT_MAX
+    int min_size = self.compress_min;
+    if (self.compress) {
+        struct hrpc_compress_policy tmp = {.nid = nid};
+        struct hrpc_compress_policy* policy = hashmap_get(self.compress, &tmp);
+        if (policy) {
+            min_size = policy->min_size;
+        }
+    }
+    return min_size > 0 ? min_size : 0x7fffffff;
+}
+
+static void hrpc_zbuf_reserve_(int size) {
+    if (size > self.zbuf_cap) {
+        self.zbuf_cap = size;
+        self.zbuf = realloc(self.zbuf, size);
+    }
+}
+
+// 改变pack在fmap里的大小, 值可能被搬走, 同时更新map里的指针
+static struct hrpc_pack* hrpc_pack_resize_(struct densemap* map, const char* path, struct hrpc_pack* pack, int psize) {
+    densemap_del(map, pack);
+    struct fmap_index* fi = fmap_resize(self.db, fmap_get(self.db, path), psize);
+    pack = fmap_val(self.db, fi, psize);
+    densemap_add(map, pack);
+    return pack;
+}
+
+// 双方都声明支持版本2之后才发紧凑帧
+static inline int hrpc_wire_v2_(struct hrpc_connection* conn) {
+    return self.wire_version >= k_hrpc_wire_v2 && conn->wire_version >= k_hrpc_wire_v2;
+}
+
+static inline unsigned char hrpc_epoch_(long long connect_time) {
+    return (unsigned long long)connect_time * 0x9E3779B97F4A7C15ull >> 56;
+}
+
+static inline int hrpc_varint_put_(unsigned char* p, unsigned long long v) {
+    int n = 0;
+    while (v >= 0x80) {
+        p[n++] = (unsigned char)v | 0x80;
+        v >>= 7;
+    }
+    p[n++] = (unsigned char)v;
+    return n;
+}
+
+static inline int hrpc_varint_get_(const unsigned char* p, const unsigned char* end, unsigned long long* v) {    // 越界返回0
+    *v = 0;
+    for (int n = 0; n < 10 && p + n < end; n++) {
+        *v |= (unsigned long long)(p[n] & 0x7f) << (7 * n);
+        if (!(p[n] & 0x80)) {
+            return n + 1;
+        }
+    }
+    return 0;
+}
+
+static inline void hrpc_le_put_(unsigned char* p, unsigned long long v, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        p[i] = (unsigned char)(v >> (8 * i));
+    }
+}
+
+static inline unsigned long long hrpc_le_get_(const unsigned char* p, int bytes) {
+    unsigned long long v = 0;
+    for (int i = 0; i < bytes; i++) {
+        v |= (unsigned long long)p[i] << (8 * i);
+    }
+    return v;
+}
+
+static int hrpc_wire_head_v2_(unsigned char* p, unsigned int type, long long connect_time, int id_code) {
+    p[0] = type;
+    p[1] = hrpc_epoch_(connect_time);
+    hrpc_le_put_(p + 2, self.nid, 4);
+    p[6] = id_code;
+    p[7] = k_hrpc_wire_v2;
+    return k_hrpc_wire_head_v2;
+}
+
+// 数据帧的id只发低位: 在途的id都在(acked, send]之内, 接收方的reci也在这个区间, 字节数保证差值不超过半个窗口
+static int hrpc_wire_data_v2_(unsigned char* p, struct hrpc_connection* conn, struct hrpc_pack* pack, int i) {
+    unsigned long long span = conn->send - conn->acked;
+    int code = span < 1ull << 7 ? 0 : span < 1ull << 15 ? 1 : span < 1ull << 31 ? 2 : 3;
+    int n = hrpc_wire_head_v2_(p, k_hrpc_frame_data | (pack->raw_size ? k_hrpc_wire_compressed : 0), pack->connect_time, code);
+    hrpc_le_put_(p + n, pack->id, 1 << code);
+    n += 1 << code;
+    n += hrpc_varint_put_(p + n, pack->size);
+    if (pack->raw_size) {
+        n += hrpc_varint_put_(p + n, pack->raw_size);
+    }
+    n += hrpc_varint_put_(p + n, i);
+    return n;
+}
+
+static int hrpc_wire_ack_v2_(unsigned char* p, struct hrpc_frame* frame) {
+    int n = hrpc_wire_head_v2_(p, k_hrpc_frame_ack, frame->connect_time, 0);
+    n += hrpc_varint_put_(p + n, frame->id);
+    n += hrpc_varint_put_(p + n, frame->data.ack.count);
+    unsigned int last = 0;
+    for (unsigned int i = 0; i < frame->data.ack.count; i++) {    // 序号是递增的, 只发差值
+        n += hrpc_varint_put_(p + n, frame->data.ack.recived[i] - last);
+        last = frame->data.ack.recived[i];
+    }
+    return n;
+}
+
+// 按离expected最近的值还原截断的id
+static unsigned long long hrpc_wire_id_(unsigned long long truncated, int bytes, unsigned long long expected) {
+    if (bytes == 8) {
+        return truncated;
+    }
+    unsigned long long win = 1ull << (8 * bytes);
+    unsigned long long id = (expected & ~(win - 1)) | truncated;
+    if (id + win / 2 <= expected) {
+        id += win;
+    } else if (id > expected + win / 2 && id >= win) {
+        id -= win;
+    }
+    return id;
+}
+
+// 把版本2的帧还原成hrpc_frame的头部字段, 数据帧的数据不复制, 通过payload返回, 压缩过的通过raw_size返回解压后大小
+// 没有对应的连接或者纪元不一致返回0
+static int hrpc_wire_parse_v2_(const unsigned char* p, int size, struct hrpc_frame* frame, const char** payload, unsigned int* raw_size) {
+    const unsigned char* end = p + size;
+    if (size < k_hrpc_wire_head_v2) {
+        return 0;
+    }
+    struct hrpc_connection* conn = hrpc_connection_get_(hrpc_le_get_(p + 2, 4));
+    if (!conn || p[1] != hrpc_epoch_(conn->connect_time)) {
+        return 0;
+    }
+    int compressed = p[0] & k_hrpc_wire_compressed;
+    frame->type = p[0] & ~k_hrpc_wire_compressed;
+    frame->nid = conn->nid;
+    frame->connect_time = conn->connect_time;
+    frame->size = 0;
+    *raw_size = 0;
+    p += k_hrpc_wire_head_v2;
+    unsigned long long v;
+    int n;
+    if (frame->type == k_hrpc_frame_data) {
+        int bytes = 1 << (p[-2] & 3);
+        if (end - p < bytes) {
+            return 0;
+        }
+        frame->id = hrpc_wire_id_(hrpc_le_get_(p, bytes), bytes, conn->reci + 1);
+        p += bytes;
+        if (!(n = hrpc_varint_get_(p, end, &v))) {
+            return 0;
+        }
+        frame->size = v;
+        p += n;
+        if (compressed) {
+            if (!(n = hrpc_varint_get_(p, end, &v)) || !v) {
+                return 0;
+            }
+            *raw_size = v;
+            p += n;
+        }
+        if (!(n = hrpc_varint_get_(p, end, &v))) {
+            return 0;
+        }
+        frame->data.pack.i = v;
+        p += n;
+        unsigned int frame_count = get_frame_count(frame->size);
+        if (frame->data.pack.i >= frame_count || end - p != (frame->data.pack.i < frame_count - 1 ? 1024 : frame->size - frame->data.pack.i * 1024)) {
+            return 0;
+        }
+        *payload = (const char*)p;
+        return 1;
+    }
+    if (frame->type == k_hrpc_frame_ack) {
+        if (!(n = hrpc_varint_get_(p, end, &v))) {
+            return 0;
+        }
+        frame->id = v;
+        p += n;
+        if (!(n = hrpc_varint_get_(p, end, &v)) || v > 256) {
+            return 0;
+        }
+        frame->data.ack.count = v;
+        p += n;
+        unsigned int last = 0;
+        for (unsigned int i = 0; i < frame->data.ack.count; i++) {
+            if (!(n = hrpc_varint_get_(p, end, &v))) {
+                return 0;
+            }
+            last += v;
+            frame->data.ack.recived[i] = last;
+            p += n;
+        }
+        return 1;
+    }
+    return 0;    // 心跳只用版本1
+}
+
+// 心跳: 版本1的布局, 每个字段按小端写, 填充的字节是0
+static int hrpc_wire_heartbeat_(unsigned char* p, struct hrpc_frame* frame) {
+    memset(p, 0, k_hrpc_wire_heartbeat);
+    hrpc_le_put_(p + offsetof(struct hrpc_frame, id), frame->id, 8);
+    hrpc_le_put_(p + offsetof(struct hrpc_frame, nid), frame->nid, 4);
+    hrpc_le_put_(p + offsetof(struct hrpc_frame, size), frame->size, 4);
+    hrpc_le_put_(p + offsetof(struct hrpc_frame, connect_time), frame->connect_time, 8);
+    hrpc_le_put_(p + offsetof(struct hrpc_frame, type), frame->type, 4);
+    hrpc_le_put_(p + offsetof(struct hrpc_frame, data.sync.reci), frame->data.sync.reci, 8);
+    hrpc_le_put_(p + offsetof(struct hrpc_frame, data.sync.send), frame->data.sync.send, 8);
+    p[offsetof(struct hrpc_frame, data.sync._)] = self.wire_version;    // 版本声明, 旧节点按原来的长度读取, 忽略这个字节
+    return k_hrpc_wire_heartbeat;
+}
+
+// 按小端读出版本1布局的心跳, 不是心跳返回0. 旧节点的心跳没有版本声明, 按版本1处理
+static int hrpc_wire_parse_heartbeat_(const unsigned char* p, int size, struct hrpc_frame* frame) {
+    if (size < (int)offsetof(struct hrpc_frame, data.sync._) || hrpc_le_get_(p + offsetof(struct hrpc_frame, type), 4) != k_hrpc_frame_heartbeat) {
+        return 0;
+    }
+    frame->id = hrpc_le_get_(p + offsetof(struct hrpc_frame, id), 8);
+    frame->nid = hrpc_le_get_(p + offsetof(struct hrpc_frame, nid), 4);
+    frame->size = hrpc_le_get_(p + offsetof(struct hrpc_frame, size), 4);
+    frame->connect_time = hrpc_le_get_(p + offsetof(struct hrpc_frame, connect_time), 8);
+    frame->type = k_hrpc_frame_heartbeat;
+    frame->data.sync.reci = hrpc_le_get_(p + offsetof(struct hrpc_frame, data.sync.reci), 8);
+    frame->data.sync.send = hrpc_le_get_(p + offsetof(struct hrpc_frame, data.sync.send), 8);
+    frame->data.sync._ = size >= (int)k_hrpc_wire_heartbeat ? p[offsetof(struct hrpc_frame, data.sync._)] : k_hrpc_wire_v1;
+    return 1;
+}
+
+// 删除发送缓存. 还有没完成的zerocopy发送时先挂起, 完成之后再删, 避免内核还在读的内存被复用
+static void hrpc_send_drop_(const char* lo, const char* hi) {
+    if (self.zc_done == self.zc_sent) {
+        if (hi) {
+            fmap_del_range(self.db, lo, hi);
+        } else {
+            fmap_del(self.db, lo);
+        }
+        return;
+    }
+    if (self.zc_defer_count == self.zc_defer_cap) {
+        self.zc_defer_cap = self.zc_defer_cap ? self.zc_defer_cap * 2 : 64;
+        self.zc_defer = realloc(self.zc_defer, sizeof(struct hrpc_zc_defer) * self.zc_defer_cap);
+    }
+    struct hrpc_zc_defer* d = &self.zc_defer[self.zc_defer_count++];
+    d->barrier = self.zc_sent;
+    snprintf(d->lo, sizeof(d->lo), "%s", lo);
+    snprintf(d->hi, sizeof(d->hi), "%s", hi ? hi : "");
+}
+
+// 记录完成的区间[lo, hi], zc_done只推进到连续完成的位置. 序号会回绕, 都按相对zc_done的距离比较
+static void hrpc_zc_complete_(unsigned int lo, unsigned int hi) {
+    if ((int)(hi + 1 - self.zc_done) <= 0) {
+        return;
+    }
+    if ((int)(lo - self.zc_done) < 0) {
+        lo = self.zc_done;
+    }
+    if (self.zc_range_count == self.zc_range_cap) {
+        self.zc_range_cap = self.zc_range_cap ? self.zc_range_cap * 2 : 16;
+        self.zc_ranges = realloc(self.zc_ranges, sizeof(struct hrpc_zc_range) * self.zc_range_cap);
+    }
+    int i = self.zc_range_count;
+    while (i > 0 && self.zc_ranges[i - 1].lo - self.zc_done > lo - self.zc_done) {
+        self.zc_ranges[i] = self.zc_ranges[i - 1];
+        i--;
+    }
+    self.zc_ranges[i].lo = lo;
+    self.zc_ranges[i].hi = hi;
+    self.zc_range_count++;
+    int k = 0;
+    for (i = 1; i < self.zc_range_count; i++) {    // 合并重叠和相邻的区间
+        struct hrpc_zc_range* last = &self.zc_ranges[k];
+        struct hrpc_zc_range* cur = &self.zc_ranges[i];
+        if (cur->lo - self.zc_done <= last->hi + 1 - self.zc_done) {
+            if (cur->hi - self.zc_done > last->hi - self.zc_done) {
+                last->hi = cur->hi;
+            }
+        } else {
+            self.zc_ranges[++k] = *cur;
+        }
+    }
+    self.zc_range_count = k + 1;
+    if (self.zc_ranges[0].lo == self.zc_done) {
+        self.zc_done = self.zc_ranges[0].hi + 1;
+        memmove(self.zc_ranges, self.zc_ranges + 1, sizeof(struct hrpc_zc_range) * --self.zc_range_count);
+    }
+}
+
+// 读取错误队列里的zerocopy完成通知, 删除已经不再被引用的发送缓存
+static void hrpc_zc_reap_() {
+    if (self.zc_done == self.zc_sent && !self.zc_defer_count) {
+        return;
+    }
+    char control[128];
+    struct msghdr msg = {0};
+    while (1) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(self.sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            break;
+        }
+        for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            struct sock_extended_err* ee = (struct sock_extended_err*)CMSG_DATA(cm);
+            if (ee->ee_origin == SO_EE_ORIGIN_ZEROCOPY && ee->ee_errno == 0) {
+                hrpc_zc_complete_(ee->ee_info, ee->ee_data);    // 通知区间是[ee_info, ee_data]
+            }
+        }
+    }
+    int keep = 0;
+    for (int i = 0; i < self.zc_defer_count; i++) {
+        struct hrpc_zc_defer* d = &self.zc_defer[i];
+        if ((int)(self.zc_done - d->barrier) < 0) {
+            self.zc_defer[keep++] = *d;
+        } else if (d->hi[0]) {
+            fmap_del_range(self.db, d->lo, d->hi);
+        } else {
+            fmap_del(self.db, d->lo);
+        }
+    }
+    self.zc_defer_count = keep;
+}
+
+// 等提交的zerocopy发送完成, 把挂起的删除执行掉
+// 挂起的删除是按key记的, 重连之后发送缓存的id从1开始, key会被新包复用, 重建连接之前必须清掉prefix下的
+// 超时不再等, prefix下还挂起的删除直接丢弃, 由调用方整段删除. 内核还没发出的旧帧可能读到复用后的内容, 只是一次坏的重发
+static void hrpc_zc_flush_(const char* prefix) {
+    long long deadline = time_curruent_ms() + k_hrpc_zc_flush_timeout;
+    while (self.zc_done != self.zc_sent && time_curruent_ms() < deadline) {
+        struct pollfd pfd = {.fd = self.sockfd, .events = 0};    // 错误队列有通知时返回POLLERR
+        poll(&pfd, 1, 10);
+        hrpc_zc_reap_();
+    }
+    hrpc_zc_reap_();
+    int len = strlen(prefix);
+    int keep = 0;
+    for (int i = 0; i < self.zc_defer_count; i++) {
+        if (strncmp(self.zc_defer[i].lo, prefix, len) != 0) {
+            self.zc_defer[keep++] = self.zc_defer[i];
+        }
+    }
+    self.zc_defer_count = keep;
+}
+
+void hrpc_send_udp_(struct hrpc_connection* conn, struct hrpc_frame* frame) {
+    if (!hrpc_sendable_(conn, frame->type)) {
+        return;
+    }
     int size = 0;
+    if (frame->type == k_hrpc_frame_heartbeat) {
+        static unsigned char wire[sizeof(struct hrpc_frame)];
+        size = hrpc_wire_heartbeat_(wire, frame);
+        sendto(self.sockfd, wire, size, 0, (struct sockaddr*)&conn->target_addr, sizeof(struct sockaddr_in));
+        return;
+    }
+    if (frame->type == k_hrpc_frame_ack && hrpc_wire_v2_(conn)) {
+        static unsigned char wire[k_hrpc_wire_head_v2 + 10 + 5 + 256 * 5];
+        size = hrpc_wire_ack_v2_(wire, frame);
+        sendto(self.sockfd, wire, size, 0, (struct sockaddr*)&conn->target_addr, sizeof(struct sockaddr_in));
+        return;
+    }
+    if (!k_hrpc_wire_v1_native) {
+        return;
+    }
     if (frame->type == k_hrpc_frame_ack) {
         size = (const int)offsetof(struct hrpc_frame, data.ack.recived) + (frame->data.ack.count * sizeof(unsigned int));
-    } else if (frame->type == k_hrpc_frame_data) {
-        size = (const int)offsetof(struct hrpc_frame, data.pack.buff) + (frame->data.pack.i < get_frame_count(frame->size) - 1 ? 1024 : frame->size - frame->data.pack.i * 1024);
     } else {
-        size = (const int)offsetof(struct hrpc_frame, data.sync._);
+        size = (const int)offsetof(struct hrpc_frame, data.pack.buff) + (frame->data.pack.i < get_frame_count(frame->size) - 1 ? 1024 : frame->size - frame->data.pack.i * 1024);
     }
     sendto(self.sockfd, frame, size, 0, (struct sockaddr*)&conn->target_addr, sizeof(struct sockaddr_in));
 }
@@ -271,23 +956,48 @@ int hrpc_send_once_(struct hrpc_pack* pack, long long curtime) {
     }
     pack->retry++;
     pack->last_time = curtime;
+    struct hrpc_connection* conn = hrpc_connection_get_(pack->nid);
+    if (!hrpc_sendable_(conn, k_hrpc_frame_data)) {
+        return 0;
+    }
+    if ((pack->raw_size || !k_hrpc_wire_v1_native) && !hrpc_wire_v2_(conn)) {    // 压缩过的只能用版本2发, 对端退回版本1时等重新协商
+        return 0;
+    }
     int frame_count = get_frame_count(pack->size);
-    int send_count = 0;
-    struct hrpc_connection* conn = bsearch_get(self.connections->connections, cmp_int, &pack->nid);
+    int flags = self.zc_min && (int)pack->size >= self.zc_min ? MSG_ZEROCOPY : 0;
+    const unsigned char* done = hrpc_pack_done(pack);
+    char* buff = hrpc_pack_buff(pack);
+    int v2 = hrpc_wire_v2_(conn);
+    static struct hrpc_frame_head heads[k_hrpc_send_batch];    // 版本2的头部更短, 也放在这里
+    static struct iovec iovs[k_hrpc_send_batch][2];
+    static struct mmsghdr msgs[k_hrpc_send_batch];
+    int n = 0;
     for (int p = 0; p < frame_count; p++) {
-        if (pack->done[p]) {
+        if (hrpc_bit_get(done, p)) {
             continue;
         }
-        static struct hrpc_frame frame;
-        frame.type = k_hrpc_frame_data;
-        frame.id = pack->id;
-        frame.nid = self.nid;
-        frame.size = pack->size;
-        frame.connect_time = pack->connect_time;
-        frame.data.pack.i = p;
-        memcpy(frame.data.pack.buff, pack->buff + p * 1024, p < frame_count - 1 ? 1024 : pack->size - p * 1024);
-        hrpc_send_udp_(conn, &frame);
-        send_count++;
+        struct hrpc_frame_head* head = &heads[n];
+        int head_size = sizeof(struct hrpc_frame_head);
+        if (v2) {
+            head_size = hrpc_wire_data_v2_((unsigned char*)head, conn, pack, p);
+        } else {
+            head->type = k_hrpc_frame_data;
+            head->id = pack->id;
+            head->nid = self.nid;
+            head->size = pack->size;
+            head->connect_time = pack->connect_time;
+            head->i = p;
+        }
+        iovs[n][0] = (struct iovec){.iov_base = head, .iov_len = head_size};
+        iovs[n][1] = (struct iovec){.iov_base = buff + p * 1024, .iov_len = p < frame_count - 1 ? 1024 : pack->size - p * 1024};
+        msgs[n].msg_hdr = (struct msghdr){.msg_name = &conn->target_addr, .msg_namelen = sizeof(struct sockaddr_in), .msg_iov = iovs[n], .msg_iovlen = 2};
+        if (++n == k_hrpc_send_batch) {
+            hrpc_send_frames_(msgs, n, flags);
+            n = 0;
+        }
+    }
+    if (n) {
+        hrpc_send_frames_(msgs, n, flags);
     }
     return 0;
 }
@@ -296,19 +1006,22 @@ void* hrpc_send(int nid, int size) {
     if (nid == 0) {
         return 0;
     }
-    struct hrpc_connection* conn = bsearch_get(self.connections->connections, cmp_int, &nid);
+    struct hrpc_connection* conn = hrpc_connection_get_(nid);
     if (!conn) {
         typeof(*conn) tmp = {0};
         tmp.nid = nid;
         tmp.connect_time = time_curruent_us();
         tmp.target_addr = self.get_addr(nid);
-        int p = bsearch_put(self.connections->connections, cmp_int, &tmp);
-        conn = &self.connections->connections[p];
+        conn = hrpc_connection_put_(&tmp);
+        if (!conn) {
+            return 0;
+        }
     }
     unsigned long long id = ++conn->send;
+    self.connections_dirty = 1;
     char path[128];
     snprintf(path, sizeof(path), "/send/%d/%llu", nid, id);
-    int psize = sizeof(struct hrpc_pack) + get_frame_count(size) + size;
+    int psize = hrpc_pack_total_size(size);
     struct fmap_index* fi = fmap_add(self.db, path, 0, psize);
     struct hrpc_pack* pack = fmap_val(self.db, fi, psize);
     pack->id = id;
@@ -317,18 +1030,221 @@ void* hrpc_send(int nid, int size) {
     pack->connect_time = conn->connect_time;
     pack->last_time = 0;
     pack->retry = 0;
-    pack->done = ((char*)pack) + sizeof(struct hrpc_pack);
-    pack->buff = ((char*)pack) + sizeof(struct hrpc_pack) + get_frame_count(size);
-    hashmap_add(self.send, pack);
+    pack->raw_size = 0;
+    densemap_add(self.send, pack);
+    if (size >= hrpc_compress_min_(nid) && hrpc_wire_v2_(conn)) {
+        if (self.fresh_count == self.fresh_cap) {
+            self.fresh_cap = self.fresh_cap ? self.fresh_cap * 2 : 64;
+            self.fresh = realloc(self.fresh, sizeof(struct hrpc_pack) * self.fresh_cap);
+        }
+        self.fresh[self.fresh_count++] = (struct hrpc_pack){.id = id, .nid = nid};
+    }
     self.once_timeout = 0;
-    return pack->buff;
+    return hrpc_pack_buff(pack);
+}
+
+static pthread_key_t hrpc_ring_key_;
+static pthread_once_t hrpc_ring_once_ = PTHREAD_ONCE_INIT;
+static thread_local struct hrpc_ring* hrpc_ring_local_;
+
+static void hrpc_ring_exit_(void* ptr) {    // 线程退出, 交给hrpc线程消费完之后释放
+    struct hrpc_ring* ring = ptr;
+    __atomic_store_n(&ring->closed, 1, __ATOMIC_RELEASE);
+}
+
+static void hrpc_ring_key_init_() {
+    pthread_key_create(&hrpc_ring_key_, hrpc_ring_exit_);
+}
+
+static struct hrpc_ring* hrpc_ring_local_get_() {
+    struct hrpc_ring* ring = hrpc_ring_local_;
+    if (ring) {
+        return ring;
+    }
+    ring = aligned_alloc(64, sizeof(struct hrpc_ring));
+    ring->tail = 0;
+    ring->reserve = 0;
+    ring->head = 0;
+    ring->closed = 0;
+    ring->next = __atomic_load_n(&self.rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&self.rings, &ring->next, ring, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+    pthread_once(&hrpc_ring_once_, hrpc_ring_key_init_);
+    pthread_setspecific(hrpc_ring_key_, ring);
+    hrpc_ring_local_ = ring;
+    return ring;
+}
+
+void* hrpc_send_reserve(int nid, int size) {
+    if (nid == 0 || size < 0 || size > k_hrpc_ring_size / 2) {    // 先检查size, 下面的对齐不会溢出
+        return 0;
+    }
+    int need = sizeof(struct hrpc_ring_head) + ((size + 7) & ~7);
+    if (need > k_hrpc_ring_size / 2) {
+        return 0;
+    }
+    struct hrpc_ring* ring = hrpc_ring_local_get_();
+    unsigned long long pos = ring->tail;
+    int off = pos & (k_hrpc_ring_size - 1);
+    int pad = off + need > k_hrpc_ring_size ? k_hrpc_ring_size - off : 0;    // 放不下就从开头开始
+    if (pos + pad + need - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) > k_hrpc_ring_size) {
+        return 0;
+    }
+    if (pad) {
+        struct hrpc_ring_head* h = (struct hrpc_ring_head*)(ring->buff + off);
+        h->nid = 0;
+        h->size = pad - sizeof(struct hrpc_ring_head);
+        pos += pad;
+        off = 0;
+    }
+    struct hrpc_ring_head* h = (struct hrpc_ring_head*)(ring->buff + off);
+    h->nid = nid;
+    h->size = size;
+    ring->reserve = pos + need;
+    return h + 1;
+}
+
+static void hrpc_wakeup_() {
+    if (__atomic_exchange_n(&self.submit_signaled, 1, __ATOMIC_ACQ_REL) == 0) {    // hrpc线程取走之前只通知一次
+        unsigned long long one = 1;
+        write(self.submit_fd, &one, sizeof(one));
+    }
+}
+
+void hrpc_send_commit(void* buff) {
+    struct hrpc_ring* ring = hrpc_ring_local_;
+    struct hrpc_ring_head* h = (struct hrpc_ring_head*)buff - 1;
+    // 只能提交本线程最近一次申请的缓冲区, 并且只提交一次
+    assert(ring && ring->reserve > ring->tail);
+    assert((char*)h == ring->buff + ((ring->reserve - sizeof(struct hrpc_ring_head) - ((h->size + 7) & ~7)) & (k_hrpc_ring_size - 1)));
+    (void)h;
+    __atomic_store_n(&ring->tail, ring->reserve, __ATOMIC_RELEASE);
+    hrpc_wakeup_();
+}
+
+int hrpc_submit_fd() {
+    return self.submit_fd;
+}
+
+// 本轮新发送的消息在落盘和第一次发送之前原地压缩, 帧数按压缩后的大小算. 省不到1/8的保持原样
+static void hrpc_compress_packs_() {
+    for (int i = 0; i < self.fresh_count; i++) {
+        struct hrpc_pack* pack = densemap_get(self.send, &self.fresh[i]);
+        if (!pack || pack->raw_size || pack->retry) {    // 连接重建时已经删掉了
+            continue;
+        }
+        unsigned int size = pack->size;
+        hrpc_zbuf_reserve_(size);
+        int zsize = lz_compress(hrpc_pack_buff(pack), size, self.zbuf, size - size / 8);
+        if (!zsize) {
+            continue;
+        }
+        pack->size = zsize;
+        pack->raw_size = size;
+        memset(hrpc_pack_done(pack), 0, hrpc_pack_bitmap_size(zsize) * 2);
+        memcpy(hrpc_pack_buff(pack), self.zbuf, zsize);
+        char path[128];
+        snprintf(path, sizeof(path), "/send/%u/%llu", pack->nid, pack->id);
+        pack = hrpc_pack_resize_(self.send, path, pack, hrpc_pack_total_size(zsize));
+        fmap_dirty(self.db, pack);
+    }
+    self.fresh_count = 0;
+}
+
+// 把各线程提交的消息按顺序转成hrpc_send, 和本轮的接收一起在fmap_commit时落盘
+static void hrpc_drain_rings_() {
+    if (__atomic_exchange_n(&self.submit_signaled, 0, __ATOMIC_ACQ_REL)) {
+        unsigned long long value;
+        read(self.submit_fd, &value, sizeof(value));
+    }
+    struct hrpc_ring** prev = &self.rings;
+    for (struct hrpc_ring* ring = __atomic_load_n(&self.rings, __ATOMIC_ACQUIRE); ring;) {
+        int closed = __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE);
+        unsigned long long tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        unsigned long long head = ring->head;
+        while (head < tail) {
+            struct hrpc_ring_head* h = (struct hrpc_ring_head*)(ring->buff + (head & (k_hrpc_ring_size - 1)));
+            if (h->nid) {
+                void* dst = hrpc_send(h->nid, h->size);
+                if (!dst) {    // 连接数已满: 留在环里下次再试, 环满了之后提交线程的hrpc_send_reserve返回0
+                    break;
+                }
+                memcpy(dst, h + 1, h->size);
+                head += sizeof(struct hrpc_ring_head) + ((h->size + 7) & ~7);
+            } else {
+                head += sizeof(struct hrpc_ring_head) + h->size;
+            }
+        }
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+        struct hrpc_ring* next = ring->next;
+        struct hrpc_ring* expected = ring;
+        // 链表头可能正在被新线程插入, 用CAS摘掉, 失败说明前面插入了新的环, 下次就不在链表头了
+        if (closed && head == tail && (prev != &self.rings || __atomic_compare_exchange_n(&self.rings, &expected, next, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))) {
+            if (prev != &self.rings) {
+                *prev = next;
+            }
+            free(ring);
+        } else {
+            prev = &ring->next;
+        }
+        ring = next;
+    }
+}
+
+// 收齐了返回pack, 压缩过的收齐之后原地解压成原始布局
+// 压缩的包解压成功之前一帧ack都不回复, 解压失败时清掉收到的帧返回0, 对端还留着整个包, 会全部重发
+static struct hrpc_pack* hrpc_reci_complete_(struct hrpc_pack* pack) {
+    unsigned int zframes = get_frame_count(pack->size);
+    if (!hrpc_bits_full_(hrpc_pack_done(pack), zframes)) {
+        return 0;
+    }
+    if (!pack->raw_size) {
+        return pack;
+    }
+    unsigned int zsize = pack->size;
+    unsigned int size = pack->raw_size;
+    hrpc_zbuf_reserve_(size);
+    if (lz_decompress(hrpc_pack_buff(pack), zsize, self.zbuf, size) != (int)size) {    // 数据损坏, 不能交给应用
+        memset(hrpc_pack_done(pack), 0, hrpc_pack_bitmap_size(zsize));
+        memset(hrpc_pack_acked(pack), 0, hrpc_pack_bitmap_size(zsize));
+        fmap_dirty(self.db, pack);
+        return 0;
+    }
+    char path[128];
+    hrpc_reci_path_(path, sizeof(path), pack->nid, pack->id);
+    pack = hrpc_pack_resize_(self.reci, path, pack, hrpc_pack_total_size(size));
+    pack->size = size;
+    pack->raw_size = 0;
+    unsigned int frame_count = get_frame_count(size);
+    hrpc_bits_fill_(hrpc_pack_done(pack), frame_count);
+    unsigned char* acked = hrpc_pack_acked(pack);
+    hrpc_bits_fill_(acked, frame_count);
+    for (unsigned int p = 0; p < zframes; p++) {    // 对端按压缩后的帧号确认, 留给下一次ack回复
+        hrpc_bit_clear(acked, p);
+    }
+    memcpy(hrpc_pack_buff(pack), self.zbuf, size);
+    fmap_dirty(self.db, pack);
+    return pack;
 }
 
 void hrpc_reci_udp_(void* buff, int size, struct sockaddr_in* target_addr) {
     struct hrpc_frame* frame = buff;
+    const char* payload = frame->data.pack.buff;
+    unsigned int raw_size = 0;    // 版本1的帧不会压缩
+    static struct hrpc_frame parsed;
+    if (size >= k_hrpc_wire_head_v2 && ((unsigned char*)buff)[7] == k_hrpc_wire_v2) {
+        if (!hrpc_wire_parse_v2_(buff, size, &parsed, &payload, &raw_size)) {
+            return;
+        }
+        frame = &parsed;
+    } else if (hrpc_wire_parse_heartbeat_(buff, size, &parsed)) {    // 心跳的第8个字节是id的最高字节, 永远是0
+        frame = &parsed;
+    } else if (!k_hrpc_wire_v1_native) {
+        return;
+    }
     long long curtime = time_curruent_ms();
     char path[128];
-    struct hrpc_connection* conn = bsearch_get(self.connections->connections, cmp_int, &frame->nid);
+    struct hrpc_connection* conn = hrpc_connection_get_(frame->nid);
     if (conn && conn->connect_time != frame->connect_time) {
         conn = 0;
     }
@@ -338,59 +1254,47 @@ void hrpc_reci_udp_(void* buff, int size, struct sockaddr_in* target_addr) {
         tmp.connect_time = frame->connect_time;
         tmp.active_time = curtime;
         tmp.target_addr = *target_addr;
-        int p = bsearch_put(self.connections->connections, cmp_int, &tmp);
-        conn = &self.connections->connections[p];
-        // 删除所有的发送缓存
-        long long send_clear = 0;
-        long long reci_clear = 0;
-        snprintf(path, sizeof(path), "/send/%d/", frame->nid);
-        struct fmap_index* start = fmap_get_ge(self.db, path);
-        snprintf(path, sizeof(path), "/send/%d/~", frame->nid);
-        struct fmap_index* end = fmap_get_ge(self.db, path);
-        while (start && start != end) {
-            struct fmap_index* current = start;
-            start = fmap_nxt(self.db, start);
-            struct hrpc_pack* pack = fmap_val(self.db, current, fmap_val_size(current));
-            hashmap_del(self.send, pack);
-            fmap_del(self.db, fmap_key(current));
-            send_clear++;
+        conn = hrpc_connection_put_(&tmp);
+        if (!conn) {
+            return;
         }
+        // 删除所有的发送缓存. 区间上界是把前缀末尾的'/'加一
+        // 新连接的发送id从1开始, 会复用旧包的key, 不能挂起删除: 先等内核释放zerocopy发送(有超时), 再直接删
+        char hi[128];
+        snprintf(path, sizeof(path), "/send/%d/", frame->nid);
+        snprintf(hi, sizeof(hi), "/send/%d0", frame->nid);
+        hrpc_zc_flush_(path);
+        fmap_scan_prefix(self.db, path, hrpc_drop_pack_, self.send);
+        fmap_del_range(self.db, path, hi);
         // 删除所有的接收缓存
         snprintf(path, sizeof(path), "/reci/%d/", frame->nid);
-        start = fmap_get_ge(self.db, path);
-        snprintf(path, sizeof(path), "/reci/%d/~", frame->nid);
-        end = fmap_get_ge(self.db, path);
-        while (start && start != end) {
-            struct fmap_index* current = start;
-            start = fmap_nxt(self.db, start);
-            struct hrpc_pack* pack = fmap_val(self.db, current, fmap_val_size(current));
-            hashmap_del(self.reci, pack);
-            fmap_del(self.db, fmap_key(current));
-            reci_clear++;
-        }
+        snprintf(hi, sizeof(hi), "/reci/%d0", frame->nid);
+        fmap_scan_prefix(self.db, path, hrpc_drop_pack_, self.reci);
+        fmap_del_range(self.db, path, hi);
     }
     if (frame->type == k_hrpc_frame_ack) {
         static struct hrpc_pack key;
         key.nid = conn->nid;
         key.id = frame->id;
-        struct hrpc_pack* pack = hashmap_get(self.send, &key);
+        struct hrpc_pack* pack = densemap_get(self.send, &key);
         if (pack) {
-            int frame_count = get_frame_count(pack->size);
-            for (unsigned int i = 0; i < frame->data.ack.count; i++) {
-                pack->done[frame->data.ack.recived[i]] = 1;
-            }
-            for (int i = 0; i < frame_count; i++) {
-                if (!pack->done[i]) {
-                    pack = 0;
-                    break;
+            unsigned int frame_count = get_frame_count(pack->size);
+            unsigned char* done = hrpc_pack_done(pack);
+            fmap_dirty(self.db, pack);
+            for (unsigned int i = 0; i < frame->data.ack.count && i < 256; i++) {
+                if (frame->data.ack.recived[i] < frame_count) {
+                    hrpc_bit_set(done, frame->data.ack.recived[i]);
                 }
             }
+            if (!hrpc_bits_full_(done, frame_count)) {
+                pack = 0;
+            }
         }
         if (pack) {
             char path[128];
             snprintf(path, sizeof(path), "/send/%u/%llu", key.nid, key.id);
-            hashmap_del(self.send, &key);
-            fmap_del(self.db, path);
+            densemap_del(self.send, &key);
+            hrpc_send_drop_(path, 0);
         }
         // 这里不需要回复，只有接收方发送ack. 如果接收方的ack丢失问题也不大，无非再发一次，然后每2秒心跳会同步一次reci，所以不会造成一直重复发
     } else if (frame->type == k_hrpc_frame_data) {
@@ -398,48 +1302,56 @@ void hrpc_reci_udp_(void* buff, int size, struct sockaddr_in* target_addr) {
             static struct hrpc_pack key;
             key.id = frame->id;
             key.nid = frame->nid;
-            struct hrpc_pack* pack = hashmap_get(self.reci, &key);
+            struct hrpc_pack* pack = densemap_get(self.reci, &key);
             unsigned int frame_count = get_frame_count(frame->size);
             if (frame->data.pack.i >= frame_count) {
                 return;
             }
             if (!pack) {
-                snprintf(path, sizeof(path), "/reci/%u/%llu", frame->nid, frame->id);
-                int psize = sizeof(struct hrpc_pack) + frame_count + frame->size;
+                hrpc_reci_path_(path, sizeof(path), frame->nid, frame->id);
+                int psize = hrpc_pack_total_size(frame->size);
                 struct fmap_index* fi = fmap_add(self.db, path, 0, psize);
                 pack = fmap_val(self.db, fi, psize);
                 pack->id = key.id;
                 pack->nid = key.nid;
-                pack->done = ((char*)pack) + sizeof(struct hrpc_pack);
-                pack->buff = ((char*)pack) + sizeof(struct hrpc_pack) + frame_count;
-                hashmap_add(self.reci, pack);
+                pack->size = frame->size;    // 位图和数据的位置由size决定
+                pack->raw_size = raw_size;
+                densemap_add(self.reci, pack);
             }
-            if (!pack->done[frame->data.pack.i]) {
-                pack->id = frame->id;
-                pack->nid = frame->nid;
-                pack->size = frame->size;
+            if (pack->size != frame->size || pack->raw_size != raw_size) {
+                return;
+            }
+            unsigned char* done = hrpc_pack_done(pack);
+            if (!hrpc_bit_get(done, frame->data.pack.i)) {
                 pack->connect_time = frame->connect_time;
                 pack->retry = 0;
-                memcpy(pack->buff + frame->data.pack.i * 1024, frame->data.pack.buff, frame->data.pack.i < frame_count - 1 ? 1024 : frame->size - frame->data.pack.i * 1024);
+                memcpy(hrpc_pack_buff(pack) + frame->data.pack.i * 1024, payload, frame->data.pack.i < frame_count - 1 ? 1024 : frame->size - frame->data.pack.i * 1024);
+                hrpc_bit_set(done, frame->data.pack.i);
+            }
+            fmap_dirty(self.db, pack);
+            if (pack->raw_size) {
+                hrpc_reci_complete_(pack);    // 收齐就解压校验, 通过之后才回复ack
             }
-            pack->done[frame->data.pack.i] = 1;
         }
     } else {
+        int version = (unsigned char)frame->data.sync._;
+        conn->wire_version = version < k_hrpc_wire_v2 ? version : k_hrpc_wire_v2;    // 对端降级回版本1时也跟着退回
         if (frame->data.sync.reci > conn->acked) {
             static struct hrpc_pack key;
             key.nid = conn->nid;
             key.id = frame->id;
             for (unsigned long long i = conn->acked + 1; i <= frame->data.sync.reci; i++) {
                 key.id = i;
-                struct hrpc_pack* pack = hashmap_get(self.send, &key);
+                struct hrpc_pack* pack = densemap_get(self.send, &key);
                 if (pack) {
                     char path[128];
                     snprintf(path, sizeof(path), "/send/%u/%llu", key.nid, key.id);
-                    hashmap_del(self.send, &key);
-                    fmap_del(self.db, path);
+                    densemap_del(self.send, &key);
+                    hrpc_send_drop_(path, 0);
                 }
             }
             conn->acked = frame->data.sync.reci;
+            self.connections_dirty = 1;
         }
         if (self.is_server) {
             static struct hrpc_frame heartbeat;
@@ -457,43 +1369,180 @@ void hrpc_reci_udp_(void* buff, int size, struct sockaddr_in* target_addr) {
     conn->target_addr = *target_addr;
 }
 
+static void hrpc_connections_commit_() {
+    if (self.connections_dirty) {
+        fmap_dirty(self.db, self.connections);
+        self.connections_dirty = 0;
+    }
+    fmap_commit(self.db);
+}
+
 static unsigned long long try_handle = 0;
 static unsigned long long real_handle = 0;
 static unsigned long long send_heartbeat = 0;
 
-int hrpc_once(void (*on_message)(int nid, void* message, unsigned int size)) {
-    self.once_timeout = 1000;
+// conn的下一条消息已经交给应用, 删除接收缓存并推进reci
+// 释放conn接下来count条处理完的消息. fmap里是一段连续的key, 多条时一次区间删除
+static void hrpc_reci_release_(struct hrpc_connection* conn, unsigned long long count) {
+    static struct hrpc_pack key;
+    key.nid = conn->nid;
+    for (unsigned long long i = 1; i <= count; i++) {
+        key.id = conn->reci + i;
+        densemap_del(self.reci, &key);
+    }
+    char lo[128];
+    hrpc_reci_path_(lo, sizeof(lo), conn->nid, conn->reci + 1);
+    if (count == 1) {
+        fmap_del(self.db, lo);
+    } else {
+        char hi[128];
+        hrpc_reci_path_(hi, sizeof(hi), conn->nid, conn->reci + count + 1);
+        fmap_del_range(self.db, lo, hi);
+    }
+    conn->reci += count;
+    self.connections_dirty = 1;
+}
 
-    // 处理掉所有的
+static void hrpc_reci_advance_(struct hrpc_connection* conn) {
+    hrpc_reci_release_(conn, 1);
+}
+
+// conn的第reci+ahead条消息, 没有收齐返回0
+static struct hrpc_pack* hrpc_reci_ready_(struct hrpc_connection* conn, unsigned long long ahead) {
+    static struct hrpc_pack key;
+    key.nid = conn->nid;
+    key.id = conn->reci + ahead;
+    struct hrpc_pack* find = densemap_get(self.reci, &key);
+    if (find) {
+        try_handle++;
+        find = hrpc_reci_complete_(find);
+    }
+    return find;
+}
+
+static int hrpc_dispatched_hashcode_(const void* ptr) {
+    return ((const struct hrpc_dispatched*)ptr)->nid;
+}
+
+static int hrpc_dispatched_equal_(const void* a, const void* b) {
+    return ((const struct hrpc_dispatched*)a)->nid == ((const struct hrpc_dispatched*)b)->nid;
+}
+
+// 工作线程处理完的消息: 这时才推进reci并删除接收缓存, 和本轮一起落盘之后才会在心跳里告诉对端
+static void hrpc_pool_complete_() {
+    struct hrpc_pool* pool = self.pool;
+    pthread_mutex_lock(&pool->done_lock);
+    struct hrpc_job* job = pool->done_head;
+    pool->done_head = pool->done_tail = 0;
+    pthread_mutex_unlock(&pool->done_lock);
+    while (job) {
+        struct hrpc_job* next = job->next;
+        struct hrpc_connection* conn = hrpc_connection_get_(job->nid);
+        if (conn && conn->connect_time == job->connect_time && job->id == conn->reci + 1) {
+            hrpc_reci_advance_(conn);
+        }
+        free(job);
+        job = next;
+    }
+}
+
+// 按连接把收齐的消息依次复制给工作线程, 同一个nid总是同一个工作线程
+static void hrpc_pool_dispatch_() {
+    struct hrpc_pool* pool = self.pool;
     for (int i = 0; i < self.connections->connections_count_; i++) {
         struct hrpc_connection* conn = &self.connections->connections[i];
+        struct hrpc_dispatched tmp = {.nid = conn->nid};
+        struct hrpc_dispatched* d = hashmap_get(pool->dispatched, &tmp);
+        if (!d) {
+            d = hashmap_add(pool->dispatched, &tmp);
+        }
+        if (d->connect_time != conn->connect_time || d->id < conn->reci) {    // 连接重建过, 从reci重新开始
+            d->connect_time = conn->connect_time;
+            d->id = conn->reci;
+        }
+        struct hrpc_worker* w = &pool->worker[(unsigned int)conn->nid % pool->workers];
         static struct hrpc_pack key;
         key.nid = conn->nid;
         while (1) {
-            key.id = conn->reci + 1;
-            struct hrpc_pack* find = hashmap_get(self.reci, &key);
-            if (find) {
-                try_handle++;
-                int count = get_frame_count(find->size);
-                for (int k = 0; k < count; k++) {
-                    if (!find->done[k]) {
-                        find = 0;
-                        break;
-                    }
-                }
-            }
-            if (!find) {
+            key.id = d->id + 1;
+            struct hrpc_pack* find = densemap_get(self.reci, &key);
+            if (!find || !(find = hrpc_reci_complete_(find))) {
                 break;
             }
+            struct hrpc_job* job = malloc(sizeof(struct hrpc_job) + find->size);
+            job->next = 0;
+            job->nid = find->nid;
+            job->size = find->size;
+            job->id = find->id;
+            job->connect_time = conn->connect_time;
+            memcpy(job->data, hrpc_pack_buff(find), find->size);
+            pthread_mutex_lock(&w->lock);
+            if (w->tail) {
+                w->tail->next = job;
+            } else {
+                w->head = job;
+            }
+            w->tail = job;
+            pthread_cond_signal(&w->cond);
+            pthread_mutex_unlock(&w->lock);
+            d->id++;
+        }
+    }
+}
+
+static void hrpc_deliver_(void (*on_message)(int nid, void* message, unsigned int size)) {
+    for (int i = 0; i < self.connections->connections_count_; i++) {
+        struct hrpc_connection* conn = &self.connections->connections[i];
+        struct hrpc_pack* find;
+        while ((find = hrpc_reci_ready_(conn, 1))) {
             real_handle++;
-            on_message(find->nid, find->buff, find->size);
-            hashmap_del(self.reci, &key);
-            char path[128];
-            snprintf(path, sizeof(path), "/reci/%u/%llu", key.nid, key.id);
-            fmap_del(self.db, path);
-            conn->reci += 1;
+            on_message(find->nid, hrpc_pack_buff(find), find->size);
+            hrpc_reci_advance_(conn);
         }
     }
+}
+
+// 先收集本轮所有按序就绪的消息一次性交给应用, 回调返回之后再统一释放
+static void hrpc_deliver_batch_(void (*on_batch)(struct hrpc_message* messages, int count)) {
+    int count = 0;
+    for (int i = 0; i < self.connections->connections_count_; i++) {
+        struct hrpc_connection* conn = &self.connections->connections[i];
+        struct hrpc_pack* find;
+        for (unsigned long long ahead = 1; (find = hrpc_reci_ready_(conn, ahead)); ahead++) {
+            if (count == self.batch_cap) {
+                self.batch_cap = self.batch_cap ? self.batch_cap * 2 : 256;
+                self.batch = realloc(self.batch, sizeof(struct hrpc_message) * self.batch_cap);
+            }
+            self.batch[count++] = (struct hrpc_message){.nid = find->nid, .size = find->size, .data = hrpc_pack_buff(find)};
+        }
+    }
+    if (!count) {
+        return;
+    }
+    real_handle += count;
+    on_batch(self.batch, count);
+    for (int i = 0; i < count;) {    // 同一个nid的消息相邻, 每个nid一次区间删除. 回调里可能hrpc_send到新的nid, 连接数组会移动, 按nid重新找
+        int run = 1;
+        while (i + run < count && self.batch[i + run].nid == self.batch[i].nid) {
+            run++;
+        }
+        hrpc_reci_release_(hrpc_connection_get_(self.batch[i].nid), run);
+        i += run;
+    }
+}
+
+static int hrpc_once_(void (*on_message)(int nid, void* message, unsigned int size), void (*on_batch)(struct hrpc_message* messages, int count)) {
+    self.once_timeout = 1000;
+
+    // 处理掉所有的
+    if (self.pool) {
+        hrpc_pool_complete_();
+        hrpc_pool_dispatch_();
+    } else if (on_batch) {
+        hrpc_deliver_batch_(on_batch);
+    } else {
+        hrpc_deliver_(on_message);
+    }
 
     // 接收请求
     char buff[1500];
@@ -525,35 +1574,33 @@ int hrpc_once(void (*on_message)(int nid, void* message, unsigned int size)) {
         }
     }
 
+    hrpc_drain_rings_();
+    hrpc_compress_packs_();
+
+    // 在发出任何数据和ack之前提交: 已确认的接收和新的发送都已落盘. 空转的一轮不标记, group模式下不会每轮都fdatasync
+    hrpc_connections_commit_();
+
     long long curtime = time_curruent_ms();
 
+    hrpc_zc_reap_();
+
     // 发送重试。随机起点是为了降低阻塞概率: 极端情况, 如果一个包随机定位到数组最后边, 前边一直在填充并且发送, 造成对端阻塞(永远无法收到最后一个), 对端消费可能会持续卡住直到网络压力缓解。
-    int rand = util_rand(0, hashmap_count(self.send) - 1);
-    int t = 0;
-    hashmap_foreach(struct hrpc_pack*, pack, self.send) {
-        if (t++ >= rand) {
-            long long nextimeout = hrpc_send_once_(pack, curtime);
-            if (nextimeout < self.once_timeout) {
-                self.once_timeout = nextimeout;
-            }
-        }
-    }
-    t = 0;
-    hashmap_foreach(struct hrpc_pack*, pack, self.send) {
-        if (t++ < rand) {
-            long long nextimeout = hrpc_send_once_(pack, curtime);
-            if (nextimeout < self.once_timeout) {
-                self.once_timeout = nextimeout;
-            }
-        } else {
-            break;
+    int count = densemap_count(self.send);
+    int rand = util_rand(0, count - 1);
+    for (int t = 0; t < count; t++) {
+        struct hrpc_pack* pack = densemap_at(self.send, (rand + t) % count);
+        long long nextimeout = hrpc_send_once_(pack, curtime);
+        if (nextimeout < self.once_timeout) {
+            self.once_timeout = nextimeout;
         }
     }
 
     // 接收包ack
-    hashmap_foreach(struct hrpc_pack*, pack, self.reci) {
-        int frame_count = get_frame_count(pack->size);
-        struct hrpc_connection* conn = bsearch_get(self.connections->connections, cmp_int, &pack->nid);
+    densemap_foreach(struct hrpc_pack*, pack, self.reci) {
+        if (pack->raw_size) {    // 压缩的包解压校验通过之前不回复ack, 失败了对端可以整包重发
+            continue;
+        }
+        struct hrpc_connection* conn = hrpc_connection_get_(pack->nid);
         static struct hrpc_frame frame;
         frame.type = k_hrpc_frame_ack;
         frame.id = pack->id;
@@ -561,16 +1608,23 @@ int hrpc_once(void (*on_message)(int nid, void* message, unsigned int size)) {
         frame.size = 0;
         frame.connect_time = pack->connect_time;
         frame.data.ack.count = 0;
-        for (int p = 0; p < frame_count; p++) {
-            if (pack->done[p] != 1) {
+        unsigned char* done = hrpc_pack_done(pack);
+        unsigned char* acked = hrpc_pack_acked(pack);
+        for (unsigned int b = 0; b < hrpc_pack_bitmap_size(pack->size); b++) {
+            unsigned int pending = done[b] & ~acked[b];    // 收到了但还没回复ack的帧
+            if (!pending) {
                 continue;
             }
-            pack->done[p] = 2;
-            if (frame.data.ack.count >= 256) {
-                hrpc_send_udp_(conn, &frame);
-                frame.data.ack.count = 0;
+            acked[b] |= pending;
+            while (pending) {
+                int p = b * 8 + __builtin_ctz(pending);
+                pending &= pending - 1;
+                if (frame.data.ack.count >= 256) {
+                    hrpc_send_udp_(conn, &frame);
+                    frame.data.ack.count = 0;
+                }
+                frame.data.ack.recived[frame.data.ack.count++] = p;
             }
-            frame.data.ack.recived[frame.data.ack.count++] = p;
         }
         if (frame.data.ack.count > 0) {
             hrpc_send_udp_(conn, &frame);
@@ -602,4 +1656,114 @@ int hrpc_once(void (*on_message)(int nid, void* message, unsigned int size)) {
     }
 
     return self.once_timeout;
-}
\ No newline at end of file
+}
+
+int hrpc_once(void (*on_message)(int nid, void* message, unsigned int size)) {
+    return hrpc_once_(on_message, 0);
+}
+
+int hrpc_once_batch(void (*on_batch)(struct hrpc_message* messages, int count)) {
+    return hrpc_once_(0, on_batch);
+}
+
+static void* hrpc_worker_main_(void* arg) {
+    struct hrpc_worker* w = arg;
+    struct hrpc_pool* pool = self.pool;
+    pthread_mutex_lock(&w->lock);
+    while (1) {
+        while (!w->head && !w->stop) {
+            pthread_cond_wait(&w->cond, &w->lock);
+        }
+        if (w->stop) {    // 没处理的留在接收缓存里, 下次启动重新投递
+            break;
+        }
+        struct hrpc_job* job = w->head;
+        w->head = job->next;
+        if (!w->head) {
+            w->tail = 0;
+        }
+        pthread_mutex_unlock(&w->lock);
+        pool->on_message(job->nid, job->data, job->size);
+        job->next = 0;
+        pthread_mutex_lock(&pool->done_lock);
+        if (pool->done_tail) {
+            pool->done_tail->next = job;
+        } else {
+            pool->done_head = job;
+        }
+        pool->done_tail = job;
+        pthread_mutex_unlock(&pool->done_lock);
+        hrpc_wakeup_();
+        pthread_mutex_lock(&w->lock);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return 0;
+}
+
+static void* hrpc_io_main_(void* arg) {
+    struct hrpc_pool* pool = arg;
+    while (!__atomic_load_n(&pool->stop, __ATOMIC_ACQUIRE)) {
+        int timeout = hrpc_once_(pool->on_message, 0);
+        struct pollfd fds[2] = {{.fd = self.sockfd, .events = POLLIN}, {.fd = self.submit_fd, .events = POLLIN}};
+        poll(fds, 2, timeout);
+    }
+    hrpc_pool_complete_();    // 工作线程已经全部退出, 把处理完的落盘
+    hrpc_connections_commit_();
+    return 0;
+}
+
+int hrpc_start(int workers, void (*on_message)(int nid, void* message, unsigned int size)) {
+    if (self.pool || workers <= 0) {
+        return 0;
+    }
+    struct hrpc_pool* pool = malloc(sizeof(struct hrpc_pool));
+    memset(pool, 0, sizeof(struct hrpc_pool));
+    pool->workers = workers;
+    pool->on_message = on_message;
+    pool->worker = aligned_alloc(64, sizeof(struct hrpc_worker) * workers);
+    pool->dispatched = hashmap_create(64, sizeof(struct hrpc_dispatched), hrpc_dispatched_hashcode_, hrpc_dispatched_equal_);
+    pthread_mutex_init(&pool->done_lock, 0);
+    self.pool = pool;
+    for (int i = 0; i < workers; i++) {
+        struct hrpc_worker* w = &pool->worker[i];
+        memset(w, 0, sizeof(struct hrpc_worker));
+        pthread_mutex_init(&w->lock, 0);
+        pthread_cond_init(&w->cond, 0);
+        pthread_create(&w->thread, 0, hrpc_worker_main_, w);
+    }
+    pthread_create(&pool->io, 0, hrpc_io_main_, pool);
+    return 1;
+}
+
+void hrpc_stop() {
+    struct hrpc_pool* pool = self.pool;
+    if (!pool) {
+        return;
+    }
+    for (int i = 0; i < pool->workers; i++) {    // 先停工作线程, 正在处理的消息处理完
+        struct hrpc_worker* w = &pool->worker[i];
+        pthread_mutex_lock(&w->lock);
+        w->stop = 1;
+        pthread_cond_signal(&w->cond);
+        pthread_mutex_unlock(&w->lock);
+        pthread_join(w->thread, 0);
+    }
+    __atomic_store_n(&pool->stop, 1, __ATOMIC_RELEASE);
+    hrpc_wakeup_();
+    pthread_join(pool->io, 0);
+    for (int i = 0; i < pool->workers; i++) {
+        struct hrpc_worker* w = &pool->worker[i];
+        while (w->head) {
+            struct hrpc_job* next = w->head->next;
+            free(w->head);
+            w->head = next;
+        }
+        pthread_mutex_destroy(&w->lock);
+        pthread_cond_destroy(&w->cond);
+    }
+    pthread_mutex_destroy(&pool->done_lock);
+    hashmap_free(pool->dispatched);
+    free(pool->worker);
+    free(pool);
+    self.pool = 0;
+}
@@ -4,13 +4,49 @@
 
 // 返回 sockfd
 int hrpc_init(const char* dbpath, int nid, int bind_port, struct sockaddr_in (*get_addr)(int nid));
+#define k_hrpc_durability_none 0        // 依赖内核回写, 进程崩溃不丢, 机器掉电可能丢
+#define k_hrpc_durability_periodic 1    // 后台每interval_ms落盘一次
+#define k_hrpc_durability_group 2       // 每次hrpc_once发包/ack之前一次性落盘, 真正的崩溃持久
+// 设置持久化模式, 在hrpc_init之后调用, 默认none
+int hrpc_durability(int mode, int interval_ms);
 // 客户端主动touch连接服务端, 拉起心跳
 int hrpc_touch_connect(int nid);
 // 服务端判断是否已经与指定nid建立连接
 int hrpc_is_connected(int nid);
-// 申请一个完整消息缓冲区
+// 申请一个完整消息缓冲区, 只能在调用hrpc_once的线程里用
 void* hrpc_send(int nid, int size);
+// 任意线程发送: 在本线程自己的提交队列里申请缓冲区, 填好之后 hrpc_send_commit, 两次调用之间不能再申请
+// 下一次hrpc_once时按每个线程的提交顺序落盘发出, 不同线程之间不保证顺序. 队列满或者消息超过2MB返回0
+void* hrpc_send_reserve(int nid, int size);
+void hrpc_send_commit(void* buff);
+// 有新的提交时可读, 和sockfd一起监听, 可读时立即hrpc_once
+int hrpc_submit_fd();
+// 不小于min_size的消息用MSG_ZEROCOPY发送, 内核直接从持久化的缓冲区取数据, 完成通知回来之前不会复用这块内存
+// 每帧只有1KB, 一般只有大消息并且网卡支持时才划算. 0关闭, 内核不支持返回0
+int hrpc_zerocopy(int min_size);
+// 声明并使用的最高帧格式版本, 默认2. 和对端在心跳里协商, 双方都支持才用版本2的紧凑帧, 否则按版本1发送
+// 滚动升级时新旧节点可以混跑; 需要回滚到旧版本前先设成1, 让对端在下一次心跳退回版本1. 版本不支持返回0
+// 版本1的帧按主机字节序, 只在小端机器之间互通; 大端机器只能用版本2, 不能和只支持版本1的节点通信
+int hrpc_wire_version(int version);
+// 发往nid的不小于min_size字节的消息, 在下一次hrpc_once落盘之前用内置的LZ压缩, 按压缩后的大小分帧, 帧数/ack/重传都随之减少
+// 接收方收齐之后解压, on_message拿到的是原始数据. nid为0设置默认值, 单独设置过的nid以自己的为准, min_size为0不压缩
+// 只有协商到帧格式版本2的连接才压缩, 省不到1/8的按原样发送
+int hrpc_compress(int nid, int min_size);
 // 执行一次交换
 int hrpc_once(void (*on_message)(int nid, void* message, unsigned int size));
+struct hrpc_message {
+    int nid;
+    unsigned int size;
+    void* data;
+};
+// 和hrpc_once一样, 但是本轮所有按序收齐的消息一次性交给on_batch, 同一个nid的消息在数组里按顺序相邻
+// messages只在回调内有效, 回调返回之后统一释放接收缓存
+int hrpc_once_batch(void (*on_batch)(struct hrpc_message* messages, int count));
 // 期望在这个超时时间到期后继续下一次hrpc_once. 如果有入包(selector监控到)也需要立即执行
-int hrpc_once_timeout();
\ No newline at end of file
+int hrpc_once_timeout();
+// 线程模式: hrpc自己起一个I/O线程循环hrpc_once, 收齐的消息复制给workers个工作线程执行on_message
+// 同一个nid的消息总是同一个工作线程按顺序处理, 处理完才推进接收进度, 慢的on_message不会卡住其他连接的ack和重发
+// 启动之后不要再调用hrpc_once/hrpc_send, 用hrpc_send_reserve/hrpc_send_commit发送
+int hrpc_start(int workers, void (*on_message)(int nid, void* message, unsigned int size));
+// 等正在处理的消息处理完, 停止所有线程. 没处理的消息留在接收缓存里, 下次启动重新投递
+void hrpc_stop();
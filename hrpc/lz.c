@@ -0,0 +1,183 @@
+#include "lz.h"
+
+#include <memory.h>
+
+#define k_lz_hash_log 12
+#define k_lz_min_match 4
+#define k_lz_last_literals 5    // 块格式要求: 最后5个字节必须是字面量
+#define k_lz_mflimit 12         // 最后一个匹配至少在结尾12字节之前开始
+#define k_lz_max_offset 65535
+
+static inline unsigned int lz_read32_(const unsigned char* p) {
+    unsigned int v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline unsigned int lz_hash_(unsigned int v) {
+    return (v * 2654435761u) >> (32 - k_lz_hash_log);
+}
+
+static inline unsigned char* lz_put_length_(unsigned char* op, int len) {    // 超过15的部分每255一个字节
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+// 输出一个序列: 字面量 + 匹配, match_len为0表示最后一段只有字面量. 空间不够返回0
+static unsigned char* lz_emit_(unsigned char* op, unsigned char* oend, const unsigned char* lit, int lit_len, int offset, int match_len) {
+    if (oend - op < 1 + lit_len / 255 + 1 + lit_len + 2 + match_len / 255 + 1) {
+        return 0;
+    }
+    unsigned char* token = op++;
+    if (lit_len >= 15) {
+        *token = 15 << 4;
+        op = lz_put_length_(op, lit_len - 15);
+    } else {
+        *token = lit_len << 4;
+    }
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if (!match_len) {
+        return op;
+    }
+    *op++ = offset;
+    *op++ = offset >> 8;
+    int ml = match_len - k_lz_min_match;
+    if (ml >= 15) {
+        *token |= 15;
+        op = lz_put_length_(op, ml - 15);
+    } else {
+        *token |= ml;
+    }
+    return op;
+}
+
+int lz_bound(int size) {
+    return size + size / 255 + 16;
+}
+
+int lz_compress(const void* src, int size, void* dst, int cap) {
+    const unsigned char* base = src;
+    const unsigned char* ip = base;
+    const unsigned char* anchor = base;
+    const unsigned char* end = base + size;
+    unsigned char* op = dst;
+    unsigned char* oend = op + cap;
+    if (size > k_lz_mflimit) {
+        const unsigned char* mflimit = end - k_lz_mflimit;
+        const unsigned char* matchlimit = end - k_lz_last_literals;
+        unsigned int table[1 << k_lz_hash_log];    // 位置相对src, 初始0指向开头, 不匹配会被内容比较过滤掉
+        memset(table, 0, sizeof(table));
+        int misses = 0;
+        ip++;
+        while (ip < mflimit) {
+            unsigned int seq = lz_read32_(ip);
+            unsigned int h = lz_hash_(seq);
+            const unsigned char* ref = base + table[h];
+            table[h] = ip - base;
+            if (ref >= ip || ip - ref > k_lz_max_offset || lz_read32_(ref) != seq) {
+                ip += 1 + (misses++ >> 6);    // 连续64次找不到匹配之后步长逐渐加大
+                continue;
+            }
+            misses = 0;
+            while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            int len = k_lz_min_match;
+            while (ip + len < matchlimit && ip[len] == ref[len]) {
+                len++;
+            }
+            op = lz_emit_(op, oend, anchor, ip - anchor, ip - ref, len);
+            if (!op) {
+                return 0;
+            }
+            ip += len;
+            anchor = ip;
+            if (ip < mflimit) {
+                table[lz_hash_(lz_read32_(ip - 2))] = ip - 2 - base;
+            }
+        }
+    }
+    op = lz_emit_(op, oend, anchor, end - anchor, 0, 0);
+    return op ? op - (unsigned char*)dst : 0;
+}
+
+int lz_decompress(const void* src, int size, void* dst, int cap) {
+    const unsigned char* ip = src;
+    const unsigned char* iend = ip + size;
+    unsigned char* op = dst;
+    unsigned char* oend = op + cap;
+    while (ip < iend) {
+        unsigned int token = *ip++;
+        long long len = token >> 4;
+        if (len == 15) {
+            unsigned int b;
+            do {
+                if (ip >= iend) {
+                    return -1;
+                }
+                b = *ip++;
+                len += b;
+            } while (b == 255);
+        }
+        if (len > iend - ip || len > oend - op) {
+            return -1;
+        }
+        if (len <= 16 && iend - ip >= 16 && oend - op >= 16) {    // 短的字面量固定复制16字节, 多出来的会被后面覆盖
+            memcpy(op, ip, 16);
+        } else {
+            memcpy(op, ip, len);
+        }
+        op += len;
+        ip += len;
+        if (ip == iend) {
+            break;
+        }
+        if (iend - ip < 2) {
+            return -1;
+        }
+        int offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > op - (unsigned char*)dst) {
+            return -1;
+        }
+        len = token & 15;
+        if (len == 15) {
+            unsigned int b;
+            do {
+                if (ip >= iend) {
+                    return -1;
+                }
+                b = *ip++;
+                len += b;
+            } while (b == 255);
+        }
+        len += k_lz_min_match;
+        if (len > oend - op) {
+            return -1;
+        }
+        const unsigned char* ref = op - offset;
+        if (offset >= 8 && oend - op >= len + 8) {    // 按8字节复制, 最多多写7个字节
+            unsigned char* end = op + len;
+            do {
+                memcpy(op, ref, 8);
+                op += 8;
+                ref += 8;
+            } while (op < end);
+            op = end;
+        } else if (offset >= len) {
+            memcpy(op, ref, len);
+            op += len;
+        } else {
+            while (len--) {    // 重叠复制, 按字节展开重复的内容
+                *op++ = *ref++;
+            }
+        }
+    }
+    return op - (unsigned char*)dst;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+/**
+ * LZ4块格式的快速压缩: 贪心匹配, 4096项哈希表, 连续找不到匹配时步长逐渐加大, 快速跳过难压的数据
+ * 压缩率不追求极致, 换取速度. 合成的游戏状态快照(./bench_lz): 压缩率约2.8, 压缩400-800MB/s, 解压1.2-2.2GB/s
+ */
+
+/**
+ * 最坏情况(完全不可压缩)的输出大小
+ */
+int lz_bound(int size);
+
+/**
+ * 压缩到dst, 返回压缩后的大小. 超过cap时放弃, 返回0
+ */
+int lz_compress(const void* src, int size, void* dst, int cap);
+
+/**
+ * 解压到dst, 返回解压后的大小. 数据损坏或者超过cap返回-1, 不会越界读写
+ */
+int lz_decompress(const void* src, int size, void* dst, int cap);
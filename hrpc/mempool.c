@@ -0,0 +1,66 @@
+#include "mempool.h"
+
+#include <stdlib.h>
+
+#define k_mempool_chunk_min 64
+#define k_mempool_chunk_max 65536
+
+struct mempool_chunk {
+    struct mempool_chunk* next;
+    long long pad;    // 对象从16字节处开始, 保持malloc的对齐
+};
+
+struct mempool {
+    int element_size;
+    int chunk_count;    // 下一个块的对象数量
+    char* cur;    // 当前块里还没分配过的部分
+    char* end;
+    void* idle;    // 空闲链表, 链接指针存在对象开头
+    struct mempool_chunk* chunks;
+};
+
+struct mempool* mempool_create(int element_size) {
+    struct mempool* self = (struct mempool*)malloc(sizeof(struct mempool));
+    self->element_size = element_size < (int)sizeof(void*) ? (int)sizeof(void*) : (element_size + 7) & ~7;
+    self->chunk_count = k_mempool_chunk_min;
+    self->cur = 0;
+    self->end = 0;
+    self->idle = 0;
+    self->chunks = 0;
+    return self;
+}
+
+void mempool_destroy(struct mempool* self) {
+    while (self->chunks) {
+        struct mempool_chunk* next = self->chunks->next;
+        free(self->chunks);
+        self->chunks = next;
+    }
+    free(self);
+}
+
+void* mempool_alloc(struct mempool* self) {
+    if (self->idle) {
+        void* ptr = self->idle;
+        self->idle = *(void**)ptr;
+        return ptr;
+    }
+    if (self->cur == self->end) {
+        struct mempool_chunk* chunk = malloc(sizeof(struct mempool_chunk) + (long long)self->element_size * self->chunk_count);
+        chunk->next = self->chunks;
+        self->chunks = chunk;
+        self->cur = (char*)(chunk + 1);
+        self->end = self->cur + (long long)self->element_size * self->chunk_count;
+        if (self->chunk_count < k_mempool_chunk_max) {
+            self->chunk_count *= 2;
+        }
+    }
+    void* ptr = self->cur;
+    self->cur += self->element_size;
+    return ptr;
+}
+
+void mempool_free(struct mempool* self, void* ptr) {
+    *(void**)ptr = self->idle;
+    self->idle = ptr;
+}
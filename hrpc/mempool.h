@@ -0,0 +1,18 @@
+#pragma once
+
+/**
+ * 定长对象池: 按块向系统申请, 释放的对象挂在空闲链表上复用, 热路径上不调用malloc/free
+ * 块的大小从64个对象开始翻倍, 最大65536个. 对象按8字节对齐
+ */
+
+struct mempool;
+
+struct mempool* mempool_create(int element_size);
+
+/**
+ * 一次性释放所有块, 不需要逐个释放对象
+ */
+void mempool_destroy(struct mempool* self);
+
+void* mempool_alloc(struct mempool* self);
+void mempool_free(struct mempool* self, void* ptr);
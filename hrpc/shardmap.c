@@ -0,0 +1,168 @@
+#include "shardmap.h"
+
+#include <assert.h>
+#include <memory.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "mempool.h"
+#include "swissmap.h"
+
+#define k_shardmap_bits 6
+#define k_shardmap_shards (1 << k_shardmap_bits)
+
+struct shardmap_shard {
+    pthread_rwlock_t lock;
+    struct swissmap_raw raw;    // 槽位里存元素指针
+    struct mempool* pool;
+} __attribute__((aligned(64)));    // 分片之间不共享缓存行
+
+struct shardmap {
+    struct shardmap_shard shards[k_shardmap_shards];
+    int element_size;
+    int (*func_hashcode)(const void*);
+    int (*func_equal)(const void*, const void*);
+};
+
+static inline unsigned long long shardmap_hashcode_(struct shardmap* self, const void* data) {
+    return swissmap_mix64((unsigned int)self->func_hashcode(data));
+}
+
+// 高位选分片, swiss table用低位, 两者不相关
+static inline struct shardmap_shard* shardmap_shard_(struct shardmap* self, unsigned long long hash) {
+    return &self->shards[hash >> (64 - k_shardmap_bits)];
+}
+
+static int shardmap_eq_(void* ud, const void* slot, const void* key) {
+    struct shardmap* self = ud;
+    return self->func_equal(*(void* const*)slot, key) == 1;
+}
+
+static unsigned long long shardmap_hash_(void* ud, const void* slot) {
+    return shardmap_hashcode_(ud, *(void* const*)slot);
+}
+
+static inline int shardmap_find_(struct shardmap* self, struct shardmap_shard* shard, unsigned long long hash, const void* key) {
+    return swissmap_find_(&shard->raw, hash, key, sizeof(void*), shardmap_eq_, self);
+}
+
+static inline void* shardmap_slot_(struct shardmap_shard* shard, int i) {
+    return ((void**)shard->raw.slots)[i];
+}
+
+static void shardmap_insert_(struct shardmap* self, struct shardmap_shard* shard, unsigned long long hash, const void* data) {
+    void* tmp = mempool_alloc(shard->pool);
+    memcpy(tmp, data, self->element_size);
+    swissmap_reserve_one_(&shard->raw, sizeof(void*), shardmap_hash_, self);
+    int i = swissmap_claim_(&shard->raw, hash);
+    ((void**)shard->raw.slots)[i] = tmp;
+}
+
+struct shardmap* shardmap_create(int init_cap, int element_size, int (*func_hashcode)(const void*), int (*func_equal)(const void*, const void*)) {
+    assert(element_size > 0);
+    struct shardmap* self;
+    if (posix_memalign((void**)&self, 64, sizeof(struct shardmap))) {
+        return 0;
+    }
+    for (int i = 0; i < k_shardmap_shards; i++) {
+        struct shardmap_shard* shard = &self->shards[i];
+        pthread_rwlock_init(&shard->lock, 0);
+        swissmap_raw_init_(&shard->raw, init_cap / k_shardmap_shards, sizeof(void*));
+        shard->pool = mempool_create(element_size);
+    }
+    self->element_size = element_size;
+    self->func_hashcode = func_hashcode;
+    self->func_equal = func_equal;
+    return self;
+}
+
+void shardmap_free(struct shardmap* self) {
+    for (int i = 0; i < k_shardmap_shards; i++) {
+        struct shardmap_shard* shard = &self->shards[i];
+        mempool_destroy(shard->pool);
+        swissmap_raw_free_(&shard->raw);
+        pthread_rwlock_destroy(&shard->lock);
+    }
+    free(self);
+}
+
+int shardmap_count(struct shardmap* self) {
+    int count = 0;
+    for (int i = 0; i < k_shardmap_shards; i++) {
+        count += __atomic_load_n(&self->shards[i].raw.count, __ATOMIC_RELAXED);
+    }
+    return count;
+}
+
+int shardmap_add(struct shardmap* self, const void* data) {
+    unsigned long long hash = shardmap_hashcode_(self, data);
+    struct shardmap_shard* shard = shardmap_shard_(self, hash);
+    pthread_rwlock_wrlock(&shard->lock);
+    int added = shardmap_find_(self, shard, hash, data) < 0;
+    if (added) {
+        shardmap_insert_(self, shard, hash, data);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    return added;
+}
+
+void shardmap_put(struct shardmap* self, const void* data) {
+    unsigned long long hash = shardmap_hashcode_(self, data);
+    struct shardmap_shard* shard = shardmap_shard_(self, hash);
+    pthread_rwlock_wrlock(&shard->lock);
+    int i = shardmap_find_(self, shard, hash, data);
+    if (i < 0) {
+        shardmap_insert_(self, shard, hash, data);
+    } else {
+        memcpy(shardmap_slot_(shard, i), data, self->element_size);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+}
+
+int shardmap_get(struct shardmap* self, const void* key, void* out) {
+    unsigned long long hash = shardmap_hashcode_(self, key);
+    struct shardmap_shard* shard = shardmap_shard_(self, hash);
+    pthread_rwlock_rdlock(&shard->lock);
+    int i = shardmap_find_(self, shard, hash, key);
+    if (i >= 0 && out) {
+        memcpy(out, shardmap_slot_(shard, i), self->element_size);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    return i >= 0;
+}
+
+int shardmap_del(struct shardmap* self, const void* key) {
+    unsigned long long hash = shardmap_hashcode_(self, key);
+    struct shardmap_shard* shard = shardmap_shard_(self, hash);
+    pthread_rwlock_wrlock(&shard->lock);
+    int i = shardmap_find_(self, shard, hash, key);
+    if (i >= 0) {
+        mempool_free(shard->pool, shardmap_slot_(shard, i));
+        swissmap_erase_(&shard->raw, i);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    return i >= 0;
+}
+
+int shardmap_update(struct shardmap* self, const void* key, void (*func)(void* val, void* ud), void* ud) {
+    unsigned long long hash = shardmap_hashcode_(self, key);
+    struct shardmap_shard* shard = shardmap_shard_(self, hash);
+    pthread_rwlock_wrlock(&shard->lock);
+    int i = shardmap_find_(self, shard, hash, key);
+    if (i >= 0) {
+        func(shardmap_slot_(shard, i), ud);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    return i >= 0;
+}
+
+void shardmap_foreach(struct shardmap* self, void (*func)(const void* val, void* ud), void* ud) {
+    for (int s = 0; s < k_shardmap_shards; s++) {
+        struct shardmap_shard* shard = &self->shards[s];
+        pthread_rwlock_rdlock(&shard->lock);
+        for (int i = swissmap_next_(&shard->raw, -1); i >= 0; i = swissmap_next_(&shard->raw, i)) {
+            func(shardmap_slot_(shard, i), ud);
+        }
+        pthread_rwlock_unlock(&shard->lock);
+    }
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+/**
+ * 多线程共享的hash表: 按hash的高位分成64个分片, 每个分片一把读写锁和一张swiss table
+ *   - 不同分片之间的读写互不阻塞, 同一分片的读并发, 写独占
+ *   - 元素总是复制一份存在分片自己的对象池里, 读取也是在锁内复制出来, 不会拿到被其他线程删除的指针
+ *   - 需要读-改-写的用 shardmap_update, 在写锁内原地修改
+ *   - 回调里不要再访问同一个shardmap, 会死锁
+ */
+
+struct shardmap;
+
+/**
+ * @param init_cap 初始总容量, 平均分到每个分片
+ * @param element_size 元素大小, 必须大于0
+ * @param func_hashcode hash函数, 不可为空
+ * @param func_equal 比较函数，不可为空。返回0表示不相等，1表示相等
+ */
+struct shardmap* shardmap_create(int init_cap, int element_size, int (*func_hashcode)(const void*), int (*func_equal)(const void*, const void*));
+
+/**
+ * 释放内存, 调用时不能有其他线程在访问
+ */
+void shardmap_free(struct shardmap* self);
+
+/**
+ * 获得元素计数, 有并发修改时只是一个近似值
+ */
+int shardmap_count(struct shardmap* self);
+
+/**
+ * 不存在才添加, 返回是否添加了
+ */
+int shardmap_add(struct shardmap* self, const void* data);
+
+/**
+ * 存在则替换
+ */
+void shardmap_put(struct shardmap* self, const void* data);
+
+/**
+ * 找到时复制到out并返回1, out为0时只判断是否存在
+ */
+int shardmap_get(struct shardmap* self, const void* key, void* out);
+
+/**
+ * 返回是否删除了
+ */
+int shardmap_del(struct shardmap* self, const void* key);
+
+/**
+ * 持有写锁调用func修改元素, 不能修改key相关的字段. 返回是否找到
+ */
+int shardmap_update(struct shardmap* self, const void* key, void (*func)(void* val, void* ud), void* ud);
+
+/**
+ * 逐个分片持有读锁遍历, 不是整张表的快照
+ */
+void shardmap_foreach(struct shardmap* self, void (*func)(const void* val, void* ud), void* ud);
@@ -0,0 +1,108 @@
+#include "swissmap.h"
+
+#include <memory.h>
+#include <stdlib.h>
+
+#include "mempool.h"
+
+struct swissmap {
+    struct swissmap_raw raw;    // 槽位里存元素指针
+    int element_size;
+    struct mempool* pool;    // element_size不为0时元素都从这里分配
+    int (*func_hashcode)(const void*);
+    int (*func_equal)(const void*, const void*);
+};
+
+static inline unsigned long long swissmap_hashcode_(struct swissmap* self, const void* data) {
+    return swissmap_mix64((unsigned int)self->func_hashcode(data));
+}
+
+static int swissmap_eq_(void* ud, const void* slot, const void* key) {
+    struct swissmap* self = ud;
+    return self->func_equal(*(void* const*)slot, key) == 1;
+}
+
+static unsigned long long swissmap_hash_(void* ud, const void* slot) {
+    return swissmap_hashcode_(ud, *(void* const*)slot);
+}
+
+struct swissmap* swissmap_create(int init_cap, int element_size, int (*func_hashcode)(const void*), int (*func_equal)(const void*, const void*)) {
+    struct swissmap* self = (struct swissmap*)malloc(sizeof(struct swissmap));
+    swissmap_raw_init_(&self->raw, init_cap, sizeof(void*));
+    self->element_size = element_size;
+    self->pool = element_size ? mempool_create(element_size) : 0;
+    self->func_hashcode = func_hashcode;
+    self->func_equal = func_equal;
+    return self;
+}
+
+void swissmap_free(struct swissmap* self) {
+    if (self->pool) {
+        mempool_destroy(self->pool);
+    }
+    swissmap_raw_free_(&self->raw);
+    free(self);
+}
+
+int swissmap_count(struct swissmap* self) {
+    return self->raw.count;
+}
+
+void swissmap_resize(struct swissmap* self, int capacity) {
+    swissmap_rehash_(&self->raw, capacity, sizeof(void*), swissmap_hash_, self);
+}
+
+static inline void* swissmap_insert_(struct swissmap* self, unsigned long long hash, void* data) {
+    if (self->element_size) {
+        void* tmp = mempool_alloc(self->pool);
+        memcpy(tmp, data, self->element_size);
+        data = tmp;
+    }
+    swissmap_reserve_one_(&self->raw, sizeof(void*), swissmap_hash_, self);
+    int i = swissmap_claim_(&self->raw, hash);
+    ((void**)self->raw.slots)[i] = data;
+    return data;
+}
+
+void* swissmap_add(struct swissmap* self, void* data) {    // must not exist
+    return swissmap_insert_(self, swissmap_hashcode_(self, data), data);
+}
+
+void* swissmap_put(struct swissmap* self, void* data) {
+    unsigned long long hash = swissmap_hashcode_(self, data);
+    int i = swissmap_find_(&self->raw, hash, data, sizeof(void*), swissmap_eq_, self);
+    if (i < 0) {
+        return swissmap_insert_(self, hash, data);
+    }
+    void** slot = (void**)self->raw.slots + i;
+    if (self->element_size) {
+        memcpy(*slot, data, self->element_size);
+    } else {
+        *slot = data;
+    }
+    return *slot;
+}
+
+void* swissmap_get(struct swissmap* self, const void* key) {
+    int i = swissmap_find_(&self->raw, swissmap_hashcode_(self, key), key, sizeof(void*), swissmap_eq_, self);
+    return i < 0 ? 0 : ((void**)self->raw.slots)[i];
+}
+
+void swissmap_del(struct swissmap* self, const void* key) {
+    int i = swissmap_find_(&self->raw, swissmap_hashcode_(self, key), key, sizeof(void*), swissmap_eq_, self);
+    if (i < 0) {
+        return;
+    }
+    if (self->element_size) {
+        mempool_free(self->pool, ((void**)self->raw.slots)[i]);
+    }
+    swissmap_erase_(&self->raw, i);
+}
+
+int swissmap_itor_next(struct swissmap* self, int i) {
+    return swissmap_next_(&self->raw, i);
+}
+
+void* swissmap_itor_val(struct swissmap* self, int i) {
+    return ((void**)self->raw.slots)[i];
+}
@@ -0,0 +1,306 @@
+#pragma once
+
+#include <stdlib.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/**
+ * 开放寻址hash表(swiss table): 每个槽位一个字节的控制标记(空/已删除/hash的低7位),
+ * 查找时一次比较16个控制字节(SSE2), 只有标记相同的槽位才调用比较函数。
+ * 和hashmap的区别:
+ *   - 不会因为一个桶满了溢出到相邻桶, 查找不需要重新计算其它元素的hash
+ *   - 删除只修改控制字节, 遍历过程中可以删除当前元素
+ *   - 不会自动缩容, 需要时手动调用 swissmap_resize
+ * 两种用法:
+ *   - struct swissmap: 和hashmap一样的接口, hash/比较通过函数指针
+ *   - swissmap_define: 按key/value类型生成专用的内联版本, hash和比较在编译期内联, 适合固定大小的key
+ */
+
+struct swissmap;
+
+/**
+ * @param init_cap 初始容量
+ * @param element_size 0表示不存储数据，只对指针进行索引. 否则添加时复制一份到map自己的对象池里(mempool), 删除时回收, 释放map时整体释放
+ * @param func_hashcode hash函数, 不可为空. 返回值会再打散一次, 直接返回id也可以
+ * @param func_equal 比较函数，不可为空。返回0表示不相等，1表示相等
+ */
+struct swissmap* swissmap_create(int init_cap, int element_size, int (*func_hashcode)(const void*), int (*func_equal)(const void*, const void*));
+void swissmap_free(struct swissmap* self);
+int swissmap_count(struct swissmap* self);
+
+/**
+ * 调整容量, 小于当前数量时按当前数量
+ */
+void swissmap_resize(struct swissmap* self, int capacity);
+
+/**
+ * 添加元素，⚠ 必须保证不存在
+ */
+void* swissmap_add(struct swissmap* self, void* data);
+
+/**
+ * 存在则替换. element_size不为0时复制到原来的内存里, 返回的指针不变
+ */
+void* swissmap_put(struct swissmap* self, void* data);
+void* swissmap_get(struct swissmap* self, const void* key);
+void swissmap_del(struct swissmap* self, const void* key);
+
+/**
+ * 遍历, 返回下一个元素的位置, 没有了返回-1. 从-1开始
+ * 遍历中可以删除当前元素, 不能添加
+ */
+int swissmap_itor_next(struct swissmap* self, int i);
+void* swissmap_itor_val(struct swissmap* self, int i);
+#ifndef _concat
+#define _concat_impl(a, b) a##b
+#define _concat(a, b) _concat_impl(a, b)
+#endif
+#define swissmap_foreach(type, val, map)                                                                                                        \
+    for (int _concat(__smap_it, __LINE__) = swissmap_itor_next(map, -1); _concat(__smap_it, __LINE__) >= 0; _concat(__smap_it, __LINE__) = -1) \
+        for (type val; _concat(__smap_it, __LINE__) >= 0 && (val = swissmap_itor_val(map, _concat(__smap_it, __LINE__)), 1); _concat(__smap_it, __LINE__) = swissmap_itor_next(map, _concat(__smap_it, __LINE__)))
+
+// ---------------- 下面是两种用法共用的内部实现 ----------------
+
+#define k_swissmap_group 16
+#define k_swissmap_empty ((signed char)-128)
+#define k_swissmap_deleted ((signed char)-2)
+
+struct swissmap_raw {
+    signed char* ctrl;    // capacity + 16 个字节, 末尾16个是开头的镜像, 整组读取不用处理回绕
+    char* slots;
+    int capacity;    // 2的幂, 至少16
+    int count;
+    int growth_left;    // 不扩容还能占用的空槽, 负载上限7/8, 删除标记也占位置
+};
+
+static inline unsigned long long swissmap_mix64(unsigned long long h) {    // murmur3 finalizer, 所有位都充分打散
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static inline unsigned int swissmap_match_(const signed char* group, signed char h2) {
+#if defined(__SSE2__)
+    __m128i g = _mm_loadu_si128((const __m128i*)group);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(h2)));
+#else
+    unsigned int mask = 0;
+    for (int i = 0; i < k_swissmap_group; i++) {
+        mask |= (unsigned int)(group[i] == h2) << i;
+    }
+    return mask;
+#endif
+}
+
+static inline unsigned int swissmap_match_empty_(const signed char* group) {
+    return swissmap_match_(group, k_swissmap_empty);
+}
+
+static inline unsigned int swissmap_match_free_(const signed char* group) {    // 空或者已删除
+#if defined(__SSE2__)
+    __m128i g = _mm_loadu_si128((const __m128i*)group);
+    return _mm_movemask_epi8(_mm_cmpgt_epi8(_mm_set1_epi8(-1), g));
+#else
+    unsigned int mask = 0;
+    for (int i = 0; i < k_swissmap_group; i++) {
+        mask |= (unsigned int)(group[i] < -1) << i;
+    }
+    return mask;
+#endif
+}
+
+static inline void swissmap_set_ctrl_(struct swissmap_raw* t, int i, signed char h) {
+    t->ctrl[i] = h;
+    t->ctrl[((i - k_swissmap_group) & (t->capacity - 1)) + k_swissmap_group] = h;    // 前16个同时写到末尾的镜像
+}
+
+static inline int swissmap_growth_(int capacity) {
+    return capacity - capacity / 8;
+}
+
+static inline void swissmap_raw_init_(struct swissmap_raw* t, int capacity, int slot_size) {
+    int cap = k_swissmap_group;
+    while (swissmap_growth_(cap) < capacity) {
+        cap *= 2;
+    }
+    t->capacity = cap;
+    t->count = 0;
+    t->growth_left = swissmap_growth_(cap);
+    t->ctrl = malloc(cap + k_swissmap_group);
+    memset(t->ctrl, k_swissmap_empty, cap + k_swissmap_group);
+    t->slots = malloc((long long)cap * slot_size);
+}
+
+static inline void swissmap_raw_free_(struct swissmap_raw* t) {
+    free(t->ctrl);
+    free(t->slots);
+    t->ctrl = 0;
+    t->slots = 0;
+}
+
+// 查找, 返回槽位下标, 找不到返回-1. eq是常量时会被内联
+static inline __attribute__((always_inline)) int swissmap_find_(const struct swissmap_raw* t, unsigned long long hash, const void* key, int slot_size, int (*eq)(void* ud, const void* slot, const void* key), void* ud) {
+    int mask = t->capacity - 1;
+    signed char h2 = hash & 0x7f;
+    int pos = (int)(hash >> 7) & mask;
+    for (int step = k_swissmap_group;; step += k_swissmap_group) {
+        const signed char* group = t->ctrl + pos;
+        for (unsigned int m = swissmap_match_(group, h2); m; m &= m - 1) {
+            int i = (pos + __builtin_ctz(m)) & mask;
+            if (eq(ud, t->slots + (long long)i * slot_size, key)) {
+                return i;
+            }
+        }
+        if (swissmap_match_empty_(group)) {
+            return -1;
+        }
+        pos = (pos + step) & mask;    // 三角形探测, 容量是2的幂时能遍历所有组
+    }
+}
+
+// 找一个可以写入的槽位并占用, 调用之前保证 growth_left > 0 或者有可复用的删除标记
+static inline int swissmap_claim_(struct swissmap_raw* t, unsigned long long hash) {
+    int mask = t->capacity - 1;
+    int pos = (int)(hash >> 7) & mask;
+    for (int step = k_swissmap_group;; step += k_swissmap_group) {
+        unsigned int m = swissmap_match_free_(t->ctrl + pos);
+        if (m) {
+            int i = (pos + __builtin_ctz(m)) & mask;
+            if (t->ctrl[i] == k_swissmap_empty) {
+                t->growth_left--;
+            }
+            swissmap_set_ctrl_(t, i, hash & 0x7f);
+            t->count++;
+            return i;
+        }
+        pos = (pos + step) & mask;
+    }
+}
+
+// 重新分配到新容量, 同时清掉删除标记
+static inline __attribute__((always_inline)) void swissmap_rehash_(struct swissmap_raw* t, int capacity, int slot_size, unsigned long long (*hash)(void* ud, const void* slot), void* ud) {
+    struct swissmap_raw old = *t;
+    swissmap_raw_init_(t, capacity > old.count ? capacity : old.count, slot_size);
+    for (int i = 0; i < old.capacity; i++) {
+        if (old.ctrl[i] >= 0) {
+            const char* slot = old.slots + (long long)i * slot_size;
+            int j = swissmap_claim_(t, hash(ud, slot));
+            memcpy(t->slots + (long long)j * slot_size, slot, slot_size);
+        }
+    }
+    swissmap_raw_free_(&old);
+}
+
+// 插入前保证有空槽: 删除标记多的时候原容量重建, 否则翻倍
+static inline __attribute__((always_inline)) void swissmap_reserve_one_(struct swissmap_raw* t, int slot_size, unsigned long long (*hash)(void* ud, const void* slot), void* ud) {
+    if (t->growth_left > 0) {
+        return;
+    }
+    int capacity = t->count * 2 < swissmap_growth_(t->capacity) ? swissmap_growth_(t->capacity) : swissmap_growth_(t->capacity) * 2;
+    swissmap_rehash_(t, capacity, slot_size, hash, ud);
+}
+
+static inline void swissmap_erase_(struct swissmap_raw* t, int i) {
+    int mask = t->capacity - 1;
+    unsigned int after = swissmap_match_empty_(t->ctrl + i);
+    unsigned int before = swissmap_match_empty_(t->ctrl + ((i - k_swissmap_group) & mask));
+    // 前后16个槽位内都有空槽, 说明没有探测序列经过这里时遇到过满组, 可以直接置空
+    if (after && before && __builtin_ctz(after) + (__builtin_clz(before) - 16) < k_swissmap_group) {
+        swissmap_set_ctrl_(t, i, k_swissmap_empty);
+        t->growth_left++;
+    } else {
+        swissmap_set_ctrl_(t, i, k_swissmap_deleted);
+    }
+    t->count--;
+}
+
+static inline int swissmap_next_(const struct swissmap_raw* t, int i) {
+    for (i++; i < t->capacity; i++) {
+        if (t->ctrl[i] >= 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * 按类型生成专用的内联hash表, key和value直接存在槽位里:
+ *   static inline unsigned long long pack_hash(struct pack_key k) { return swissmap_mix64(k.id * 31 + k.nid); }
+ *   static inline int pack_equal(struct pack_key a, struct pack_key b) { return a.id == b.id && a.nid == b.nid; }
+ *   swissmap_define(packmap, struct pack_key, struct hrpc_pack*, pack_hash, pack_equal)
+ * 生成:
+ *   struct packmap                             表, 用 packmap_init/packmap_destroy 初始化和释放
+ *   val_type* packmap_get(m, key)              不存在返回0
+ *   val_type* packmap_put(m, key, &exists)     不存在时插入(值未初始化), 返回值的位置
+ *   int packmap_del(m, key)                    返回是否删除了
+ *   void packmap_resize(m, capacity)
+ * 遍历: swissmap_slot_foreach(slot, m) { slot->key, slot->val }
+ * ⚠ 插入可能扩容, 之前拿到的值指针会失效
+ */
+#define swissmap_define(name, key_type, val_type, hash_fn, equal_fn)                                                    \
+    struct name##_slot {                                                                                                \
+        key_type key;                                                                                                   \
+        val_type val;                                                                                                   \
+    };                                                                                                                  \
+    struct name {                                                                                                       \
+        union {                                                                                                         \
+            struct swissmap_raw raw;                                                                                    \
+            struct {                                                                                                    \
+                signed char* ctrl;                                                                                      \
+                struct name##_slot* slots;                                                                              \
+                int capacity;                                                                                           \
+                int count;                                                                                              \
+            };                                                                                                          \
+        };                                                                                                              \
+    };                                                                                                                  \
+    static inline int name##_eq_(void* ud, const void* slot, const void* key) {                                         \
+        (void)ud;                                                                                                       \
+        return equal_fn(((const struct name##_slot*)slot)->key, *(const key_type*)key);                                 \
+    }                                                                                                                   \
+    static inline unsigned long long name##_hash_(void* ud, const void* slot) {                                         \
+        (void)ud;                                                                                                       \
+        return hash_fn(((const struct name##_slot*)slot)->key);                                                         \
+    }                                                                                                                   \
+    static inline void name##_init(struct name* m, int capacity) {                                                      \
+        swissmap_raw_init_(&m->raw, capacity, sizeof(struct name##_slot));                                              \
+    }                                                                                                                   \
+    static inline void name##_destroy(struct name* m) {                                                                 \
+        swissmap_raw_free_(&m->raw);                                                                                    \
+    }                                                                                                                   \
+    static inline void name##_resize(struct name* m, int capacity) {                                                    \
+        swissmap_rehash_(&m->raw, capacity, sizeof(struct name##_slot), name##_hash_, 0);                               \
+    }                                                                                                                   \
+    static inline val_type* name##_get(struct name* m, key_type key) {                                                  \
+        int i = swissmap_find_(&m->raw, hash_fn(key), &key, sizeof(struct name##_slot), name##_eq_, 0);                 \
+        return i < 0 ? 0 : &m->slots[i].val;                                                                            \
+    }                                                                                                                   \
+    static inline val_type* name##_put(struct name* m, key_type key, int* exists) {                                     \
+        unsigned long long hash = hash_fn(key);                                                                         \
+        int i = swissmap_find_(&m->raw, hash, &key, sizeof(struct name##_slot), name##_eq_, 0);                         \
+        if (exists) {                                                                                                   \
+            *exists = i >= 0;                                                                                           \
+        }                                                                                                               \
+        if (i < 0) {                                                                                                    \
+            swissmap_reserve_one_(&m->raw, sizeof(struct name##_slot), name##_hash_, 0);                                \
+            i = swissmap_claim_(&m->raw, hash);                                                                         \
+            m->slots[i].key = key;                                                                                      \
+        }                                                                                                               \
+        return &m->slots[i].val;                                                                                        \
+    }                                                                                                                   \
+    static inline int name##_del(struct name* m, key_type key) {                                                        \
+        int i = swissmap_find_(&m->raw, hash_fn(key), &key, sizeof(struct name##_slot), name##_eq_, 0);                 \
+        if (i < 0) {                                                                                                    \
+            return 0;                                                                                                   \
+        }                                                                                                               \
+        swissmap_erase_(&m->raw, i);                                                                                    \
+        return 1;                                                                                                       \
+    }
+
+#define swissmap_slot_foreach(slot, m) \
+    for (int _concat(__smap_i, __LINE__) = swissmap_next_(&(m)->raw, -1); _concat(__smap_i, __LINE__) >= 0; _concat(__smap_i, __LINE__) = -1) \
+        for (typeof((m)->slots) slot; _concat(__smap_i, __LINE__) >= 0 && (slot = &(m)->slots[_concat(__smap_i, __LINE__)], 1); _concat(__smap_i, __LINE__) = swissmap_next_(&(m)->raw, _concat(__smap_i, __LINE__)))
@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lz.h"
+
+/**
+ * lz压缩的回归测试: 随机和可压缩的数据来回压缩解压, 截断和损坏的输入不能越界也不能当成完整数据解出来
+ *   ./test_lz
+ */
+
+#define k_test_max_size 300000
+
+static unsigned long long test_rand_state_ = 1;
+static int test_failed_;
+
+static unsigned long long test_rand_() {    // xorshift64
+    test_rand_state_ ^= test_rand_state_ << 13;
+    test_rand_state_ ^= test_rand_state_ >> 7;
+    test_rand_state_ ^= test_rand_state_ << 17;
+    return test_rand_state_;
+}
+
+#define test_check(cond, ...)                          \
+    do {                                               \
+        if (!(cond)) {                                 \
+            printf("fail %s:%d ", __FILE__, __LINE__); \
+            printf(__VA_ARGS__);                       \
+            printf("\n");                              \
+            test_failed_++;                            \
+        }                                              \
+    } while (0)
+
+// 0随机, 1短周期, 2从前面复制片段, 3大部分是0
+static void test_fill_(unsigned char* buff, int size, int mode) {
+    for (int i = 0; i < size; i++) {
+        if (mode == 0) {
+            buff[i] = test_rand_();
+        } else if (mode == 1) {
+            buff[i] = i % 7;
+        } else if (mode == 2) {
+            buff[i] = i > 20 && test_rand_() % 4 ? buff[i - 1 - test_rand_() % 20] : test_rand_();
+        } else {
+            buff[i] = test_rand_() % 8 == 0 ? test_rand_() : 0;
+        }
+    }
+}
+
+static void test_roundtrip_(unsigned char* src, unsigned char* z, unsigned char* out) {
+    for (int t = 0; t < 3000; t++) {
+        int size = test_rand_() % (t < 1000 ? 64 : k_test_max_size);
+        int mode = test_rand_() % 4;
+        test_fill_(src, size, mode);
+
+        int zsize = lz_compress(src, size, z, lz_bound(size));
+        test_check(zsize > 0 && zsize <= lz_bound(size), "compress size %d mode %d -> %d", size, mode, zsize);
+        int n = lz_decompress(z, zsize, out, size);
+        test_check(n == size && memcmp(src, out, size) == 0, "roundtrip size %d mode %d -> %d", size, mode, n);
+
+        // 和hrpc一样限制输出大小, 放弃时返回0, 没放弃的必须能解回来
+        int capped = lz_compress(src, size, z, size - size / 8);
+        if (capped) {
+            n = lz_decompress(z, capped, out, size);
+            test_check(n == size && memcmp(src, out, size) == 0, "capped size %d mode %d -> %d", size, mode, n);
+        }
+        if (mode == 1 && size >= 64) {
+            test_check(capped, "periodic size %d not compressed", size);
+        }
+    }
+}
+
+static void test_corrupt_(unsigned char* src, unsigned char* z, unsigned char* out) {
+    for (int t = 0; t < 1000; t++) {
+        int size = 1 + test_rand_() % 20000;
+        int mode = test_rand_() % 4;
+        test_fill_(src, size, mode);
+        int zsize = lz_compress(src, size, z, lz_bound(size));
+
+        // 输出空间不够
+        test_check(lz_decompress(z, zsize, out, size - 1) == -1, "short cap size %d mode %d", size, mode);
+        // 最后一段总是字面量, 截掉任何一个字节都会读不完
+        test_check(lz_decompress(z, zsize - 1, out, size) == -1, "truncated by one size %d mode %d", size, mode);
+        // 截断在任意位置: 不能越界, 也不能解出完整的数据
+        int cut = test_rand_() % zsize;
+        int n = lz_decompress(z, cut, out, size);
+        test_check(n == -1 || (n >= 0 && n < size), "truncated at %d/%d -> %d", cut, zsize, n);
+        // 随机翻转一些位: 输出不会超过cap
+        for (int k = 0; k < 5; k++) {
+            z[test_rand_() % zsize] ^= 1 << (test_rand_() % 8);
+            n = lz_decompress(z, zsize, out, size);
+            test_check(n >= -1 && n <= size, "corrupted size %d -> %d", size, n);
+        }
+    }
+
+    // 构造的非法输入
+    static const unsigned char zero_offset[] = {0x10, 'a', 0x00, 0x00, 0x00};
+    static const unsigned char far_offset[] = {0x10, 'a', 0x05, 0x00, 0x00};
+    static const unsigned char no_offset[] = {0x10, 'a', 0x05};
+    static const unsigned char long_literal[] = {0xf0, 0xff, 0xff, 0xff};
+    test_check(lz_decompress(zero_offset, sizeof(zero_offset), out, 64) == -1, "zero offset");
+    test_check(lz_decompress(far_offset, sizeof(far_offset), out, 64) == -1, "offset before start");
+    test_check(lz_decompress(no_offset, sizeof(no_offset), out, 64) == -1, "truncated offset");
+    test_check(lz_decompress(long_literal, sizeof(long_literal), out, 64) == -1, "truncated literal length");
+}
+
+int main() {
+    unsigned char* src = malloc(k_test_max_size);
+    unsigned char* z = malloc(lz_bound(k_test_max_size));
+    unsigned char* out = malloc(k_test_max_size);
+    test_roundtrip_(src, z, out);
+    test_corrupt_(src, z, out);
+    free(src);
+    free(z);
+    free(out);
+    printf("%s\n", test_failed_ ? "test_lz fail" : "test_lz ok");
+    return test_failed_ ? 1 : 0;
+}
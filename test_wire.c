@@ -0,0 +1,249 @@
+#include "hrpc.c"
+
+/**
+ * 帧格式的回归测试: 截断id的还原, varint, 版本2的数据帧/ack帧, 显式小端的心跳
+ *   ./test_wire
+ * 直接包含hrpc.c测试里面的静态函数, 编译时不再链接hrpc.c
+ */
+
+#define k_test_db "/tmp/hrpc_test_wire"
+#define k_test_nid 7
+
+static unsigned long long test_rand_state_ = 88172645463325252ull;
+static int test_failed_;
+
+static unsigned long long test_rand_() {    // xorshift64
+    test_rand_state_ ^= test_rand_state_ << 13;
+    test_rand_state_ ^= test_rand_state_ >> 7;
+    test_rand_state_ ^= test_rand_state_ << 17;
+    return test_rand_state_;
+}
+
+#define test_check(cond, ...)                          \
+    do {                                               \
+        if (!(cond)) {                                 \
+            printf("fail %s:%d ", __FILE__, __LINE__); \
+            printf(__VA_ARGS__);                       \
+            printf("\n");                              \
+            test_failed_++;                            \
+        }                                              \
+    } while (0)
+
+static struct sockaddr_in test_get_addr_(int nid) {
+    (void)nid;
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    addr.sin_port = htons(1);
+    return addr;
+}
+
+// 在途的id在(acked, send]之内, 接收方的reci在[acked, send)之内, 按发送方选的字节数截断之后都能还原
+static void test_wire_id_() {
+    for (int t = 0; t < 3000000; t++) {
+        unsigned long long s = test_rand_();
+        unsigned long long acked = s % (1ull << 40);
+        unsigned long long span = 1 + (s >> 40) % (t % 3 == 0 ? 100 : t % 3 == 1 ? 40000 : 3000000000ull);
+        unsigned long long send = acked + span;
+        int code = span < 1ull << 7 ? 0 : span < 1ull << 15 ? 1 : span < 1ull << 31 ? 2 : 3;
+        int bytes = 1 << code;
+        unsigned long long r = test_rand_();
+        unsigned long long id = acked + 1 + r % span;
+        unsigned long long reci = acked + (r >> 20) % span;
+        unsigned long long truncated = bytes == 8 ? id : id & ((1ull << (8 * bytes)) - 1);
+        unsigned long long got = hrpc_wire_id_(truncated, bytes, reci + 1);
+        test_check(got == id, "id %llu acked %llu send %llu reci %llu bytes %d -> %llu", id, acked, send, reci, bytes, got);
+    }
+}
+
+static void test_varint_() {
+    unsigned char buff[16];
+    unsigned long long v;
+    for (int t = 0; t < 1000000; t++) {
+        unsigned long long x = test_rand_() >> (test_rand_() % 64);
+        int n = hrpc_varint_put_(buff, x);
+        test_check(n >= 1 && n <= 10, "varint %llu length %d", x, n);
+        test_check(hrpc_varint_get_(buff, buff + n, &v) == n && v == x, "varint %llu", x);
+        test_check(hrpc_varint_get_(buff, buff + n - 1, &v) == 0, "truncated varint %llu", x);
+    }
+}
+
+static void test_data_v2_(struct hrpc_connection* conn) {
+    static unsigned char wire[k_hrpc_wire_head_v2 + 40 + 1024];
+    for (int t = 0; t < 100000; t++) {
+        conn->acked = test_rand_() % (1ull << 40);
+        unsigned long long span = 1 + test_rand_() % (t % 2 ? 200 : 100000);
+        conn->send = conn->acked + span;
+        conn->reci = conn->acked + test_rand_() % span;
+        struct hrpc_pack pack = {0};
+        pack.id = conn->acked + 1 + test_rand_() % span;
+        pack.nid = conn->nid;
+        pack.connect_time = conn->connect_time;
+        pack.size = 1 + test_rand_() % 100000;
+        pack.raw_size = t % 4 == 0 ? pack.size + test_rand_() % 100000 : 0;
+        int frame_count = get_frame_count(pack.size);
+        int i = test_rand_() % frame_count;
+        int payload_size = i < frame_count - 1 ? 1024 : pack.size - i * 1024;
+        int n = hrpc_wire_data_v2_(wire, conn, &pack, i);
+        memset(wire + n, 0x5a, payload_size);
+
+        struct hrpc_frame frame;
+        const char* payload = 0;
+        unsigned int raw_size = 0;
+        int ok = hrpc_wire_parse_v2_(wire, n + payload_size, &frame, &payload, &raw_size);
+        test_check(ok && frame.type == k_hrpc_frame_data && frame.id == pack.id && frame.size == pack.size && frame.data.pack.i == (unsigned int)i,
+                   "data id %llu size %u i %d -> %llu %u %u", pack.id, pack.size, i, frame.id, frame.size, frame.data.pack.i);
+        test_check(ok && raw_size == pack.raw_size && payload == (const char*)wire + n, "data raw_size %u -> %u", pack.raw_size, raw_size);
+        test_check(!hrpc_wire_parse_v2_(wire, n + payload_size - 1, &frame, &payload, &raw_size), "data short payload");
+    }
+}
+
+static void test_ack_v2_(struct hrpc_connection* conn) {
+    static unsigned char wire[k_hrpc_wire_head_v2 + 10 + 5 + 256 * 5];
+    static struct hrpc_frame frame, parsed;
+    for (int t = 0; t < 10000; t++) {
+        frame.type = k_hrpc_frame_ack;
+        frame.id = test_rand_() >> (test_rand_() % 64);
+        frame.connect_time = conn->connect_time;
+        frame.data.ack.count = test_rand_() % 257;
+        unsigned int p = test_rand_() % 100;
+        for (unsigned int i = 0; i < frame.data.ack.count; i++) {
+            frame.data.ack.recived[i] = p;
+            p += 1 + test_rand_() % (t % 2 ? 3 : 3000);
+        }
+        int n = hrpc_wire_ack_v2_(wire, &frame);
+        const char* payload = 0;
+        unsigned int raw_size = 0;
+        int ok = hrpc_wire_parse_v2_(wire, n, &parsed, &payload, &raw_size);
+        test_check(ok && parsed.type == k_hrpc_frame_ack && parsed.id == frame.id && parsed.data.ack.count == frame.data.ack.count, "ack id %llu count %u", frame.id, frame.data.ack.count);
+        test_check(ok && memcmp(parsed.data.ack.recived, frame.data.ack.recived, frame.data.ack.count * sizeof(unsigned int)) == 0, "ack recived count %u", frame.data.ack.count);
+        if (frame.data.ack.count) {
+            test_check(!hrpc_wire_parse_v2_(wire, n - 1, &parsed, &payload, &raw_size), "ack truncated count %u", frame.data.ack.count);
+        }
+    }
+    const char* payload = 0;
+    unsigned int raw_size = 0;
+    int n = hrpc_wire_ack_v2_(wire, &frame);
+    wire[1] ^= 1;    // 纪元不一致: 旧连接还在路上的帧
+    test_check(!hrpc_wire_parse_v2_(wire, n, &parsed, &payload, &raw_size), "ack stale epoch");
+}
+
+// 心跳的每个字段在固定偏移按小端编码, 不依赖主机字节序
+static void test_heartbeat_() {
+    static struct hrpc_frame frame, parsed;
+    unsigned char wire[sizeof(struct hrpc_frame)];
+    frame.type = k_hrpc_frame_heartbeat;
+    frame.id = 0;
+    frame.nid = 0x01020304;
+    frame.size = 0;
+    frame.connect_time = 0x1122334455667788ll;
+    frame.data.sync.reci = 0x0102030405060708ull;
+    frame.data.sync.send = 0xa1a2a3a4a5a6a7a8ull;
+    int n = hrpc_wire_heartbeat_(wire, &frame);
+    static const unsigned char expect[] = {
+        0, 0, 0, 0, 0, 0, 0, 0,                            // id
+        0x04, 0x03, 0x02, 0x01,                            // nid
+        0, 0, 0, 0,                                        // size
+        0x88, 0x77, 0x66, 0x55, 0x44, 0x33, 0x22, 0x11,    // connect_time
+        2, 0, 0, 0,                                        // type
+        0, 0, 0, 0,                                        // 对齐
+        0x08, 0x07, 0x06, 0x05, 0x04, 0x03, 0x02, 0x01,    // reci
+        0xa8, 0xa7, 0xa6, 0xa5, 0xa4, 0xa3, 0xa2, 0xa1,    // send
+        k_hrpc_wire_v2,                                    // 版本声明
+    };
+    test_check(n == sizeof(expect) && memcmp(wire, expect, sizeof(expect)) == 0, "heartbeat layout");
+    test_check(wire[7] != k_hrpc_wire_v2, "heartbeat mistaken for v2");
+
+    test_check(hrpc_wire_parse_heartbeat_(expect, sizeof(expect), &parsed), "heartbeat parse");
+    test_check(parsed.nid == frame.nid && parsed.connect_time == frame.connect_time && parsed.data.sync.reci == frame.data.sync.reci && parsed.data.sync.send == frame.data.sync.send,
+               "heartbeat fields");
+    test_check((unsigned char)parsed.data.sync._ == k_hrpc_wire_v2, "heartbeat version %d", parsed.data.sync._);
+    // 旧节点的心跳没有版本声明
+    test_check(hrpc_wire_parse_heartbeat_(expect, sizeof(expect) - 1, &parsed) && parsed.data.sync._ == k_hrpc_wire_v1, "old heartbeat");
+    test_check(!hrpc_wire_parse_heartbeat_(expect, sizeof(expect) - 2, &parsed), "short heartbeat");
+    if (k_hrpc_wire_v1_native) {    // 小端机器上和旧节点直接发结构体完全一样
+        frame.data.sync._ = k_hrpc_wire_v2;
+        test_check(memcmp(&frame, expect, sizeof(expect)) == 0, "heartbeat differs from v1 struct");
+    }
+}
+
+// zerocopy完成通知乱序到达, zc_done只推进到连续完成的位置, 序号回绕也一样
+static void test_zc_complete_() {
+    for (int t = 0; t < 1000; t++) {
+        unsigned int base = t % 2 ? test_rand_() : 0u - 500;
+        int count = 1 + test_rand_() % 1000;
+        static unsigned int lo[1000], hi[1000];
+        int n = 0;
+        for (int i = 0; i < count; n++) {    // 切成若干区间之后打乱
+            int len = 1 + test_rand_() % 5;
+            lo[n] = base + i;
+            hi[n] = base + (i + len < count ? i + len : count) - 1;
+            i += len;
+        }
+        for (int i = n - 1; i > 0; i--) {
+            int j = test_rand_() % (i + 1);
+            unsigned int l = lo[i], h = hi[i];
+            lo[i] = lo[j], hi[i] = hi[j];
+            lo[j] = l, hi[j] = h;
+        }
+        self.zc_done = base;
+        self.zc_range_count = 0;
+        int missing = test_rand_() % n;    // 留一个区间最后才完成
+        for (int i = 0; i < n; i++) {
+            if (i != missing) {
+                hrpc_zc_complete_(lo[i], hi[i]);
+                test_check((int)(self.zc_done - lo[missing]) <= 0, "zc_done %u passed missing %u", self.zc_done, lo[missing]);
+            }
+        }
+        hrpc_zc_complete_(lo[missing], hi[missing]);
+        test_check(self.zc_done == base + count && self.zc_range_count == 0, "zc_done %u expect %u ranges %d", self.zc_done, base + count, self.zc_range_count);
+    }
+    self.zc_done = self.zc_sent = 0;
+}
+
+// 内核一直不通知完成时重连不会卡住: 超时之后丢弃这个连接挂起的删除, 其它连接的继续挂起
+static void test_zc_flush_timeout_() {
+    self.zc_done = 0;
+    self.zc_sent = 3;
+    self.zc_range_count = 0;
+    hrpc_send_drop_("/send/7/1", 0);
+    hrpc_send_drop_("/send/77/1", 0);
+    long long start = time_curruent_ms();
+    hrpc_zc_flush_("/send/7/");
+    long long cost = time_curruent_ms() - start;
+    test_check(cost >= k_hrpc_zc_flush_timeout && cost < k_hrpc_zc_flush_timeout + 1000, "zc flush took %lld ms", cost);
+    test_check(self.zc_defer_count == 1 && strcmp(self.zc_defer[0].lo, "/send/77/1") == 0, "zc flush kept %d", self.zc_defer_count);
+    self.zc_done = self.zc_sent = 0;
+    self.zc_defer_count = 0;
+}
+
+static void test_clean_db_() {
+    char path[128];
+    for (int i = 0; i < 8; i++) {
+        snprintf(path, sizeof(path), "%s.%d", k_test_db, i);
+        unlink(path);
+    }
+}
+
+int main() {
+    test_clean_db_();
+    if (!hrpc_init(k_test_db, k_test_nid, 0, test_get_addr_)) {
+        printf("test_wire init fail\n");
+        return 1;
+    }
+    hrpc_touch_connect(k_test_nid);    // 自己连自己: 编码时写的nid就是解析时找的连接
+    struct hrpc_connection* conn = hrpc_connection_get_(k_test_nid);
+    test_check(conn != 0, "connection");
+    if (conn) {
+        test_data_v2_(conn);
+        test_ack_v2_(conn);
+    }
+    test_wire_id_();
+    test_varint_();
+    test_heartbeat_();
+    test_zc_complete_();
+    test_zc_flush_timeout_();
+    test_clean_db_();
+    printf("%s\n", test_failed_ ? "test_wire fail" : "test_wire ok");
+    return test_failed_ ? 1 : 0;
+}